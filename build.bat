@@ -1,2 +1,9 @@
 @ECHO OFF
 clang main.c -o build/btree_test.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic
+clang main.c -o build/btree_test_wide.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_KEY_COUNT=32
+clang main.c -o build/btree_test_unsorted.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_KEY_COUNT=32 -DBT_UNSORTED_LEAVES
+clang main.c -o build/btree_test_radix.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_RADIX_ENGINE
+clang main.c -o build/btree_test_stats.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_ORDER_STATISTICS -DBT_AGGREGATES
+clang main.c -o build/btree_test_region.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_REGION_NODES -DBT_ORDER_STATISTICS
+clang main.c -o build/btree_test_handles.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_COMPACT_HANDLES -DBT_ORDER_STATISTICS
+clang main.c -o build/btree_test_epoch.exe -std=C89 -O0 -g -gcodeview -ansi -pedantic -DBT_EPOCH_RECLAMATION
@@ -1 +1,9 @@
 clang main.c -o build/btree_test -std=C89 -O0 -g -ansi -pedantic
+clang main.c -o build/btree_test_wide -std=C89 -O0 -g -ansi -pedantic -DBT_KEY_COUNT=32
+clang main.c -o build/btree_test_unsorted -std=C89 -O0 -g -ansi -pedantic -DBT_KEY_COUNT=32 -DBT_UNSORTED_LEAVES
+clang main.c -o build/btree_test_radix -std=C89 -O0 -g -ansi -pedantic -DBT_RADIX_ENGINE
+clang main.c -o build/btree_test_stats -std=C89 -O0 -g -ansi -pedantic -DBT_ORDER_STATISTICS -DBT_AGGREGATES
+clang main.c -o build/btree_test_region -std=C89 -O0 -g -ansi -pedantic -DBT_REGION_NODES -DBT_ORDER_STATISTICS
+clang main.c -o build/btree_test_handles -std=C89 -O0 -g -ansi -pedantic -DBT_COMPACT_HANDLES -DBT_ORDER_STATISTICS
+clang main.c -o build/btree_test_hugepage -std=C89 -O0 -g -ansi -pedantic -D_DEFAULT_SOURCE -DBT_HUGEPAGE_NODES
+clang main.c -o build/btree_test_epoch -std=C89 -O0 -g -ansi -pedantic -DBT_EPOCH_RECLAMATION
@@ -14,11 +14,132 @@
 #endif
 
 /*
- * Customize number of keys per node:
+ * Customize number of keys per node, define BT_KEY_COUNT before including to override.
+ * key_count is a byte and 0xFF marks free pool slots, so it has to stay below 255.
  */
-#define BT_KEY_COUNT    (5)
+#ifndef BT_KEY_COUNT
+  #define BT_KEY_COUNT  (5)
+#endif
 #define BT_NODE_COUNT   (BT_KEY_COUNT + 1)
 
+#if (BT_KEY_COUNT) < 3 || (BT_KEY_COUNT) > 254
+#error "BT_KEY_COUNT has to be between 3 and 254"
+#endif
+
+/*
+ * Define BT_ORDER_STATISTICS before including to keep per sub-node key counts in every
+ * node. Enables bt_rank, bt_select and bt_count_range in O(log n).
+ *
+ * Define BT_AGGREGATES before including to keep per sub-node aggregates described by
+ * bt_set_aggregate. Enables bt_aggregate_range in O(log n).
+ *
+ * Define BT_REGION_NODES before including to allocate nodes from tree-owned slabs.
+ * bt_destroy and bt_clear release the slabs without walking the tree, and
+ * bt_clear_detached hands them over to be released later, e.g. on another thread.
+ * bt_compact moves nodes into the slabs in pre-order and releases slabs left empty.
+ *
+ * Define BT_COMPACT_HANDLES before including to keep nodes in tree-owned slabs and link
+ * them with 32-bit handles instead of pointers. Links don't depend on where the slabs
+ * live, so a node is smaller and the slabs can be copied or mapped as they are. Implies
+ * BT_REGION_NODES.
+ */
+#if defined(BT_COMPACT_HANDLES) && !defined(BT_REGION_NODES)
+  #define BT_REGION_NODES
+#endif
+
+/*
+ * Define BT_HUGEPAGE_NODES before including to get bt_hugepage_allocator (Linux only),
+ * which places nodes and node slabs in BT_HUGEPAGE_REGION_SIZE regions backed by
+ * hugepages and optionally bound to or interleaved across NUMA nodes. With -std=c89 it
+ * needs _DEFAULT_SOURCE for mmap and syscall.
+ */
+#define BT_HUGEPAGE_REGION_SIZE   (2 * 1024 * 1024)
+
+/*
+ * Define BT_EPOCH_RECLAMATION before including to retire nodes instead of freeing them
+ * while a thread record is attached with bt_epoch_attach. Retired nodes are freed once
+ * every registered thread has left the critical sections that could still see them.
+ * Needs GCC or Clang atomic builtins, doesn't work together with BT_REGION_NODES.
+ */
+#define BT_EPOCH_LIMBO_COUNT   (256)
+
+#if defined(BT_EPOCH_RECLAMATION) && defined(BT_REGION_NODES)
+#error "BT_EPOCH_RECLAMATION can't be used with slab nodes"
+#endif
+
+/*
+ * Define BT_RADIX_ENGINE before including to get bt_create_engine, which can back a tree
+ * with an adaptive radix tree over the bytes of the id instead of B-tree nodes. Search,
+ * insert, delete, visits and cursors behave the same with either engine. Operations that
+ * work on B-tree nodes directly (split, join, key cache, aggregates, order statistics)
+ * are denied or see an empty tree.
+ */
+
+/*
+ * Define BT_UNSORTED_LEAVES before including to append keys at the end of a leaf instead
+ * of shifting the keys after them. Every appended key gets a 1-byte fingerprint that point
+ * lookups scan, with SSE2 where available. Anything that needs ordered leaves first sorts
+ * the leaves appended to since, at most BT_UNSORTED_LEAF_COUNT of them, so keys returned
+ * earlier can move on ordered reads like bt_min or a cursor seek. Only pays off with
+ * wide nodes, so it needs BT_KEY_COUNT of at least 16, and doesn't work together with
+ * BT_AGGREGATES, which combines the keys of a leaf in order.
+ */
+#define BT_UNSORTED_LEAF_COUNT   (64)
+#define BT_FINGERPRINT_COUNT     (((BT_KEY_COUNT) + 15) / 16 * 16)
+
+#if defined(BT_UNSORTED_LEAVES) && (BT_KEY_COUNT) < 16
+#error "BT_UNSORTED_LEAVES needs BT_KEY_COUNT of at least 16"
+#endif
+
+#if defined(BT_UNSORTED_LEAVES) && defined(BT_AGGREGATES)
+#error "BT_UNSORTED_LEAVES can't be used with BT_AGGREGATES"
+#endif
+
+/*
+ * Customize slabs used by BT_REGION_NODES, nodes per slab is a power of two:
+ */
+#define BT_POOL_CHUNK_SHIFT   (10)
+#define BT_POOL_CHUNK_NODES   (1 << BT_POOL_CHUNK_SHIFT)
+
+/*
+ * Customize node cache refilled and drained by the batch callbacks of BT_Allocator:
+ */
+#define BT_NODE_CACHE_COUNT   (16)
+
+/*
+ * Customize Bloom filter enabled by bt_bloom_enable:
+ */
+#define BT_BLOOM_BLOCK_WORDS   (8)
+#define BT_BLOOM_BITS_PER_KEY  (10)
+#define BT_BLOOM_MIN_REBUILD   (64)
+
+/*
+ * Customize frozen index built by bt_freeze, ids per block (one 64-byte cache line):
+ */
+#define BT_FROZEN_BLOCK   (8)
+
+/*
+ * Customize sharded front-end, most shards per BT_Sharded and how much busier than its
+ * neighbour a shard has to be before bt_sharded_rebalance moves keys over:
+ */
+#define BT_SHARD_MAX_COUNT         (64)
+#define BT_SHARD_REBALANCE_RATIO   (2)
+
+/*
+ * Customize lookups kept in flight by bt_search_batch:
+ */
+#define BT_SEARCH_BATCH_WIDTH   (8)
+
+/*
+ * Customize in-node search picked by bt_set_node_search. Interpolation is only tried in
+ * nodes with at least BT_INTERPOLATION_MIN_KEYS keys and walks up to
+ * BT_INTERPOLATION_PROBE keys from its guess before binary search takes over.
+ * BT_NODE_SEARCH_Auto reconsiders every BT_NODE_SEARCH_WINDOW node searches.
+ */
+#define BT_INTERPOLATION_MIN_KEYS   (8)
+#define BT_INTERPOLATION_PROBE      (2)
+#define BT_NODE_SEARCH_WINDOW       (1024)
+
 #ifndef BT_CUSTOM_DATA_TYPES
 
 typedef unsigned char  bt_u08;
@@ -49,6 +170,19 @@ typedef bt_u64 BT_KeyID;
   #define bt_memset memset
 #endif
 
+#ifndef bt_memmove
+  #include <string.h>
+  #define bt_memmove memmove
+#endif
+
+#ifndef bt_prefetch
+  #if defined(__GNUC__) || defined(__clang__)
+    #define bt_prefetch(ptr) __builtin_prefetch(ptr)
+  #else
+    #define bt_prefetch(ptr) ((void)(ptr))
+  #endif
+#endif
+
 #ifndef bt_malloc
   #include <stdlib.h>
   #define bt_malloc(size, ud) ((void)ud,malloc(size))
@@ -80,9 +214,65 @@ typedef bt_u64 BT_KeyID;
 
 #define BT_COUNTOF(x)                   (sizeof(x)/sizeof((x)[0]))
 
+/* NOTE(nick): 64-bit constant put together from 32-bit halves, C89 has no long long
+ * literals. */
+#define BT_U64_CONST(hi, lo)            (((bt_u64)(hi) << 32) | (bt_u64)(lo))
+
 #define BT_VISIT_KEYS_SIG(name) bt_bool name(void *user_context, BT_KeyID id, const void *data)
 typedef BT_VISIT_KEYS_SIG(bt_visit_keys_sig);
 
+/* NOTE(nick): Called by bt_update with the current data of the key (found == bt_true) or
+ * NULL when the key doesn't exist yet (found == bt_false). Returned pointer is stored as
+ * the new data of the key. */
+#define BT_UPDATE_SIG(name) const void *name(void *user_context, BT_KeyID id, const void *data, bt_bool found)
+typedef BT_UPDATE_SIG(bt_update_sig);
+
+/* NOTE(nick): Memory callbacks of BT_Allocator. Alignment is a power of two, 0 asks for
+ * nothing beyond what malloc gives. Free gets the size and alignment of the allocation. */
+#define BT_MALLOC_SIG(name) void *name(void *context, bt_u64 size, bt_u64 alignment)
+typedef BT_MALLOC_SIG(bt_malloc_sig);
+
+#define BT_FREE_SIG(name) void name(void *context, void *ptr, bt_u64 size, bt_u64 alignment)
+typedef BT_FREE_SIG(bt_free_sig);
+
+#define BT_REALLOC_SIG(name) void *name(void *context, void *ptr, bt_u64 old_size, bt_u64 new_size)
+typedef BT_REALLOC_SIG(bt_realloc_sig);
+
+/* NOTE(nick): Fills ptrs with up to count blocks, returns how many it got. */
+#define BT_MALLOC_BATCH_SIG(name) bt_u32 name(void *context, bt_u64 size, bt_u64 alignment, void **ptrs, bt_u32 count)
+typedef BT_MALLOC_BATCH_SIG(bt_malloc_batch_sig);
+
+#define BT_FREE_BATCH_SIG(name) void name(void *context, void **ptrs, bt_u32 count, bt_u64 size, bt_u64 alignment)
+typedef BT_FREE_BATCH_SIG(bt_free_batch_sig);
+
+/* NOTE(nick): Lock and unlock of a single shard of BT_Sharded. */
+#define BT_LOCK_SIG(name) void name(void *lock_context, bt_u32 shard_index)
+typedef BT_LOCK_SIG(bt_lock_sig);
+
+#if defined(BT_AGGREGATES)
+typedef union BT_AggregateValue {
+  bt_u64 u;
+  bt_s64 s;
+  double f;
+  const void *p;
+} BT_AggregateValue;
+
+/* NOTE(nick): map turns data of a key into an aggregate value, combine has to be
+ * associative and is always called with its arguments in key order. */
+#define BT_AGGREGATE_MAP_SIG(name) BT_AggregateValue name(void *user_context, BT_KeyID id, const void *data)
+typedef BT_AGGREGATE_MAP_SIG(bt_aggregate_map_sig);
+
+#define BT_AGGREGATE_COMBINE_SIG(name) BT_AggregateValue name(void *user_context, BT_AggregateValue a, BT_AggregateValue b)
+typedef BT_AGGREGATE_COMBINE_SIG(bt_aggregate_combine_sig);
+
+typedef struct BT_Aggregate {
+  void *user_context;
+  BT_AggregateValue identity;
+  bt_aggregate_map_sig *map;
+  bt_aggregate_combine_sig *combine;
+} BT_Aggregate;
+#endif
+
 typedef enum {
   BT_ERROR_Ok,
   BT_ERROR_AllocationFailed,
@@ -97,34 +287,490 @@ typedef enum {
   BT_VISIT_NODE_BottomUp
 } BT_VisitNodesMode;
 
+typedef enum {
+  BT_INSERT_Keep,
+  BT_INSERT_Replace,
+  BT_INSERT_Update
+} BT_InsertMode;
+
 typedef struct BT_Key {
   BT_KeyID id;
   void const *data;
 } BT_Key;
 
+/* NOTE(nick): Called by bt_search_batch once per probe, key is NULL when ids[probe_index]
+ * isn't in the tree. Returning bt_false stops the batch. */
+#define BT_SEARCH_RESULT_SIG(name) bt_bool name(void *user_context, bt_u64 probe_index, BT_KeyID id, BT_Key *key)
+typedef BT_SEARCH_RESULT_SIG(bt_search_result_sig);
+
+#if defined(BT_COMPACT_HANDLES)
+/* NOTE(nick): Slab index of a node plus one, 0 is the null handle. Plain unsigned int,
+ * bt_u32 is a long and takes 8 bytes on LP64 targets. */
+typedef unsigned int BT_NodeHandle;
+#endif
+
+/* NOTE(nick): With BT_UNSORTED_LEAVES the last unsorted_count keys of a leaf were appended
+ * out of order and fingerprints holds a byte of the hash of each of them. Every other node
+ * has unsorted_count of zero. */
 typedef struct BT_Node {
   bt_u08 key_count;
+#if defined(BT_UNSORTED_LEAVES)
+  bt_u08 unsorted_count;
+#endif
+  bt_u16 free_count;
+#if defined(BT_COMPACT_HANDLES)
+  BT_NodeHandle handle;
+#endif
+#if defined(BT_UNSORTED_LEAVES)
+  bt_u08 fingerprints[BT_FINGERPRINT_COUNT];
+#endif
   BT_Key keys[BT_KEY_COUNT];
+#if defined(BT_COMPACT_HANDLES)
+  BT_NodeHandle subs[BT_NODE_COUNT];
+#else
   struct BT_Node *subs[BT_NODE_COUNT];
+#endif
+#if defined(BT_ORDER_STATISTICS)
+  bt_u64 counts[BT_NODE_COUNT];
+#endif
+#if defined(BT_AGGREGATES)
+  BT_AggregateValue aggregates[BT_NODE_COUNT];
+#endif
 } BT_Node;
 
+#if defined(BT_RADIX_ENGINE)
+typedef enum {
+  BT_ENGINE_BTree,
+  BT_ENGINE_Radix
+} BT_Engine;
+
+typedef enum {
+  BT_RADIX_Leaf,
+  BT_RADIX_Node4,
+  BT_RADIX_Node16,
+  BT_RADIX_Node48,
+  BT_RADIX_Node256
+} BT_RadixKind;
+
+/* NOTE(nick): Header of every radix node. An inner node at byte depth d has
+ * prefix_length bytes of the id starting at d in common for all of its keys and branches
+ * on the byte after them. Ids are 8 bytes, so the prefix always fits in full. */
+typedef struct BT_RadixNode {
+  bt_u08 kind;
+  bt_u08 prefix_length;
+  bt_u16 child_count;
+  bt_u08 prefix[8];
+} BT_RadixNode;
+
+typedef struct BT_RadixLeaf {
+  BT_RadixNode header;
+  BT_Key key;
+} BT_RadixLeaf;
+
+/* NOTE(nick): Node4 and Node16 keep sorted bytes next to their children, Node48 maps a
+ * byte to the slot of its child plus one and Node256 is indexed by the byte. */
+typedef struct BT_RadixNode4 {
+  BT_RadixNode header;
+  bt_u08 bytes[4];
+  BT_RadixNode *children[4];
+} BT_RadixNode4;
+
+typedef struct BT_RadixNode16 {
+  BT_RadixNode header;
+  bt_u08 bytes[16];
+  BT_RadixNode *children[16];
+} BT_RadixNode16;
+
+typedef struct BT_RadixNode48 {
+  BT_RadixNode header;
+  bt_u08 slots[256];
+  BT_RadixNode *children[48];
+} BT_RadixNode48;
+
+typedef struct BT_RadixNode256 {
+  BT_RadixNode header;
+  BT_RadixNode *children[256];
+} BT_RadixNode256;
+#endif
+
 typedef struct BT_StackFrame {
   bt_u08 key_index;
   BT_Node *node;
   struct BT_StackFrame *next;
 } BT_StackFrame;
 
+/* NOTE(nick): Deepest path a cursor can hold. Every node has at least two sub-nodes, so
+ * this is enough for any tree that fits into a 64-bit address space. */
+#define BT_MAX_DEPTH (64)
+
+typedef enum {
+  BT_SEEK_GreaterEqual,
+  BT_SEEK_Greater,
+  BT_SEEK_LessEqual,
+  BT_SEEK_Less
+} BT_SeekMode;
+
+typedef struct BT_BloomStats {
+  bt_u64 lookups;
+  bt_u64 filtered;
+  bt_u64 false_positives;
+  bt_u64 rebuilds;
+} BT_BloomStats;
+
+/* NOTE(nick): Blocked Bloom filter in front of bt_search. Every key sets bits within a
+ * single cache-line sized block, so a negative lookup touches one cache line. */
+typedef struct BT_Bloom {
+  bt_u64 *blocks;
+  bt_u64 block_count;
+  bt_u64 key_capacity;
+  bt_u64 key_count;
+  bt_u64 delete_count;
+  BT_BloomStats stats;
+} BT_Bloom;
+
+typedef struct BT_KeyCacheStats {
+  bt_u64 hits;
+  bt_u64 misses;
+} BT_KeyCacheStats;
+
+typedef struct BT_KeyCacheEntry {
+  BT_KeyID id;
+  struct BT_Node *node;
+  bt_u64 free_epoch;
+  bt_u32 key_index;
+  bt_u16 free_count;
+} BT_KeyCacheEntry;
+
+/* NOTE(nick): Direct-mapped cache of recent bt_search results. An entry remembers the node
+ * and slot a key was found in. Freeing a node bumps its free_count, which only stales the
+ * entries pointing at that node. Node memory can't go back to the allocator without
+ * free_epoch moving on, so an entry from the current epoch points at memory the tree still
+ * owns, and it's right as long as free_count matches and the slot holds the same id. */
+typedef struct BT_KeyCache {
+  BT_KeyCacheEntry *entries;
+  bt_u32 entry_shift;
+  bt_u64 entry_count;
+  bt_u64 free_epoch;
+  BT_KeyCacheStats stats;
+} BT_KeyCache;
+
+typedef enum {
+  BT_NODE_SEARCH_Binary,
+  BT_NODE_SEARCH_Interpolation,
+  BT_NODE_SEARCH_Auto
+} BT_NodeSearch;
+
+typedef struct BT_NodeSearchStats {
+  bt_u64 guesses;
+  bt_u64 fallbacks;
+} BT_NodeSearchStats;
+
+/* NOTE(nick): How lookups find their slot within a node. Auto keeps interpolating while
+ * at most a quarter of the guesses of a window fall back to binary search, otherwise it
+ * stays on binary search for a window and tries again. */
+typedef struct BT_NodeSearchState {
+  BT_NodeSearch mode;
+  bt_bool interpolate;
+  bt_u32 window;
+  bt_u32 window_guesses;
+  bt_u32 window_fallbacks;
+  BT_NodeSearchStats stats;
+} BT_NodeSearchState;
+
+typedef enum {
+  BT_MESSAGE_Insert,
+  BT_MESSAGE_Upsert,
+  BT_MESSAGE_Delete
+} BT_MessageKind;
+
+typedef struct BT_Message {
+  BT_Key key;
+  BT_MessageKind kind;
+} BT_Message;
+
+/* NOTE(nick): Writes enabled by bt_write_buffer_enable land in a sorted message buffer
+ * in front of the root and get applied in key order once the buffer fills up. There is a
+ * single buffer for the whole tree, not one per internal node, and every message still
+ * descends from the root when it is applied. bt_search reads through the buffer, every
+ * other read applies it first and so modifies the tree. */
+typedef struct BT_WriteBuffer {
+  BT_Message *messages;
+  bt_u32 count;
+  bt_u32 capacity;
+  bt_bool flushing;
+} BT_WriteBuffer;
+
+/* NOTE(nick): Memory policy of a tree, copied into it by bt_create. alloc_memory and
+ * free_memory are required, the rest is optional:
+ * - realloc_memory grows unaligned blocks in place of alloc + copy + free.
+ * - alloc_batch and free_batch get the alloc and free contexts. With either of them set,
+ *   nodes go through a per-tree cache of BT_NODE_CACHE_COUNT that is refilled and
+ *   drained half a cache at a time.
+ * - node_alignment applies to every node, or to the start of every slab with
+ *   BT_REGION_NODES. 0 for none. */
+typedef struct BT_Allocator {
+  void *alloc_memory_context;
+  bt_malloc_sig *alloc_memory;
+  void *free_memory_context;
+  bt_free_sig *free_memory;
+  void *realloc_memory_context;
+  bt_realloc_sig *realloc_memory;
+  bt_malloc_batch_sig *alloc_batch;
+  bt_free_batch_sig *free_batch;
+  bt_u64 node_alignment;
+} BT_Allocator;
+
+#if defined(BT_EPOCH_RECLAMATION)
+typedef struct BT_EpochRetired {
+  void *ptr;
+  bt_u64 epoch;
+  bt_free_sig *free_memory;
+  void *free_memory_context;
+  bt_u64 size;
+  bt_u64 alignment;
+} BT_EpochRetired;
+
+/* NOTE(nick): Takes what doesn't fit into the limbo list of a thread while readers hold the
+ * epoch back. Allocated with the allocator of the tree whose node overflowed. */
+typedef struct BT_EpochLimbo {
+  struct BT_EpochLimbo *next;
+  bt_free_sig *free_memory;
+  void *free_memory_context;
+  bt_u32 retired_count;
+  BT_EpochRetired retired[BT_EPOCH_LIMBO_COUNT];
+} BT_EpochLimbo;
+
+/* NOTE(nick): One per thread. state is (epoch << 1) | 1 inside a critical section and 0
+ * outside, only its owner writes it. retired is the limbo list of the thread, ordered by
+ * the epoch nodes were retired in, and continues in the overflow blocks, oldest first. */
+typedef struct BT_EpochThread {
+  struct BT_Epoch *epoch;
+  struct BT_EpochThread *next;
+  bt_u64 state;
+  bt_u32 retired_count;
+  BT_EpochRetired retired[BT_EPOCH_LIMBO_COUNT];
+  BT_EpochLimbo *overflow;
+  BT_EpochLimbo *overflow_last;
+} BT_EpochThread;
+
+typedef struct BT_Epoch {
+  bt_u64 global_epoch;
+  BT_EpochThread *threads;
+} BT_Epoch;
+#endif
+
+#if defined(BT_HUGEPAGE_NODES)
+typedef enum {
+  BT_HUGEPAGE_Transparent,
+  BT_HUGEPAGE_HugeTLB
+} BT_HugepageMode;
+
+typedef enum {
+  BT_NUMA_Local,
+  BT_NUMA_Bind,
+  BT_NUMA_Interleave,
+  BT_NUMA_Preferred
+} BT_NumaPolicy;
+
+/* NOTE(nick): Regions are chained through their first cache line, nodes and slabs are
+ * carved out of the newest one. Freed blocks are kept for reuse, memory goes back to the
+ * system only in bt_hugepage_heap_release. Can be shared by trees used from one thread. */
+typedef struct BT_HugepageHeap {
+  BT_HugepageMode mode;
+  BT_NumaPolicy numa_policy;
+  bt_u64 numa_node_mask;
+  bt_u08 *regions;
+  bt_u64 region_count;
+  bt_u08 *cursor;
+  bt_u64 remaining;
+  void *node_free_list;
+  void *slab_free_list;
+} BT_HugepageHeap;
+#endif
+
+#if defined(BT_REGION_NODES)
+/* NOTE(nick): Slabs of BT_POOL_CHUNK_NODES nodes each. Freed nodes are doubly linked
+ * through their first two sub-node links and marked with BT_POOL_FREE_MARK in key_count,
+ * so bt_compact can take any of them off the list. */
+typedef struct BT_NodePool {
+  BT_Node **chunks;
+  bt_u32 chunk_count;
+  bt_u32 chunk_capacity;
+  bt_u32 used_count;
+#if defined(BT_COMPACT_HANDLES)
+  BT_NodeHandle free_list;
+#else
+  BT_Node *free_list;
+#endif
+} BT_NodePool;
+
+/* NOTE(nick): Slabs taken out of a tree by bt_clear_detached. Owns them until
+ * bt_region_release, which doesn't touch the tree and can run on any thread. */
+typedef struct BT_NodeRegion {
+  BT_Allocator allocator;
+  BT_Node **chunks;
+  bt_u32 chunk_count;
+  bt_u32 chunk_capacity;
+} BT_NodeRegion;
+
+#define BT_POOL_FREE_MARK (0xFF)
+#endif
+
+/* NOTE(nick): Where bt_compact stopped. The pass has handled every key below resume_id,
+ * next_slot is the pool slot the next node in pre-order goes to. Once every node is in
+ * place the pass trims free slots off the end of the pool. */
+typedef struct BT_CompactState {
+  BT_KeyID resume_id;
+#if defined(BT_REGION_NODES)
+  bt_u32 next_slot;
+  bt_bool trimming;
+#endif
+} BT_CompactState;
+
 typedef struct BT_Context {
-  void *malloc_ud;
+  BT_Allocator allocator;
   bt_u32 value_size;
   bt_u32 frames_count;
   bt_u32 frames_max;
   BT_StackFrame *frames;
   BT_Node *root;
+  BT_Node *min_leaf;
+  BT_Node *max_leaf;
+  BT_Bloom bloom;
+  BT_KeyCache key_cache;
+  BT_NodeSearchState node_search;
+  BT_WriteBuffer write_buffer;
+  BT_CompactState compact;
+#if defined(BT_AGGREGATES)
+  BT_Aggregate aggregate;
+#endif
+#if defined(BT_REGION_NODES)
+  BT_NodePool pool;
+#else
+  bt_u32 node_cache_count;
+  BT_Node *node_cache[BT_NODE_CACHE_COUNT];
+#endif
+#if defined(BT_EPOCH_RECLAMATION)
+  BT_EpochThread *epoch_thread;
+#endif
+#if defined(BT_RADIX_ENGINE)
+  BT_Engine engine;
+  BT_RadixNode *radix_root;
+#endif
+#if defined(BT_UNSORTED_LEAVES)
+  bt_u32 unsorted_leaf_count;
+  BT_Node *unsorted_leaves[BT_UNSORTED_LEAF_COUNT];
+#endif
 } BT_Context;
 
+/* NOTE(nick): Path from the root to the current key. The last frame points at the key,
+ * frames above it hold the index of the sub-node that was descended into. Cursor stays
+ * valid until the tree is modified. A cursor of a radix tree only holds the current key
+ * in radix_key, depth is 1 while there is one. */
+typedef struct BT_Cursor {
+  BT_Context *tree;
+  bt_u32 depth;
+  BT_StackFrame frames[BT_MAX_DEPTH];
+#if defined(BT_RADIX_ENGINE)
+  BT_Key *radix_key;
+#endif
+} BT_Cursor;
+
+/* NOTE(nick): Read-only copy of a tree made by bt_freeze. Ids are stored in full blocks of
+ * an implicit B+ tree: layer 0 holds every id in key order, the layers above hold
+ * separators and children of block k are blocks k * (BT_FROZEN_BLOCK + 1) + i of the layer
+ * below. Ids and data share a single allocation and there are no pointers between blocks.
+ * Positions returned by lookups are indices into key order.
+ *
+ * bt_freeze_packed stores layer 0 in leaves instead of ids: every block is the first id
+ * of the block followed by BT_FROZEN_BLOCK offsets from it, delta_size bytes each.
+ *
+ * Only frozen copies are packed. Nodes of a live tree keep full BT_Keys, lookups hand out
+ * pointers to them and every node has the same size, so a packed leaf would neither
+ * have a BT_Key to point at nor take less memory. */
+typedef struct BT_Frozen {
+  BT_Allocator allocator;
+  void *memory;
+  bt_u64 memory_size;
+  BT_KeyID *ids;
+  bt_u08 *leaves;
+  bt_u32 delta_size;
+  const void **data;
+  bt_u64 key_count;
+  bt_u32 layer_count;
+  bt_u64 layer_offsets[BT_MAX_DEPTH];
+} BT_Frozen;
+
+/* NOTE(nick): Shard i holds ids from id_min of shard i up to id_min of shard i + 1. A
+ * boundary is only moved with the shards on both sides of it locked, so holding the lock
+ * of a shard keeps its range fixed. load counts operations since the last rebalance. */
+typedef struct BT_Shard {
+  BT_Context tree;
+  BT_KeyID id_min;
+  bt_u64 load;
+} BT_Shard;
+
+typedef struct BT_Sharded {
+  void *lock_context;
+  bt_lock_sig *lock;
+  bt_lock_sig *unlock;
+  bt_u32 shard_count;
+  BT_Shard shards[BT_SHARD_MAX_COUNT];
+} BT_Sharded;
+
+/* NOTE(nick): Holds the lock of the shard it's in, keys it returns stay valid until it
+ * moves to another shard, reaches the end or gets closed. */
+typedef struct BT_ShardedCursor {
+  BT_Sharded *sharded;
+  bt_u32 shard_index;
+  BT_KeyID last_id;
+  BT_Cursor cursor;
+} BT_ShardedCursor;
+
+BT_API BT_Allocator
+bt_default_allocator(void *malloc_ud);
+
+#if defined(BT_HUGEPAGE_NODES)
+BT_API void
+bt_hugepage_heap_init(BT_HugepageHeap *heap, BT_HugepageMode mode, BT_NumaPolicy numa_policy, bt_u64 numa_node_mask);
+
+BT_API void
+bt_hugepage_heap_release(BT_HugepageHeap *heap);
+
+BT_API BT_Allocator
+bt_hugepage_allocator(BT_HugepageHeap *heap);
+#endif
+
 BT_API BT_ErrorCode
-bt_create(BT_Context *tree, bt_u32 value_size, void *malloc_ud);
+bt_create(BT_Context *tree, bt_u32 value_size, const BT_Allocator *allocator);
+
+#if defined(BT_RADIX_ENGINE)
+BT_API BT_ErrorCode
+bt_create_engine(BT_Context *tree, bt_u32 value_size, const BT_Allocator *allocator, BT_Engine engine);
+#endif
+
+#if defined(BT_EPOCH_RECLAMATION)
+BT_API void
+bt_epoch_init(BT_Epoch *epoch);
+
+BT_API void
+bt_epoch_destroy(BT_Epoch *epoch);
+
+BT_API void
+bt_epoch_register(BT_Epoch *epoch, BT_EpochThread *thread);
+
+BT_API void
+bt_epoch_enter(BT_EpochThread *thread);
+
+BT_API void
+bt_epoch_exit(BT_EpochThread *thread);
+
+BT_API bt_u32
+bt_epoch_reclaim(BT_EpochThread *thread);
+
+BT_API void
+bt_epoch_attach(BT_Context *tree, BT_EpochThread *thread);
+#endif
 
 BT_API BT_ErrorCode
 bt_destroy(BT_Context *tree);
@@ -133,14 +779,216 @@ BT_API BT_Key *
 bt_search(BT_Context *tree, BT_KeyID id, bt_bool get_nearest);
 
 BT_API BT_ErrorCode
-bt_insert(BT_Context *tree, BT_KeyID id, const void *data, bt_u32 data_size);
+bt_search_batch(BT_Context *tree, const BT_KeyID *ids, bt_u64 id_count, void *user_context, bt_search_result_sig *result);
+
+BT_API BT_Key *
+bt_lower_bound(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_upper_bound(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_floor(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_ceiling(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_min(BT_Context *tree);
+
+BT_API BT_Key *
+bt_max(BT_Context *tree);
+
+BT_API BT_ErrorCode
+bt_pop_min(BT_Context *tree, BT_Key *key_out);
+
+BT_API BT_ErrorCode
+bt_pop_max(BT_Context *tree, BT_Key *key_out);
+
+BT_API BT_Key *
+bt_cursor_first(BT_Context *tree, BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_cursor_last(BT_Context *tree, BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_cursor_key(BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_cursor_next(BT_Cursor *cursor);
+
+BT_API BT_Key *
+bt_cursor_prev(BT_Cursor *cursor);
+
+#if defined(BT_ORDER_STATISTICS)
+BT_API bt_u64
+bt_rank(BT_Context *tree, BT_KeyID id);
+
+BT_API BT_Key *
+bt_select(BT_Context *tree, bt_u64 rank, BT_Cursor *cursor);
+
+BT_API bt_u64
+bt_count_range(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_max);
+#endif
+
+#if defined(BT_AGGREGATES)
+BT_API BT_ErrorCode
+bt_set_aggregate(BT_Context *tree, const BT_Aggregate *aggregate);
+
+BT_API BT_ErrorCode
+bt_aggregate_range(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_max, BT_AggregateValue *result_out);
+#endif
+
+BT_API BT_ErrorCode
+bt_bloom_enable(BT_Context *tree, bt_u64 expected_key_count);
+
+BT_API void
+bt_bloom_disable(BT_Context *tree);
+
+BT_API BT_ErrorCode
+bt_bloom_rebuild(BT_Context *tree);
+
+BT_API void
+bt_bloom_get_stats(BT_Context *tree, BT_BloomStats *stats_out);
+
+BT_API BT_ErrorCode
+bt_key_cache_enable(BT_Context *tree, bt_u64 entry_count);
+
+BT_API void
+bt_key_cache_disable(BT_Context *tree);
+
+BT_API void
+bt_key_cache_get_stats(BT_Context *tree, BT_KeyCacheStats *stats_out);
+
+BT_API void
+bt_set_node_search(BT_Context *tree, BT_NodeSearch mode);
+
+BT_API void
+bt_node_search_get_stats(BT_Context *tree, BT_NodeSearchStats *stats_out);
+
+BT_API BT_ErrorCode
+bt_write_buffer_enable(BT_Context *tree, bt_u32 capacity);
+
+BT_API BT_ErrorCode
+bt_write_buffer_disable(BT_Context *tree);
+
+BT_API BT_ErrorCode
+bt_flush_writes(BT_Context *tree);
+
+BT_API BT_ErrorCode
+bt_insert(BT_Context *tree, BT_KeyID id, const void *data);
+
+BT_API BT_ErrorCode
+bt_upsert(BT_Context *tree, BT_KeyID id, const void *data);
+
+BT_API BT_ErrorCode
+bt_insert_or_get(BT_Context *tree, BT_KeyID id, const void *data, BT_Key **key_out, bt_bool *inserted_out);
+
+BT_API BT_ErrorCode
+bt_update(BT_Context *tree, BT_KeyID id, void *user_context, bt_update_sig *update);
 
 BT_API BT_ErrorCode
 bt_delete(BT_Context *tree, BT_KeyID id);
 
+BT_API BT_ErrorCode
+bt_delete_range(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_max);
+
+BT_API BT_ErrorCode
+bt_clear(BT_Context *tree);
+
+#if defined(BT_REGION_NODES)
+BT_API BT_ErrorCode
+bt_clear_detached(BT_Context *tree, BT_NodeRegion *region_out);
+
+BT_API void
+bt_region_release(BT_NodeRegion *region);
+#endif
+
+BT_API BT_ErrorCode
+bt_compact(BT_Context *tree, bt_u64 budget, bt_bool *finished_out);
+
+BT_API BT_ErrorCode
+bt_split_at(BT_Context *tree, BT_KeyID id, BT_Context *right);
+
+BT_API BT_ErrorCode
+bt_join(BT_Context *left, BT_Context *right);
+
+BT_API BT_ErrorCode
+bt_clone(BT_Context *src, BT_Context *dst);
+
 BT_API BT_ErrorCode
 bt_visit_keys(BT_Context *tree, BT_VisitNodesMode mode, void *user_context, bt_visit_keys_sig *visit);
 
+BT_API BT_ErrorCode
+bt_intersect(BT_Context *a, BT_Context *b, void *user_context, bt_visit_keys_sig *visit);
+
+BT_API BT_ErrorCode
+bt_union(BT_Context *a, BT_Context *b, void *user_context, bt_visit_keys_sig *visit);
+
+BT_API BT_ErrorCode
+bt_difference(BT_Context *a, BT_Context *b, void *user_context, bt_visit_keys_sig *visit);
+
+BT_API BT_ErrorCode
+bt_freeze(BT_Context *tree, BT_Frozen *frozen);
+
+BT_API BT_ErrorCode
+bt_freeze_packed(BT_Context *tree, BT_Frozen *frozen);
+
+BT_API void
+bt_frozen_destroy(BT_Frozen *frozen);
+
+BT_API bt_u64
+bt_frozen_lower_bound(BT_Frozen *frozen, BT_KeyID id);
+
+BT_API bt_u64
+bt_frozen_upper_bound(BT_Frozen *frozen, BT_KeyID id);
+
+BT_API bt_bool
+bt_frozen_search(BT_Frozen *frozen, BT_KeyID id, const void **data_out);
+
+BT_API BT_KeyID
+bt_frozen_get_id(BT_Frozen *frozen, bt_u64 position);
+
+BT_API const void *
+bt_frozen_get_data(BT_Frozen *frozen, bt_u64 position);
+
+BT_API BT_ErrorCode
+bt_frozen_visit_range(BT_Frozen *frozen, BT_KeyID id_min, BT_KeyID id_max, void *user_context, bt_visit_keys_sig *visit);
+
+BT_API BT_ErrorCode
+bt_sharded_create(BT_Sharded *sharded, bt_u32 shard_count, bt_u32 value_size, const BT_Allocator *allocators,
+                  void *lock_context, bt_lock_sig *lock, bt_lock_sig *unlock);
+
+BT_API void
+bt_sharded_destroy(BT_Sharded *sharded);
+
+BT_API bt_bool
+bt_sharded_search(BT_Sharded *sharded, BT_KeyID id, const void **data_out);
+
+BT_API BT_ErrorCode
+bt_sharded_insert(BT_Sharded *sharded, BT_KeyID id, const void *data);
+
+BT_API BT_ErrorCode
+bt_sharded_upsert(BT_Sharded *sharded, BT_KeyID id, const void *data);
+
+BT_API BT_ErrorCode
+bt_sharded_delete(BT_Sharded *sharded, BT_KeyID id);
+
+BT_API BT_Key *
+bt_sharded_cursor_seek(BT_Sharded *sharded, BT_KeyID id, BT_ShardedCursor *cursor);
+
+BT_API BT_Key *
+bt_sharded_cursor_next(BT_ShardedCursor *cursor);
+
+BT_API BT_Key *
+bt_sharded_cursor_prev(BT_ShardedCursor *cursor);
+
+BT_API void
+bt_sharded_cursor_close(BT_ShardedCursor *cursor);
+
+BT_API BT_ErrorCode
+bt_sharded_rebalance(BT_Sharded *sharded);
+
 /* -------------------------------------------------------------------------------- */
 
 BT_INTERNAL BT_Node *
@@ -174,830 +1022,5963 @@ bt_dump_node_keys(BT_Node *node);
 
 #ifdef BT_IMPLEMENTATION
 
-BT_INTERNAL BT_Node *
-bt_new_node(BT_Context *tree)
+BT_INTERNAL void *
+bt_alloc_memory(BT_Allocator *allocator, bt_u64 size, bt_u64 alignment)
 {
-  BT_Node *node = (BT_Node *)bt_malloc(sizeof(BT_Node), tree->malloc_ud);
-  if (node != NULL) {
-#if 0
-    bt_u32 i;
-    for (i = 0; i < BT_COUNTOF(node->keys); ++i) {
-      node->keys[i].id = BT_INVALID_ID;
-      node->keys[i].data = 0;
-    }
-#else
-    bt_memset(&node->keys[0], 0, sizeof(node->keys));
-#endif
-    node->key_count = 0;
-    bt_memset(&node->subs[0], 0, sizeof(node->subs));
-  }
-  return node;
+  return allocator->alloc_memory(allocator->alloc_memory_context, size, alignment);
 }
 
 BT_INTERNAL void
-bt_node_set_key(BT_Node *node, bt_u32 key_index, BT_KeyID id, const void *data)
+bt_free_memory(BT_Allocator *allocator, void *ptr, bt_u64 size, bt_u64 alignment)
 {
-  BT_ASSERT(key_index < BT_COUNTOF(node->keys));
-  node->keys[key_index].id = id;
-  node->keys[key_index].data = data;
+  allocator->free_memory(allocator->free_memory_context, ptr, size, alignment);
 }
 
-BT_INTERNAL BT_Key *
-bt_node_get_key(BT_Node *node, bt_u32 key_index)
+#if defined(BT_COMPACT_HANDLES)
+BT_INTERNAL BT_Node *
+bt_pool_resolve(BT_NodePool *pool, BT_NodeHandle handle)
 {
-  BT_ASSERT(key_index < BT_COUNTOF(node->keys));
-  return &node->keys[key_index];
+  bt_u32 index = handle - 1;
+  BT_ASSERT(handle != 0 && (index >> BT_POOL_CHUNK_SHIFT) < pool->chunk_count);
+  return &pool->chunks[index >> BT_POOL_CHUNK_SHIFT][index & (BT_POOL_CHUNK_NODES - 1)];
 }
+#endif
 
-BT_INTERNAL void
-bt_node_invalidate_key(BT_Node *node, bt_u32 key_index)
+#if defined(BT_REGION_NODES)
+BT_INTERNAL BT_Node *
+bt_pool_node(BT_NodePool *pool, bt_u32 index)
 {
-  BT_ASSERT(key_index < BT_COUNTOF(node->keys));
-  bt_node_set_key(node, key_index, BT_INVALID_ID, NULL);
+  return &pool->chunks[index >> BT_POOL_CHUNK_SHIFT][index & (BT_POOL_CHUNK_NODES - 1)];
+}
+
+BT_INTERNAL BT_Node *
+bt_pool_get_link(BT_NodePool *pool, BT_Node *node, bt_u32 link_index)
+{
+#if defined(BT_COMPACT_HANDLES)
+  return (node->subs[link_index] != 0) ? bt_pool_resolve(pool, node->subs[link_index]) : NULL;
+#else
+  (void)pool;
+  return node->subs[link_index];
+#endif
 }
 
 BT_INTERNAL void
-bt_node_add_key(BT_Node *node, BT_KeyID id, const void *data)
+bt_pool_set_link(BT_Node *node, bt_u32 link_index, BT_Node *target)
 {
-  if (node->key_count < BT_COUNTOF(node->keys)) {
-    bt_node_set_key(node, node->key_count, id, data);
-    node->key_count += 1;
-  } else {
-    BT_ASSERT_FAILURE("cannot add key to a full node");
-  }
+#if defined(BT_COMPACT_HANDLES)
+  node->subs[link_index] = (target != NULL) ? target->handle : 0;
+#else
+  node->subs[link_index] = target;
+#endif
+}
+
+BT_INTERNAL BT_Node *
+bt_pool_free_head(BT_NodePool *pool)
+{
+#if defined(BT_COMPACT_HANDLES)
+  return (pool->free_list != 0) ? bt_pool_resolve(pool, pool->free_list) : NULL;
+#else
+  return pool->free_list;
+#endif
 }
 
 BT_INTERNAL void
-bt_node_remove_key(BT_Node *node)
+bt_pool_set_free_head(BT_NodePool *pool, BT_Node *node)
 {
-  if (node->key_count > 0) {
-    bt_node_invalidate_key(node, node->key_count - 1);
-    node->key_count -= 1;
-  } else {
-    BT_ASSERT_FAILURE("no keys to remove from an empty node");
+#if defined(BT_COMPACT_HANDLES)
+  pool->free_list = (node != NULL) ? node->handle : 0;
+#else
+  pool->free_list = node;
+#endif
+}
+
+BT_INTERNAL void
+bt_pool_push_free(BT_NodePool *pool, BT_Node *node)
+{
+  BT_Node *head = bt_pool_free_head(pool);
+
+  node->key_count = BT_POOL_FREE_MARK;
+  bt_pool_set_link(node, 0, head);
+  bt_pool_set_link(node, 1, NULL);
+  if (head != NULL) {
+    bt_pool_set_link(head, 1, node);
   }
+  bt_pool_set_free_head(pool, node);
 }
 
-BT_INTERNAL bt_bool
-bt_node_set_sub(BT_Node *node, bt_u32 sub_index, BT_Node *sub)
+BT_INTERNAL void
+bt_pool_unlink_free(BT_NodePool *pool, BT_Node *node)
 {
-  bt_bool result = bt_false;
+  BT_Node *next = bt_pool_get_link(pool, node, 0);
+  BT_Node *prev = bt_pool_get_link(pool, node, 1);
 
-  if (sub_index < BT_COUNTOF(node->subs)) {
-    node->subs[sub_index] = sub;
-    result = bt_true;
+  if (prev != NULL) {
+    bt_pool_set_link(prev, 0, next);
   } else {
-    BT_ASSERT_FAILURE("sub index out of bounds");
+    bt_pool_set_free_head(pool, next);
+  }
+  if (next != NULL) {
+    bt_pool_set_link(next, 1, prev);
   }
-
-  return result;
 }
 
 BT_INTERNAL BT_Node *
-bt_node_get_sub(BT_Node *node, bt_u32 sub_index)
+bt_pool_alloc(BT_Context *tree)
 {
-  BT_Node *result;
+  BT_NodePool *pool = &tree->pool;
+  BT_Node *node;
+  bt_u32 index;
 
-  if (sub_index < BT_COUNTOF(node->subs)) {
-    result = node->subs[sub_index];
-  } else {
-    BT_ASSERT("sub index out of bounds, returning NULL");
-    result = NULL;
+  node = bt_pool_free_head(pool);
+  if (node != NULL) {
+    bt_pool_unlink_free(pool, node);
+    return node;
   }
 
-  return result;
+  if (pool->used_count == pool->chunk_count * BT_POOL_CHUNK_NODES) {
+    BT_Node *chunk;
+
+    /* NOTE(nick): Handle 0 is reserved, so the last slot of the 32-bit range stays unused. */
+    if ((bt_u64)(pool->chunk_count + 1) * BT_POOL_CHUNK_NODES > (bt_u64)0xFFFFFFFF) {
+      return NULL;
+    }
+
+    if (pool->chunk_count == pool->chunk_capacity) {
+      bt_u32 chunk_capacity = (pool->chunk_capacity == 0) ? 16 : pool->chunk_capacity * 2;
+      BT_Node **chunks = (BT_Node **)bt_alloc_memory(&tree->allocator, chunk_capacity * sizeof(BT_Node *), 0);
+      if (chunks == NULL) {
+        return NULL;
+      }
+      if (pool->chunks != NULL) {
+        bt_memcpy(chunks, pool->chunks, pool->chunk_count * sizeof(BT_Node *));
+        bt_free_memory(&tree->allocator, pool->chunks, pool->chunk_capacity * sizeof(BT_Node *), 0);
+      }
+      pool->chunks = chunks;
+      pool->chunk_capacity = chunk_capacity;
+    }
+
+    chunk = (BT_Node *)bt_alloc_memory(&tree->allocator, BT_POOL_CHUNK_NODES * sizeof(BT_Node), tree->allocator.node_alignment);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    pool->chunks[pool->chunk_count] = chunk;
+    pool->chunk_count += 1;
+  }
+
+  index = pool->used_count;
+  pool->used_count += 1;
+  node = bt_pool_node(pool, index);
+#if defined(BT_COMPACT_HANDLES)
+  node->handle = index + 1;
+#endif
+
+  return node;
 }
 
-BT_INTERNAL bt_bool
-bt_is_node_leaf(BT_Node *node)
+BT_API void
+bt_region_release(BT_NodeRegion *region)
 {
   bt_u32 i;
-  for (i = 0; i < BT_COUNTOF(node->subs); ++i) {
-    if (node->subs[i] != 0) {
-      return bt_false;
-    }
+
+  for (i = 0; i < region->chunk_count; ++i) {
+    bt_free_memory(&region->allocator, region->chunks[i], BT_POOL_CHUNK_NODES * sizeof(BT_Node), region->allocator.node_alignment);
   }
-  return bt_true;
+  if (region->chunks != NULL) {
+    bt_free_memory(&region->allocator, region->chunks, region->chunk_capacity * sizeof(BT_Node *), 0);
+  }
+  bt_memset(region, 0, sizeof(*region));
 }
 
 BT_INTERNAL void
-bt_shift_keys_left(BT_Node *node, bt_u32 key_index)
+bt_pool_detach(BT_Context *tree, BT_NodeRegion *region_out)
 {
-  bt_u32 i;
-  BT_ASSERT(node->key_count > 0);
-  for (i = key_index; i < node->key_count - 1; ++i) {
-    BT_Key *key;
+  region_out->allocator = tree->allocator;
+  region_out->chunks = tree->pool.chunks;
+  region_out->chunk_count = tree->pool.chunk_count;
+  region_out->chunk_capacity = tree->pool.chunk_capacity;
+  bt_memset(&tree->pool, 0, sizeof(tree->pool));
+}
 
-    key = bt_node_get_key(node, i + 1);
-    bt_node_set_key(node, i, key->id, key->data);
-    bt_node_invalidate_key(node, i + 1);
-  }
+BT_INTERNAL void
+bt_pool_release(BT_Context *tree)
+{
+  BT_NodeRegion region;
+
+  bt_pool_detach(tree, &region);
+  bt_region_release(&region);
 }
+#endif
 
+#if !defined(BT_REGION_NODES)
+/* NOTE(nick): Gives back every cached node past keep_count. */
 BT_INTERNAL void
-bt_shift_keys_right(BT_Node *node, bt_u32 start_key)
+bt_node_cache_drain(BT_Context *tree, bt_u32 keep_count)
 {
-  bt_s32 i;
-  for (i = BT_COUNTOF(node->keys) - 2; i >= 0; --i) {
-    BT_Key *key;
+  BT_Allocator *allocator = &tree->allocator;
 
-    if (i < (bt_u32)start_key) {
-      break;
+  if (tree->node_cache_count <= keep_count) {
+    return;
+  }
+  tree->key_cache.free_epoch += 1;
+  if (allocator->free_batch != NULL) {
+    allocator->free_batch(allocator->free_memory_context, (void **)&tree->node_cache[keep_count],
+                          tree->node_cache_count - keep_count, sizeof(BT_Node), allocator->node_alignment);
+  } else {
+    bt_u32 i;
+    for (i = keep_count; i < tree->node_cache_count; ++i) {
+      bt_free_memory(allocator, tree->node_cache[i], sizeof(BT_Node), allocator->node_alignment);
     }
-    key = bt_node_get_key(node, i);
-    bt_node_set_key(node, i + 1, key->id, key->data);
-    bt_node_invalidate_key(node, i);
   }
+  tree->node_cache_count = keep_count;
 }
 
-BT_INTERNAL void
-bt_shift_subs_left(BT_Node *node, bt_u32 key_index)
+BT_INTERNAL BT_Node *
+bt_node_cache_alloc(BT_Context *tree)
 {
-  bt_s32 i;
-  for (i = (bt_s32)key_index; i < (bt_s32)node->key_count; ++i) {
-    BT_Node *sub;
-    sub = bt_node_get_sub(node, i + 1);
-    bt_node_set_sub(node, i, sub);
-    bt_node_set_sub(node, i + 1, NULL);
+  BT_Allocator *allocator = &tree->allocator;
+
+  if (tree->node_cache_count == 0 && allocator->alloc_batch != NULL) {
+    tree->node_cache_count = allocator->alloc_batch(allocator->alloc_memory_context, sizeof(BT_Node), allocator->node_alignment,
+                                                    (void **)&tree->node_cache[0], BT_NODE_CACHE_COUNT / 2);
+    BT_ASSERT(tree->node_cache_count <= BT_NODE_CACHE_COUNT / 2);
   }
-  bt_node_set_sub(node, node->key_count, NULL);
+  if (tree->node_cache_count > 0) {
+    tree->node_cache_count -= 1;
+    return tree->node_cache[tree->node_cache_count];
+  }
+  return (BT_Node *)bt_alloc_memory(allocator, sizeof(BT_Node), allocator->node_alignment);
 }
 
+/* NOTE(nick): With the key cache on, freed nodes are kept even without batch callbacks,
+ * handing one back to the allocator would stale the whole cache. */
 BT_INTERNAL void
-bt_shift_subs_right(BT_Node *node, bt_u32 key_index)
+bt_node_cache_free(BT_Context *tree, BT_Node *node)
 {
-  bt_s32 i;
-  for (i = (bt_s32)node->key_count - 1; i >= (bt_s32)key_index; --i) {
-    BT_Node *sub;
+  BT_Allocator *allocator = &tree->allocator;
 
-    sub = bt_node_get_sub(node, i);
-    bt_node_set_sub(node, i + 1, sub);
-    bt_node_set_sub(node, i, NULL);
+  if (allocator->alloc_batch == NULL && allocator->free_batch == NULL && tree->key_cache.entries == NULL) {
+    bt_free_memory(allocator, node, sizeof(BT_Node), allocator->node_alignment);
+    return;
   }
+  if (tree->node_cache_count == BT_NODE_CACHE_COUNT) {
+    bt_node_cache_drain(tree, BT_NODE_CACHE_COUNT / 2);
+  }
+  tree->node_cache[tree->node_cache_count] = node;
+  tree->node_cache_count += 1;
 }
+#endif
 
-BT_INTERNAL BT_ErrorCode
-bt_push_stack_frame(BT_Context *tree, BT_Node *node, BT_KeyID key_id)
+BT_INTERNAL BT_Node *
+bt_new_node(BT_Context *tree)
 {
-  BT_StackFrame *frame;
-
-  if (tree->frames_max == 0) {
-    tree->frames_count = 0;
-    tree->frames_max = 32;
-    tree->frames = (BT_StackFrame *)bt_malloc(sizeof(BT_StackFrame) * tree->frames_max, tree->malloc_ud);
-    if (tree->frames == NULL) {
-      return BT_ERROR_AllocationFailed;
+#if defined(BT_REGION_NODES)
+  BT_Node *node = bt_pool_alloc(tree);
+#else
+  BT_Node *node = bt_node_cache_alloc(tree);
+#endif
+  if (node != NULL) {
+#if 0
+    bt_u32 i;
+    for (i = 0; i < BT_COUNTOF(node->keys); ++i) {
+      node->keys[i].id = BT_INVALID_ID;
+      node->keys[i].data = 0;
     }
-  }
-
-  if (tree->frames_count >= tree->frames_max) {
-    bt_u32 temp_max = tree->frames_max*2;
-    BT_StackFrame *temp = (BT_StackFrame *)bt_malloc(temp_max*sizeof(BT_StackFrame), tree->malloc_ud);
-    bt_memcpy(temp, tree->frames, tree->frames_count*sizeof(BT_StackFrame));
-    bt_free(tree->frames, tree->malloc_ud);
-    tree->frames_max = temp_max;
-    tree->frames = temp;
-    if (tree->frames == NULL) {
-      return BT_ERROR_AllocationFailed;
+#else
+    bt_memset(&node->keys[0], 0, sizeof(node->keys));
+#endif
+    node->key_count = 0;
+#if defined(BT_UNSORTED_LEAVES)
+    node->unsorted_count = 0;
+#endif
+    bt_memset(&node->subs[0], 0, sizeof(node->subs));
+#if defined(BT_ORDER_STATISTICS)
+    bt_memset(&node->counts[0], 0, sizeof(node->counts));
+#endif
+#if defined(BT_AGGREGATES)
+    {
+      bt_u32 i;
+      for (i = 0; i < BT_COUNTOF(node->aggregates); ++i) {
+        node->aggregates[i] = tree->aggregate.identity;
+      }
     }
+#endif
   }
+  return node;
+}
 
-  tree->frames[tree->frames_count].node = node;
-  tree->frames[tree->frames_count].key_index = key_id;
-  tree->frames_count += 1;
+#if defined(BT_EPOCH_RECLAMATION)
+#if !defined(__GNUC__) && !defined(__clang__)
+#error "BT_EPOCH_RECLAMATION needs GCC or Clang atomic builtins"
+#endif
 
-  return BT_ERROR_Ok;
+BT_API void
+bt_epoch_init(BT_Epoch *epoch)
+{
+  epoch->global_epoch = 1;
+  epoch->threads = NULL;
 }
 
-BT_INTERNAL BT_ErrorCode
-bt_pop_stack_frame(BT_Context *tree, BT_StackFrame *frame_out)
+/* NOTE(nick): Frees everything in every limbo list, no thread may be in a critical section. */
+BT_API void
+bt_epoch_destroy(BT_Epoch *epoch)
 {
-  BT_ErrorCode error_code = BT_ERROR_OpDenied;
+  BT_EpochThread *thread;
+  bt_u32 i;
 
-  if (tree->frames_count > 0) {
-    *frame_out = tree->frames[--tree->frames_count];
-    error_code = BT_ERROR_Ok;
-  }
+  for (thread = epoch->threads; thread != NULL; thread = thread->next) {
+    for (i = 0; i < thread->retired_count; ++i) {
+      BT_EpochRetired *retired = &thread->retired[i];
+      retired->free_memory(retired->free_memory_context, retired->ptr, retired->size, retired->alignment);
+    }
+    thread->retired_count = 0;
+    while (thread->overflow != NULL) {
+      BT_EpochLimbo *limbo = thread->overflow;
 
-  return error_code;
+      for (i = 0; i < limbo->retired_count; ++i) {
+        BT_EpochRetired *retired = &limbo->retired[i];
+        retired->free_memory(retired->free_memory_context, retired->ptr, retired->size, retired->alignment);
+      }
+      thread->overflow = limbo->next;
+      limbo->free_memory(limbo->free_memory_context, limbo, sizeof(BT_EpochLimbo), 0);
+    }
+    thread->overflow_last = NULL;
+  }
+  epoch->threads = NULL;
 }
 
-BT_INTERNAL BT_ErrorCode
-bt_peek_stack_frame(BT_Context *tree, BT_StackFrame *frame_out)
+/* NOTE(nick): Threads are never unregistered, a thread that is done just stays outside of
+ * critical sections. */
+BT_API void
+bt_epoch_register(BT_Epoch *epoch, BT_EpochThread *thread)
 {
-  BT_ErrorCode error_code = BT_ERROR_OpDenied;
-
-  if (tree->frames_count > 0) {
-    *frame_out = tree->frames[tree->frames_count - 1];
-    error_code = BT_ERROR_Ok;
-  }
-
-  return error_code;
+  BT_EpochThread *head;
+
+  thread->epoch = epoch;
+  thread->state = 0;
+  thread->retired_count = 0;
+  thread->overflow = NULL;
+  thread->overflow_last = NULL;
+  do {
+    head = __atomic_load_n(&epoch->threads, __ATOMIC_ACQUIRE);
+    thread->next = head;
+  } while (!__atomic_compare_exchange_n(&epoch->threads, &head, thread, bt_false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-BT_INTERNAL void
-bt_reset_stack(BT_Context *tree)
+/* NOTE(nick): Nodes reached between enter and exit stay allocated until exit. The fence
+ * orders the announcement before the reads of the tree. */
+BT_API void
+bt_epoch_enter(BT_EpochThread *thread)
 {
-  tree->frames_count = 0;
+  bt_u64 global_epoch = __atomic_load_n(&thread->epoch->global_epoch, __ATOMIC_RELAXED);
+  __atomic_store_n(&thread->state, (global_epoch << 1) | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
-BT_API BT_ErrorCode
-bt_create(BT_Context *tree, bt_u32 value_size, void *malloc_ud)
+BT_API void
+bt_epoch_exit(BT_EpochThread *thread)
 {
-  tree->malloc_ud = malloc_ud;
-  tree->value_size = value_size;
-  tree->frames = NULL;
-  tree->frames_count = 0;
-  tree->frames_max = 0;
-  tree->root = NULL;
-  return BT_ERROR_Ok;
+  __atomic_store_n(&thread->state, 0, __ATOMIC_RELEASE);
 }
 
-BT_API BT_ErrorCode
-bt_destroy(BT_Context *tree)
+/* NOTE(nick): Global epoch moves on only when every thread inside a critical section has
+ * seen the current one. */
+BT_INTERNAL void
+bt_epoch_try_advance(BT_Epoch *epoch)
 {
-  BT_Node *node = tree->root;
-
-  while (node != NULL) {
-    if (bt_is_node_leaf(node)) {
-      BT_StackFrame frame;
-
-      bt_free(node, tree->malloc_ud);
-      node = NULL;
-      while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
-        frame.key_index += 1;
-
-        if (frame.key_index > frame.node->key_count) {
-          /* NOTE(nick): Traversed all sub nodes and returned back to the parent node. */
-          bt_free(frame.node, tree->malloc_ud);
-        } else {
-          BT_Node *sub = bt_node_get_sub(frame.node, frame.key_index);
-          if (sub != NULL) {
-            BT_ErrorCode error_code;
-
-            error_code = bt_push_stack_frame(tree, frame.node, frame.key_index);
-            if (error_code != BT_ERROR_Ok) {
-              return error_code;
-            }
+  bt_u64 global_epoch = __atomic_load_n(&epoch->global_epoch, __ATOMIC_SEQ_CST);
+  BT_EpochThread *thread;
 
-            node = sub;
-            BT_ASSERT(node->key_count > 0);
+  for (thread = __atomic_load_n(&epoch->threads, __ATOMIC_ACQUIRE); thread != NULL; thread = thread->next) {
+    bt_u64 state = __atomic_load_n(&thread->state, __ATOMIC_SEQ_CST);
+    if ((state & 1) != 0 && (state >> 1) != global_epoch) {
+      return;
+    }
+  }
+  __atomic_compare_exchange_n(&epoch->global_epoch, &global_epoch, global_epoch + 1, bt_false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
 
-            break;
-          }
-        }
-      }
-    } else {
-      BT_ErrorCode error_code;
+/* NOTE(nick): A node retired in epoch e can't be seen by anyone once the global epoch is
+ * e + 2. Once the limbo list is empty the oldest overflow block is moved into it. Returns
+ * how many nodes are still waiting. */
+BT_API bt_u32
+bt_epoch_reclaim(BT_EpochThread *thread)
+{
+  bt_u64 global_epoch;
+  bt_u32 result;
+  BT_EpochLimbo *limbo;
 
-      /* NOTE(nick): Descending down to a first sub-node */
-      BT_ASSERT(node->key_count > 0);
+  bt_epoch_try_advance(thread->epoch);
+  global_epoch = __atomic_load_n(&thread->epoch->global_epoch, __ATOMIC_ACQUIRE);
+  for (;;) {
+    bt_u32 i;
 
-      error_code = bt_push_stack_frame(tree, node, 0);
-      if (error_code != BT_ERROR_Ok) {
-        return error_code;
-      }
+    for (i = 0; i < thread->retired_count && thread->retired[i].epoch + 2 <= global_epoch; ++i) {
+      BT_EpochRetired *retired = &thread->retired[i];
+      retired->free_memory(retired->free_memory_context, retired->ptr, retired->size, retired->alignment);
+    }
+    if (i > 0) {
+      bt_memmove(&thread->retired[0], &thread->retired[i], (thread->retired_count - i) * sizeof(BT_EpochRetired));
+      thread->retired_count -= i;
+    }
+    if (thread->retired_count != 0 || thread->overflow == NULL) {
+      break;
+    }
 
-      node = bt_node_get_sub(node, 0);
+    limbo = thread->overflow;
+    bt_memcpy(thread->retired, limbo->retired, limbo->retired_count * sizeof(BT_EpochRetired));
+    thread->retired_count = limbo->retired_count;
+    thread->overflow = limbo->next;
+    if (thread->overflow == NULL) {
+      thread->overflow_last = NULL;
     }
+    limbo->free_memory(limbo->free_memory_context, limbo, sizeof(BT_EpochLimbo), 0);
   }
 
-  bt_free(tree->frames, tree->malloc_ud);
-  tree->frames_count = 0;
-  tree->frames_max = 0;
-  tree->frames = NULL;
-
-  tree->root = NULL;
+  result = thread->retired_count;
+  for (limbo = thread->overflow; limbo != NULL; limbo = limbo->next) {
+    result += limbo->retired_count;
+  }
+  return result;
+}
 
-  return BT_ERROR_Ok;
+/* NOTE(nick): Writers attach their own thread record before modifying the tree. Readers
+ * still see nodes being modified in place, only freeing is deferred. */
+BT_API void
+bt_epoch_attach(BT_Context *tree, BT_EpochThread *thread)
+{
+  tree->epoch_thread = thread;
 }
 
-BT_API BT_Key *
-bt_search(BT_Context *tree, BT_KeyID id, bt_bool get_nearest)
+BT_INTERNAL void
+bt_epoch_retire(BT_Context *tree, void *ptr, bt_u64 size)
 {
-  BT_Node *node = tree->root;
-  BT_KeyID nearest_delta = BT_INVALID_ID;
-  BT_Key *nearest_key = 0;
-  while (node) {
-    bt_s32 min, max, mid;
+  BT_EpochThread *thread = tree->epoch_thread;
+  BT_EpochRetired *retired;
 
-    BT_ASSERT(node->key_count > 0);
-    max = node->key_count - 1;
-    min = 0;
-    mid = 0;
-
-    while (min < max) {
-      mid = (max - min + 1) / 2;
-      BT_ASSERT(mid < node->key_count);
-      if (id < node->keys[mid].id) {
-        max = mid - 1;
-      } else if (id > node->keys[mid].id) {
-        min = mid + 1;
-      } else {
-        return &node->keys[mid];
-      }
-    }
+  if (thread->retired_count >= BT_EPOCH_LIMBO_COUNT / 2) {
+    bt_epoch_reclaim(thread);
+  }
 
-    // check for nearest key
-    BT_ASSERT(max < node->key_count);
-    {
-      bt_s64 delta = (bt_s64)id - (bt_s64)node->keys[max].id;
-      if (delta >= 0 && delta <= nearest_delta) {
-        nearest_key = &node->keys[max];
-        nearest_delta = delta;
+  if (thread->overflow == NULL && thread->retired_count < BT_EPOCH_LIMBO_COUNT) {
+    retired = &thread->retired[thread->retired_count];
+    thread->retired_count += 1;
+  } else {
+    BT_EpochLimbo *limbo = thread->overflow_last;
+
+    /* NOTE(nick): Readers hold the epoch back, which includes the writer itself sitting in
+     * a critical section, so waiting for them here could take forever. The list grows by
+     * another block instead. If that can't be allocated either the node is leaked, it can't
+     * be freed while someone may still read it. */
+    if (limbo == NULL || limbo->retired_count == BT_EPOCH_LIMBO_COUNT) {
+      limbo = (BT_EpochLimbo *)bt_alloc_memory(&tree->allocator, sizeof(BT_EpochLimbo), 0);
+      if (limbo == NULL) {
+        return;
       }
+      limbo->next = NULL;
+      limbo->free_memory = tree->allocator.free_memory;
+      limbo->free_memory_context = tree->allocator.free_memory_context;
+      limbo->retired_count = 0;
+      if (thread->overflow_last != NULL) {
+        thread->overflow_last->next = limbo;
+      } else {
+        thread->overflow = limbo;
+      }
+      thread->overflow_last = limbo;
     }
-
-    if (id > node->keys[max].id) {
-      node = node->subs[max + 1];
-    } else if (id < node->keys[max].id) {
-      node = node->subs[max];
-    } else if (id == node->keys[max].id) {
-      return &node->keys[max];
-    }
+    retired = &limbo->retired[limbo->retired_count];
+    limbo->retired_count += 1;
   }
 
-  if (!get_nearest) {
-    nearest_key = NULL;
-  }
-  return nearest_key;
+  retired->ptr = ptr;
+  retired->epoch = __atomic_load_n(&thread->epoch->global_epoch, __ATOMIC_SEQ_CST);
+  retired->free_memory = tree->allocator.free_memory;
+  retired->free_memory_context = tree->allocator.free_memory_context;
+  retired->size = size;
+  retired->alignment = tree->allocator.node_alignment;
 }
+#endif
 
-BT_API BT_ErrorCode
-bt_insert(BT_Context *tree, BT_KeyID id, const void *data)
+/* NOTE(nick): Leftmost and rightmost leaves are cached for bt_min and bt_max. Splits keep
+ * the left half in place, so only a split of the rightmost leaf and freed nodes need to
+ * touch the cache. Anything that moves whole subtrees around drops it. */
+BT_INTERNAL void
+bt_reset_edge_leaves(BT_Context *tree)
+{
+  tree->min_leaf = NULL;
+  tree->max_leaf = NULL;
+}
+
+BT_INTERNAL void
+bt_free_node(BT_Context *tree, BT_Node *node)
+{
+  if (node == tree->min_leaf) {
+    tree->min_leaf = NULL;
+  }
+  if (node == tree->max_leaf) {
+    tree->max_leaf = NULL;
+  }
+  /* NOTE(nick): A wrapped count could match an old entry again. */
+  node->free_count += 1;
+  if (node->free_count == 0) {
+    tree->key_cache.free_epoch += 1;
+  }
+
+#if defined(BT_REGION_NODES)
+  bt_pool_push_free(&tree->pool, node);
+#else
+#if defined(BT_EPOCH_RECLAMATION)
+  if (tree->epoch_thread != NULL) {
+    tree->key_cache.free_epoch += 1;
+    bt_epoch_retire(tree, node, sizeof(BT_Node));
+    return;
+  }
+#endif
+  bt_node_cache_free(tree, node);
+#endif
+}
+
+BT_INTERNAL void
+bt_node_set_key(BT_Node *node, bt_u32 key_index, BT_KeyID id, const void *data)
+{
+  BT_ASSERT(key_index < BT_COUNTOF(node->keys));
+  node->keys[key_index].id = id;
+  node->keys[key_index].data = data;
+}
+
+BT_INTERNAL BT_Key *
+bt_node_get_key(BT_Node *node, bt_u32 key_index)
+{
+  BT_ASSERT(key_index < BT_COUNTOF(node->keys));
+  return &node->keys[key_index];
+}
+
+BT_INTERNAL void
+bt_node_invalidate_key(BT_Node *node, bt_u32 key_index)
+{
+  BT_ASSERT(key_index < BT_COUNTOF(node->keys));
+  bt_node_set_key(node, key_index, BT_INVALID_ID, NULL);
+}
+
+BT_INTERNAL void
+bt_node_add_key(BT_Node *node, BT_KeyID id, const void *data)
+{
+  if (node->key_count < BT_COUNTOF(node->keys)) {
+    bt_node_set_key(node, node->key_count, id, data);
+    node->key_count += 1;
+  } else {
+    BT_ASSERT_FAILURE("cannot add key to a full node");
+  }
+}
+
+BT_INTERNAL void
+bt_node_remove_key(BT_Node *node)
+{
+  if (node->key_count > 0) {
+    bt_node_invalidate_key(node, node->key_count - 1);
+    node->key_count -= 1;
+  } else {
+    BT_ASSERT_FAILURE("no keys to remove from an empty node");
+  }
+}
+
+BT_INTERNAL bt_bool
+bt_node_set_sub(BT_Context *tree, BT_Node *node, bt_u32 sub_index, BT_Node *sub)
+{
+  bt_bool result = bt_false;
+
+  (void)tree;
+  if (sub_index < BT_COUNTOF(node->subs)) {
+#if defined(BT_COMPACT_HANDLES)
+    node->subs[sub_index] = (sub != NULL) ? sub->handle : 0;
+#else
+    node->subs[sub_index] = sub;
+#endif
+    result = bt_true;
+  } else {
+    BT_ASSERT_FAILURE("sub index out of bounds");
+  }
+
+  return result;
+}
+
+BT_INTERNAL BT_Node *
+bt_node_get_sub(BT_Context *tree, BT_Node *node, bt_u32 sub_index)
+{
+  BT_Node *result;
+
+  (void)tree;
+  if (sub_index < BT_COUNTOF(node->subs)) {
+#if defined(BT_COMPACT_HANDLES)
+    result = (node->subs[sub_index] != 0) ? bt_pool_resolve(&tree->pool, node->subs[sub_index]) : NULL;
+#else
+    result = node->subs[sub_index];
+#endif
+  } else {
+    BT_ASSERT("sub index out of bounds, returning NULL");
+    result = NULL;
+  }
+
+  return result;
+}
+
+BT_INTERNAL bt_bool
+bt_is_node_leaf(BT_Node *node)
+{
+  bt_u32 i;
+  for (i = 0; i < BT_COUNTOF(node->subs); ++i) {
+    if (node->subs[i] != 0) {
+      return bt_false;
+    }
+  }
+  return bt_true;
+}
+
+#if defined(BT_ORDER_STATISTICS)
+BT_INTERNAL bt_u64
+bt_node_total_count(BT_Node *node)
+{
+  bt_u64 result = 0;
+
+  if (node != NULL) {
+    bt_u32 i;
+
+    result = node->key_count;
+    for (i = 0; i <= node->key_count; ++i) {
+      result += node->counts[i];
+    }
+  }
+
+  return result;
+}
+#endif
+
+#if defined(BT_AGGREGATES)
+BT_INTERNAL BT_AggregateValue
+bt_aggregate_key(BT_Context *tree, BT_Node *node, bt_u32 key_index)
+{
+  BT_Key *key = bt_node_get_key(node, key_index);
+  return tree->aggregate.map(tree->aggregate.user_context, key->id, key->data);
+}
+
+BT_INTERNAL BT_AggregateValue
+bt_aggregate_keys(BT_Context *tree, BT_Node *node, bt_u32 key_start, bt_u32 key_end, bt_bool with_left_sub)
+{
+  /* NOTE(nick): Folds keys [key_start, key_end) of the node together with the sub-nodes
+   * in between them. Left-most sub-node of the run is included on request, the sub-node
+   * that follows each key always is. */
+  BT_Aggregate *aggregate = &tree->aggregate;
+  BT_AggregateValue result = aggregate->identity;
+  bt_u32 i;
+
+  if (with_left_sub) {
+    result = node->aggregates[key_start];
+  }
+  for (i = key_start; i < key_end; ++i) {
+    result = aggregate->combine(aggregate->user_context, result, bt_aggregate_key(tree, node, i));
+    result = aggregate->combine(aggregate->user_context, result, node->aggregates[i + 1]);
+  }
+
+  return result;
+}
+
+BT_INTERNAL BT_AggregateValue
+bt_node_total_aggregate(BT_Context *tree, BT_Node *node)
+{
+  if (node == NULL) {
+    return tree->aggregate.identity;
+  }
+  return bt_aggregate_keys(tree, node, 0, node->key_count, bt_true);
+}
+
+#endif
+
+BT_INTERNAL void
+bt_node_update_summaries(BT_Context *tree, BT_Node *node)
+{
+  /* NOTE(nick): Recomputes what node caches about its sub-nodes. Sub-nodes have to be
+   * up to date already, so callers go bottom-up. */
+#if defined(BT_ORDER_STATISTICS)
+  if (node != NULL) {
+    bt_u32 i;
+    for (i = 0; i < BT_COUNTOF(node->subs); ++i) {
+      node->counts[i] = bt_node_total_count(bt_node_get_sub(tree, node, i));
+    }
+  }
+#endif
+#if defined(BT_AGGREGATES)
+  if (node != NULL && tree->aggregate.map != NULL) {
+    bt_u32 i;
+    for (i = 0; i < BT_COUNTOF(node->subs); ++i) {
+      node->aggregates[i] = bt_node_total_aggregate(tree, bt_node_get_sub(tree, node, i));
+    }
+  }
+#endif
+  (void)tree;
+  (void)node;
+}
+
+BT_INTERNAL void
+bt_update_path_summaries(BT_Context *tree, bt_u32 path_count)
+{
+  /* NOTE(nick): Walks frames that are left on the stack memory after an insert or delete.
+   * Frames of freed nodes are nulled out by the rebalancing code. */
+#if defined(BT_ORDER_STATISTICS) || defined(BT_AGGREGATES)
+  while (path_count > 0) {
+    path_count -= 1;
+    bt_node_update_summaries(tree, tree->frames[path_count].node);
+  }
+#endif
+  (void)tree;
+  (void)path_count;
+}
+
+/* NOTE(nick): Keys and sub-node slots are plain arrays, so a shift is a single memmove
+ * followed by clearing the slot that became free, instead of copying and invalidating
+ * element by element. */
+BT_INTERNAL void
+bt_shift_keys_left(BT_Node *node, bt_u32 key_index)
+{
+  BT_ASSERT(node->key_count > 0);
+  if (key_index + 1 < node->key_count) {
+    bt_memmove(&node->keys[key_index], &node->keys[key_index + 1],
+               (node->key_count - key_index - 1) * sizeof(node->keys[0]));
+    bt_node_invalidate_key(node, node->key_count - 1);
+  }
+}
+
+BT_INTERNAL void
+bt_shift_keys_right(BT_Node *node, bt_u32 start_key)
+{
+  if (start_key + 1 < BT_COUNTOF(node->keys)) {
+    bt_memmove(&node->keys[start_key + 1], &node->keys[start_key],
+               (BT_COUNTOF(node->keys) - start_key - 1) * sizeof(node->keys[0]));
+    bt_node_invalidate_key(node, start_key);
+  }
+}
+
+BT_INTERNAL void
+bt_shift_subs_left(BT_Context *tree, BT_Node *node, bt_u32 key_index)
+{
+  if (key_index < node->key_count) {
+    bt_memmove(&node->subs[key_index], &node->subs[key_index + 1],
+               (node->key_count - key_index) * sizeof(node->subs[0]));
+  }
+  bt_node_set_sub(tree, node, node->key_count, NULL);
+}
+
+BT_INTERNAL void
+bt_shift_subs_right(BT_Context *tree, BT_Node *node, bt_u32 key_index)
+{
+  if (key_index < node->key_count) {
+    bt_memmove(&node->subs[key_index + 1], &node->subs[key_index],
+               (node->key_count - key_index) * sizeof(node->subs[0]));
+    bt_node_set_sub(tree, node, key_index, NULL);
+  }
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_push_stack_frame(BT_Context *tree, BT_Node *node, BT_KeyID key_id)
+{
+  BT_StackFrame *frame;
+
+  if (tree->frames_max == 0) {
+    tree->frames_count = 0;
+    tree->frames_max = 32;
+    tree->frames = (BT_StackFrame *)bt_alloc_memory(&tree->allocator, sizeof(BT_StackFrame) * tree->frames_max, 0);
+    if (tree->frames == NULL) {
+      return BT_ERROR_AllocationFailed;
+    }
+  }
+
+  if (tree->frames_count >= tree->frames_max) {
+    BT_Allocator *allocator = &tree->allocator;
+    bt_u32 temp_max = tree->frames_max*2;
+    BT_StackFrame *temp;
+
+    if (allocator->realloc_memory != NULL) {
+      temp = (BT_StackFrame *)allocator->realloc_memory(allocator->realloc_memory_context, tree->frames,
+                                                        tree->frames_max*sizeof(BT_StackFrame), temp_max*sizeof(BT_StackFrame));
+      if (temp == NULL) {
+        return BT_ERROR_AllocationFailed;
+      }
+    } else {
+      temp = (BT_StackFrame *)bt_alloc_memory(allocator, temp_max*sizeof(BT_StackFrame), 0);
+      if (temp == NULL) {
+        return BT_ERROR_AllocationFailed;
+      }
+      bt_memcpy(temp, tree->frames, tree->frames_count*sizeof(BT_StackFrame));
+      bt_free_memory(allocator, tree->frames, tree->frames_max*sizeof(BT_StackFrame), 0);
+    }
+    tree->frames_max = temp_max;
+    tree->frames = temp;
+  }
+
+  tree->frames[tree->frames_count].node = node;
+  tree->frames[tree->frames_count].key_index = key_id;
+  tree->frames_count += 1;
+
+  return BT_ERROR_Ok;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_pop_stack_frame(BT_Context *tree, BT_StackFrame *frame_out)
 {
   BT_ErrorCode error_code = BT_ERROR_OpDenied;
-  BT_StackFrame frame;
 
-  if (tree->root == NULL) {
-    tree->root = bt_new_node(tree);
+  if (tree->frames_count > 0) {
+    *frame_out = tree->frames[--tree->frames_count];
+    error_code = BT_ERROR_Ok;
+  }
+
+  return error_code;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_peek_stack_frame(BT_Context *tree, BT_StackFrame *frame_out)
+{
+  BT_ErrorCode error_code = BT_ERROR_OpDenied;
+
+  if (tree->frames_count > 0) {
+    *frame_out = tree->frames[tree->frames_count - 1];
+    error_code = BT_ERROR_Ok;
+  }
+
+  return error_code;
+}
+
+BT_INTERNAL void
+bt_reset_stack(BT_Context *tree)
+{
+  tree->frames_count = 0;
+}
+
+BT_INTERNAL BT_MALLOC_SIG(bt_default_alloc_memory)
+{
+  bt_u08 *memory;
+  bt_u08 *result;
+
+  if (alignment <= sizeof(void *)) {
+    return bt_malloc(size, context);
+  }
+
+  /* NOTE(nick): Pointer returned by bt_malloc is kept right in front of the aligned block. */
+  memory = (bt_u08 *)bt_malloc(size + alignment - 1 + sizeof(void *), context);
+  if (memory == NULL) {
+    return NULL;
+  }
+  result = (bt_u08 *)(((size_t)(memory + sizeof(void *)) + (size_t)(alignment - 1)) & ~(size_t)(alignment - 1));
+  ((void **)result)[-1] = memory;
+  return result;
+}
+
+BT_INTERNAL BT_FREE_SIG(bt_default_free_memory)
+{
+  (void)size;
+  if (alignment <= sizeof(void *)) {
+    bt_free(ptr, context);
+  } else {
+    bt_free(((void **)ptr)[-1], context);
+  }
+}
+
+/* NOTE(nick): Allocator on top of bt_malloc and bt_free, malloc_ud is passed to both. */
+BT_API BT_Allocator
+bt_default_allocator(void *malloc_ud)
+{
+  BT_Allocator allocator;
+
+  bt_memset(&allocator, 0, sizeof(allocator));
+  allocator.alloc_memory_context = malloc_ud;
+  allocator.alloc_memory = bt_default_alloc_memory;
+  allocator.free_memory_context = malloc_ud;
+  allocator.free_memory = bt_default_free_memory;
+  return allocator;
+}
+
+#if defined(BT_HUGEPAGE_NODES)
+#if !defined(__linux__)
+#error "BT_HUGEPAGE_NODES needs Linux"
+#endif
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* NOTE(nick): Nodes and slabs are the only blocks with a free list, everything else the
+ * tree allocates goes to bt_malloc. */
+BT_INTERNAL void **
+bt_hugepage_free_list(BT_HugepageHeap *heap, bt_u64 size)
+{
+  if (size == sizeof(BT_Node)) {
+    return &heap->node_free_list;
+  }
+  if (size == BT_POOL_CHUNK_NODES * sizeof(BT_Node) && size <= BT_HUGEPAGE_REGION_SIZE - 64) {
+    return &heap->slab_free_list;
+  }
+  return NULL;
+}
+
+BT_INTERNAL bt_u08 *
+bt_hugepage_map_region(BT_HugepageHeap *heap)
+{
+  bt_u08 *region = NULL;
+  bt_u64 size = BT_HUGEPAGE_REGION_SIZE;
+
+#if defined(MAP_HUGETLB)
+  if (heap->mode == BT_HUGEPAGE_HugeTLB) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+      region = (bt_u08 *)memory;
+    }
+  }
+#endif
+
+  /* NOTE(nick): Without reserved hugetlbfs pages (or MAP_HUGETLB) the region falls back to
+   * transparent hugepages. Mapping twice the size lets it start on a hugepage boundary. */
+  if (region == NULL) {
+    bt_u08 *memory = (bt_u08 *)mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((void *)memory == MAP_FAILED) {
+      return NULL;
+    }
+    region = (bt_u08 *)(((size_t)memory + (size_t)(size - 1)) & ~(size_t)(size - 1));
+    if (region > memory) {
+      munmap(memory, region - memory);
+    }
+    if (memory + size * 2 > region + size) {
+      munmap(region + size, (memory + size * 2) - (region + size));
+    }
+#if defined(MADV_HUGEPAGE)
+    madvise(region, size, MADV_HUGEPAGE);
+#endif
+  }
+
+  /* NOTE(nick): Policy is set before the first touch, so pages land where they should.
+   * Kernels without NUMA support ignore it. */
+  if (heap->numa_policy != BT_NUMA_Local) {
+    unsigned long mask = (unsigned long)heap->numa_node_mask;
+    int mode = (heap->numa_policy == BT_NUMA_Preferred) ? 1 : (heap->numa_policy == BT_NUMA_Bind) ? 2 : 3;
+    syscall(SYS_mbind, region, (unsigned long)size, mode, &mask, (unsigned long)(sizeof(mask) * 8 + 1), 0);
+  }
+
+  *(bt_u08 **)region = heap->regions;
+  heap->regions = region;
+  heap->region_count += 1;
+  return region;
+}
+
+BT_INTERNAL BT_MALLOC_SIG(bt_hugepage_alloc_memory)
+{
+  BT_HugepageHeap *heap = (BT_HugepageHeap *)context;
+  void **free_list = bt_hugepage_free_list(heap, size);
+  bt_u64 padding;
+  void *result;
+
+  if (free_list == NULL) {
+    return bt_default_alloc_memory(NULL, size, alignment);
+  }
+  if (*free_list != NULL) {
+    result = *free_list;
+    *free_list = *(void **)result;
+    return result;
+  }
+
+  if (alignment < sizeof(void *)) {
+    alignment = sizeof(void *);
+  }
+  padding = (alignment - ((size_t)heap->cursor & (size_t)(alignment - 1))) & (alignment - 1);
+  if (heap->cursor == NULL || padding + size > heap->remaining) {
+    bt_u08 *region = bt_hugepage_map_region(heap);
+    if (region == NULL) {
+      return NULL;
+    }
+    heap->cursor = region + 64;
+    heap->remaining = BT_HUGEPAGE_REGION_SIZE - 64;
+    padding = (alignment - ((size_t)heap->cursor & (size_t)(alignment - 1))) & (alignment - 1);
+    if (padding + size > heap->remaining) {
+      return NULL;
+    }
+  }
+
+  result = heap->cursor + padding;
+  heap->cursor += padding + size;
+  heap->remaining -= padding + size;
+  return result;
+}
+
+BT_INTERNAL BT_FREE_SIG(bt_hugepage_free_memory)
+{
+  BT_HugepageHeap *heap = (BT_HugepageHeap *)context;
+  void **free_list = bt_hugepage_free_list(heap, size);
+
+  if (free_list == NULL) {
+    bt_default_free_memory(NULL, ptr, size, alignment);
+  } else {
+    *(void **)ptr = *free_list;
+    *free_list = ptr;
+  }
+}
+
+/* NOTE(nick): numa_node_mask has a bit per NUMA node, it's unused with BT_NUMA_Local. */
+BT_API void
+bt_hugepage_heap_init(BT_HugepageHeap *heap, BT_HugepageMode mode, BT_NumaPolicy numa_policy, bt_u64 numa_node_mask)
+{
+  bt_memset(heap, 0, sizeof(*heap));
+  heap->mode = mode;
+  heap->numa_policy = numa_policy;
+  heap->numa_node_mask = numa_node_mask;
+}
+
+/* NOTE(nick): Every tree using the heap has to be destroyed first. */
+BT_API void
+bt_hugepage_heap_release(BT_HugepageHeap *heap)
+{
+  while (heap->regions != NULL) {
+    bt_u08 *region = heap->regions;
+    heap->regions = *(bt_u08 **)region;
+    munmap(region, BT_HUGEPAGE_REGION_SIZE);
+  }
+  bt_hugepage_heap_init(heap, heap->mode, heap->numa_policy, heap->numa_node_mask);
+}
+
+BT_API BT_Allocator
+bt_hugepage_allocator(BT_HugepageHeap *heap)
+{
+  BT_Allocator allocator;
+
+  bt_memset(&allocator, 0, sizeof(allocator));
+  allocator.alloc_memory_context = heap;
+  allocator.alloc_memory = bt_hugepage_alloc_memory;
+  allocator.free_memory_context = heap;
+  allocator.free_memory = bt_hugepage_free_memory;
+  return allocator;
+}
+#endif
+
+#if defined(BT_RADIX_ENGINE)
+BT_INTERNAL bt_u32
+bt_radix_byte(BT_KeyID id, bt_u32 depth)
+{
+  BT_ASSERT(depth < 8);
+  return (bt_u32)(id >> (56 - 8 * depth)) & 0xFF;
+}
+
+BT_INTERNAL bt_u64
+bt_radix_node_size(bt_u32 kind)
+{
+  switch (kind) {
+  case BT_RADIX_Node4:   return sizeof(BT_RadixNode4);
+  case BT_RADIX_Node16:  return sizeof(BT_RadixNode16);
+  case BT_RADIX_Node48:  return sizeof(BT_RadixNode48);
+  case BT_RADIX_Node256: return sizeof(BT_RadixNode256);
+  default: break;
+  }
+  return sizeof(BT_RadixLeaf);
+}
+
+BT_INTERNAL bt_u32
+bt_radix_capacity(bt_u32 kind)
+{
+  switch (kind) {
+  case BT_RADIX_Node4:   return 4;
+  case BT_RADIX_Node16:  return 16;
+  case BT_RADIX_Node48:  return 48;
+  case BT_RADIX_Node256: return 256;
+  default: break;
+  }
+  return 0;
+}
+
+BT_INTERNAL void
+bt_radix_sorted_arrays(BT_RadixNode *node, bt_u08 **bytes_out, BT_RadixNode ***children_out)
+{
+  if (node->kind == BT_RADIX_Node4) {
+    *bytes_out = ((BT_RadixNode4 *)node)->bytes;
+    *children_out = ((BT_RadixNode4 *)node)->children;
+  } else {
+    BT_ASSERT(node->kind == BT_RADIX_Node16);
+    *bytes_out = ((BT_RadixNode16 *)node)->bytes;
+    *children_out = ((BT_RadixNode16 *)node)->children;
+  }
+}
+
+BT_INTERNAL BT_RadixNode *
+bt_radix_alloc(BT_Context *tree, bt_u32 kind)
+{
+  bt_u64 size = bt_radix_node_size(kind);
+  BT_RadixNode *node;
+
+  node = (BT_RadixNode *)bt_alloc_memory(&tree->allocator, size, tree->allocator.node_alignment);
+  if (node != NULL) {
+    bt_memset(node, 0, size);
+    node->kind = (bt_u08)kind;
+  }
+  return node;
+}
+
+BT_INTERNAL void
+bt_radix_free(BT_Context *tree, BT_RadixNode *node)
+{
+  bt_u64 size = bt_radix_node_size(node->kind);
+
+#if defined(BT_EPOCH_RECLAMATION)
+  if (tree->epoch_thread != NULL) {
+    bt_epoch_retire(tree, node, size);
+    return;
+  }
+#endif
+  bt_free_memory(&tree->allocator, node, size, tree->allocator.node_alignment);
+}
+
+BT_INTERNAL BT_RadixNode **
+bt_radix_find_child(BT_RadixNode *node, bt_u32 byte)
+{
+  switch (node->kind) {
+  case BT_RADIX_Node4:
+  case BT_RADIX_Node16: {
+    bt_u08 *bytes;
+    BT_RadixNode **children;
+    bt_u32 i;
+
+    bt_radix_sorted_arrays(node, &bytes, &children);
+    for (i = 0; i < node->child_count && bytes[i] <= byte; ++i) {
+      if (bytes[i] == byte) {
+        return &children[i];
+      }
+    }
+  } break;
+
+  case BT_RADIX_Node48: {
+    BT_RadixNode48 *node48 = (BT_RadixNode48 *)node;
+    if (node48->slots[byte] != 0) {
+      return &node48->children[node48->slots[byte] - 1];
+    }
+  } break;
+
+  case BT_RADIX_Node256: {
+    BT_RadixNode256 *node256 = (BT_RadixNode256 *)node;
+    if (node256->children[byte] != NULL) {
+      return &node256->children[byte];
+    }
+  } break;
+
+  default: break;
+  }
+
+  return NULL;
+}
+
+/* NOTE(nick): Child at the first byte not less than byte going forward, or not greater
+ * than byte going backward. byte can be one past either end of 0..255. */
+BT_INTERNAL BT_RadixNode *
+bt_radix_child_from(BT_RadixNode *node, bt_s32 byte, bt_bool forward, bt_s32 *byte_out)
+{
+  bt_s32 step = forward ? 1 : -1;
+
+  switch (node->kind) {
+  case BT_RADIX_Node4:
+  case BT_RADIX_Node16: {
+    bt_u08 *bytes;
+    BT_RadixNode **children;
+    bt_s32 i;
+
+    bt_radix_sorted_arrays(node, &bytes, &children);
+    for (i = forward ? 0 : (bt_s32)node->child_count - 1; i >= 0 && i < (bt_s32)node->child_count; i += step) {
+      if (forward ? (bt_s32)bytes[i] >= byte : (bt_s32)bytes[i] <= byte) {
+        *byte_out = bytes[i];
+        return children[i];
+      }
+    }
+  } break;
+
+  case BT_RADIX_Node48: {
+    BT_RadixNode48 *node48 = (BT_RadixNode48 *)node;
+    for (; byte >= 0 && byte < 256; byte += step) {
+      if (node48->slots[byte] != 0) {
+        *byte_out = byte;
+        return node48->children[node48->slots[byte] - 1];
+      }
+    }
+  } break;
+
+  case BT_RADIX_Node256: {
+    BT_RadixNode256 *node256 = (BT_RadixNode256 *)node;
+    for (; byte >= 0 && byte < 256; byte += step) {
+      if (node256->children[byte] != NULL) {
+        *byte_out = byte;
+        return node256->children[byte];
+      }
+    }
+  } break;
+
+  default: break;
+  }
+
+  return NULL;
+}
+
+/* NOTE(nick): Inserts a child into a node that has room for it. */
+BT_INTERNAL void
+bt_radix_put_child(BT_RadixNode *node, bt_u32 byte, BT_RadixNode *child)
+{
+  BT_ASSERT(node->child_count < bt_radix_capacity(node->kind));
+
+  switch (node->kind) {
+  case BT_RADIX_Node4:
+  case BT_RADIX_Node16: {
+    bt_u08 *bytes;
+    BT_RadixNode **children;
+    bt_u32 i;
+
+    bt_radix_sorted_arrays(node, &bytes, &children);
+    for (i = node->child_count; i > 0 && bytes[i - 1] > byte; --i) {
+      bytes[i] = bytes[i - 1];
+      children[i] = children[i - 1];
+    }
+    bytes[i] = (bt_u08)byte;
+    children[i] = child;
+  } break;
+
+  case BT_RADIX_Node48: {
+    BT_RadixNode48 *node48 = (BT_RadixNode48 *)node;
+    bt_u32 slot = 0;
+
+    while (node48->children[slot] != NULL) {
+      slot += 1;
+    }
+    node48->slots[byte] = (bt_u08)(slot + 1);
+    node48->children[slot] = child;
+  } break;
+
+  case BT_RADIX_Node256: {
+    ((BT_RadixNode256 *)node)->children[byte] = child;
+  } break;
+
+  default: break;
+  }
+
+  node->child_count += 1;
+}
+
+/* NOTE(nick): Moves node into a node of another kind with the same prefix and children.
+ * Returns NULL and leaves node alone when the allocation fails. */
+BT_INTERNAL BT_RadixNode *
+bt_radix_resize(BT_Context *tree, BT_RadixNode *node, bt_u32 kind)
+{
+  BT_RadixNode *resized;
+  BT_RadixNode *child;
+  bt_s32 byte = 0;
+
+  resized = bt_radix_alloc(tree, kind);
+  if (resized == NULL) {
+    return NULL;
+  }
+  resized->prefix_length = node->prefix_length;
+  bt_memcpy(resized->prefix, node->prefix, sizeof(node->prefix));
+  while ((child = bt_radix_child_from(node, byte, bt_true, &byte)) != NULL) {
+    bt_radix_put_child(resized, (bt_u32)byte, child);
+    byte += 1;
+  }
+  bt_radix_free(tree, node);
+
+  return resized;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_radix_add_child(BT_Context *tree, BT_RadixNode **ref, bt_u32 byte, BT_RadixNode *child)
+{
+  BT_RadixNode *node = *ref;
+
+  if (node->child_count == bt_radix_capacity(node->kind)) {
+    node = bt_radix_resize(tree, node, node->kind + 1);
+    if (node == NULL) {
+      return BT_ERROR_AllocationFailed;
+    }
+    *ref = node;
+  }
+  bt_radix_put_child(node, byte, child);
+
+  return BT_ERROR_Ok;
+}
+
+BT_INTERNAL void
+bt_radix_remove_child(BT_Context *tree, BT_RadixNode **ref, bt_u32 byte)
+{
+  BT_RadixNode *node = *ref;
+
+  switch (node->kind) {
+  case BT_RADIX_Node4:
+  case BT_RADIX_Node16: {
+    bt_u08 *bytes;
+    BT_RadixNode **children;
+    bt_u32 i = 0;
+
+    bt_radix_sorted_arrays(node, &bytes, &children);
+    while (bytes[i] != byte) {
+      i += 1;
+    }
+    bt_memmove(&bytes[i], &bytes[i + 1], (node->child_count - i - 1) * sizeof(bytes[0]));
+    bt_memmove(&children[i], &children[i + 1], (node->child_count - i - 1) * sizeof(children[0]));
+    children[node->child_count - 1] = NULL;
+  } break;
+
+  case BT_RADIX_Node48: {
+    BT_RadixNode48 *node48 = (BT_RadixNode48 *)node;
+    node48->children[node48->slots[byte] - 1] = NULL;
+    node48->slots[byte] = 0;
+  } break;
+
+  case BT_RADIX_Node256: {
+    ((BT_RadixNode256 *)node)->children[byte] = NULL;
+  } break;
+
+  default: break;
+  }
+  node->child_count -= 1;
+
+  if (node->kind == BT_RADIX_Node4 && node->child_count == 1) {
+    /* NOTE(nick): Node4 with a single child goes away, the child takes over the prefix of
+     * the node and the byte it was hanging on. */
+    BT_RadixNode4 *node4 = (BT_RadixNode4 *)node;
+    BT_RadixNode *child = node4->children[0];
+
+    if (child->kind != BT_RADIX_Leaf) {
+      bt_u08 prefix[16];
+      bt_u32 length = node->prefix_length;
+
+      bt_memcpy(prefix, node->prefix, length);
+      prefix[length++] = node4->bytes[0];
+      bt_memcpy(prefix + length, child->prefix, child->prefix_length);
+      length += child->prefix_length;
+      BT_ASSERT(length < sizeof(child->prefix));
+      bt_memcpy(child->prefix, prefix, length);
+      child->prefix_length = (bt_u08)length;
+    }
+    *ref = child;
+    bt_radix_free(tree, node);
+  } else if (node->kind != BT_RADIX_Node4 &&
+             node->child_count <= bt_radix_capacity(node->kind - 1) * 3 / 4) {
+    /* NOTE(nick): Shrinks below the capacity of the smaller kind, so that a node on the
+     * boundary doesn't get resized back and forth. Failed allocation keeps the node. */
+    BT_RadixNode *resized = bt_radix_resize(tree, node, node->kind - 1);
+    if (resized != NULL) {
+      *ref = resized;
+    }
+  }
+}
+
+BT_INTERNAL bt_u32
+bt_radix_prefix_match(BT_RadixNode *node, BT_KeyID id, bt_u32 depth)
+{
+  bt_u32 i;
+
+  for (i = 0; i < node->prefix_length; ++i) {
+    if (node->prefix[i] != bt_radix_byte(id, depth + i)) {
+      break;
+    }
+  }
+  return i;
+}
+
+BT_INTERNAL BT_Key *
+bt_radix_search(BT_Context *tree, BT_KeyID id)
+{
+  BT_RadixNode *node = tree->radix_root;
+  bt_u32 depth = 0;
+
+  /* NOTE(nick): Leaves hold the whole id, so prefixes are skipped on the way down and a
+   * single compare at the leaf catches every mismatch. */
+  while (node != NULL) {
+    BT_RadixNode **child;
+
+    if (node->kind == BT_RADIX_Leaf) {
+      BT_RadixLeaf *leaf = (BT_RadixLeaf *)node;
+      return (leaf->key.id == id) ? &leaf->key : NULL;
+    }
+    depth += node->prefix_length;
+    child = bt_radix_find_child(node, bt_radix_byte(id, depth));
+    node = (child != NULL) ? *child : NULL;
+    depth += 1;
+  }
+
+  return NULL;
+}
+
+BT_INTERNAL BT_RadixLeaf *
+bt_radix_edge(BT_RadixNode *node, bt_bool last)
+{
+  bt_s32 byte;
+
+  while (node != NULL && node->kind != BT_RADIX_Leaf) {
+    node = bt_radix_child_from(node, last ? 255 : 0, !last, &byte);
+  }
+  return (BT_RadixLeaf *)node;
+}
+
+/* NOTE(nick): Smallest key not less than id going forward, largest key not greater than
+ * id going backward. */
+BT_INTERNAL BT_RadixLeaf *
+bt_radix_seek(BT_RadixNode *node, BT_KeyID id, bt_u32 depth, bt_bool forward)
+{
+  BT_RadixNode *child;
+  BT_RadixLeaf *leaf;
+  bt_s32 byte;
+  bt_s32 child_byte;
+  bt_u32 i;
+
+  if (node == NULL) {
+    return NULL;
+  }
+  if (node->kind == BT_RADIX_Leaf) {
+    leaf = (BT_RadixLeaf *)node;
+    if (forward ? leaf->key.id >= id : leaf->key.id <= id) {
+      return leaf;
+    }
+    return NULL;
+  }
+
+  for (i = 0; i < node->prefix_length; ++i) {
+    byte = (bt_s32)bt_radix_byte(id, depth + i);
+    if (node->prefix[i] != byte) {
+      /* NOTE(nick): Every key below the node is on the same side of id. */
+      if ((node->prefix[i] > byte) == (forward != 0)) {
+        return bt_radix_edge(node, !forward);
+      }
+      return NULL;
+    }
+  }
+
+  depth += node->prefix_length;
+  byte = (bt_s32)bt_radix_byte(id, depth);
+  child = bt_radix_child_from(node, byte, forward, &child_byte);
+  if (child != NULL && child_byte == byte) {
+    leaf = bt_radix_seek(child, id, depth + 1, forward);
+    if (leaf != NULL) {
+      return leaf;
+    }
+    child = bt_radix_child_from(node, forward ? byte + 1 : byte - 1, forward, &child_byte);
+  }
+  return bt_radix_edge(child, !forward);
+}
+
+BT_INTERNAL BT_Key *
+bt_radix_seek_mode(BT_Context *tree, BT_KeyID id, BT_SeekMode mode)
+{
+  BT_RadixLeaf *leaf = NULL;
+
+  switch (mode) {
+  case BT_SEEK_GreaterEqual: {
+    leaf = bt_radix_seek(tree->radix_root, id, 0, bt_true);
+  } break;
+
+  case BT_SEEK_Greater: {
+    if (id != BT_INVALID_ID) {
+      leaf = bt_radix_seek(tree->radix_root, id + 1, 0, bt_true);
+    }
+  } break;
+
+  case BT_SEEK_LessEqual: {
+    leaf = bt_radix_seek(tree->radix_root, id, 0, bt_false);
+  } break;
+
+  case BT_SEEK_Less: {
+    if (id != 0) {
+      leaf = bt_radix_seek(tree->radix_root, id - 1, 0, bt_false);
+    }
+  } break;
+  }
+
+  return (leaf != NULL) ? &leaf->key : NULL;
+}
+
+BT_INTERNAL BT_Key *
+bt_radix_cursor_set(BT_Cursor *cursor, BT_Key *key)
+{
+  cursor->radix_key = key;
+  cursor->depth = (key != NULL) ? 1 : 0;
+  return key;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_radix_insert(BT_Context *tree, BT_KeyID id, const void *data, BT_InsertMode mode,
+                void *user_context, bt_update_sig *update, BT_Key **key_out, bt_bool *inserted_out)
+{
+  BT_RadixNode **ref = &tree->radix_root;
+  BT_RadixNode *node;
+  BT_RadixLeaf *leaf;
+  BT_RadixNode *split;
+  bt_u32 depth = 0;
+  bt_u32 match = 0;
+  bt_u32 i;
+  BT_ErrorCode error_code = BT_ERROR_Ok;
+
+  for (;;) {
+    BT_RadixNode **child;
+
+    node = *ref;
+    if (node == NULL) {
+      break;
+    }
+    if (node->kind == BT_RADIX_Leaf) {
+      leaf = (BT_RadixLeaf *)node;
+      if (leaf->key.id == id) {
+        if (mode == BT_INSERT_Replace) {
+          leaf->key.data = data;
+        } else if (mode == BT_INSERT_Update) {
+          leaf->key.data = update(user_context, id, leaf->key.data, bt_true);
+        }
+        if (key_out != NULL) {
+          *key_out = &leaf->key;
+        }
+        return BT_ERROR_Ok;
+      }
+      while (bt_radix_byte(leaf->key.id, depth + match) == bt_radix_byte(id, depth + match)) {
+        match += 1;
+      }
+      break;
+    }
+
+    match = bt_radix_prefix_match(node, id, depth);
+    if (match < node->prefix_length) {
+      break;
+    }
+    child = bt_radix_find_child(node, bt_radix_byte(id, depth + match));
+    if (child == NULL) {
+      break;
+    }
+    ref = child;
+    depth += match + 1;
+    match = 0;
+  }
+
+  if (mode == BT_INSERT_Update) {
+    data = update(user_context, id, NULL, bt_false);
+  }
+
+  leaf = (BT_RadixLeaf *)bt_radix_alloc(tree, BT_RADIX_Leaf);
+  if (leaf == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  leaf->key.id = id;
+  leaf->key.data = data;
+
+  if (node == NULL) {
+    *ref = &leaf->header;
+  } else if (node->kind != BT_RADIX_Leaf && match == node->prefix_length) {
+    error_code = bt_radix_add_child(tree, ref, bt_radix_byte(id, depth + match), &leaf->header);
+  } else {
+    /* NOTE(nick): id parts ways with node after match bytes. A Node4 takes over the common
+     * part and gets node and the new leaf as its children. */
+    split = bt_radix_alloc(tree, BT_RADIX_Node4);
+    if (split == NULL) {
+      error_code = BT_ERROR_AllocationFailed;
+    } else {
+      split->prefix_length = (bt_u08)match;
+      for (i = 0; i < match; ++i) {
+        split->prefix[i] = (bt_u08)bt_radix_byte(id, depth + i);
+      }
+      if (node->kind == BT_RADIX_Leaf) {
+        bt_radix_put_child(split, bt_radix_byte(((BT_RadixLeaf *)node)->key.id, depth + match), node);
+      } else {
+        bt_radix_put_child(split, node->prefix[match], node);
+        node->prefix_length -= (bt_u08)(match + 1);
+        bt_memmove(node->prefix, node->prefix + match + 1, node->prefix_length);
+      }
+      bt_radix_put_child(split, bt_radix_byte(id, depth + match), &leaf->header);
+      *ref = split;
+    }
+  }
+
+  if (error_code != BT_ERROR_Ok) {
+    bt_radix_free(tree, &leaf->header);
+    return error_code;
+  }
+  if (key_out != NULL) {
+    *key_out = &leaf->key;
+  }
+  if (inserted_out != NULL) {
+    *inserted_out = bt_true;
+  }
+
+  return BT_ERROR_Ok;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_radix_delete(BT_Context *tree, BT_KeyID id)
+{
+  BT_RadixNode **ref = &tree->radix_root;
+  BT_RadixNode **parent_ref = NULL;
+  bt_u32 parent_byte = 0;
+  bt_u32 depth = 0;
+
+  while (*ref != NULL) {
+    BT_RadixNode *node = *ref;
+    BT_RadixNode **child;
+
+    if (node->kind == BT_RADIX_Leaf) {
+      if (((BT_RadixLeaf *)node)->key.id != id) {
+        break;
+      }
+      if (parent_ref == NULL) {
+        *ref = NULL;
+      } else {
+        bt_radix_remove_child(tree, parent_ref, parent_byte);
+      }
+      bt_radix_free(tree, node);
+      return BT_ERROR_Ok;
+    }
+
+    depth += node->prefix_length;
+    parent_byte = bt_radix_byte(id, depth);
+    child = bt_radix_find_child(node, parent_byte);
+    if (child == NULL) {
+      break;
+    }
+    parent_ref = ref;
+    ref = child;
+    depth += 1;
+  }
+
+  return BT_ERROR_IDNotFound;
+}
+
+BT_INTERNAL bt_u64
+bt_radix_free_subtree(BT_Context *tree, BT_RadixNode *node)
+{
+  BT_RadixNode *child;
+  bt_s32 byte = 0;
+  bt_u64 count = 0;
+
+  if (node == NULL) {
+    return 0;
+  }
+  if (node->kind == BT_RADIX_Leaf) {
+    count = 1;
+  }
+  while (node->kind != BT_RADIX_Leaf && (child = bt_radix_child_from(node, byte, bt_true, &byte)) != NULL) {
+    count += bt_radix_free_subtree(tree, child);
+    byte += 1;
+  }
+  bt_radix_free(tree, node);
+
+  return count;
+}
+
+BT_INTERNAL bt_bool
+bt_radix_visit(BT_RadixNode *node, void *user_context, bt_visit_keys_sig *visit)
+{
+  BT_RadixNode *child;
+  bt_s32 byte = 0;
+
+  if (node->kind == BT_RADIX_Leaf) {
+    BT_RadixLeaf *leaf = (BT_RadixLeaf *)node;
+    return visit(user_context, leaf->key.id, leaf->key.data);
+  }
+  while ((child = bt_radix_child_from(node, byte, bt_true, &byte)) != NULL) {
+    if (bt_radix_visit(child, user_context, visit) == bt_false) {
+      return bt_false;
+    }
+    byte += 1;
+  }
+
+  return bt_true;
+}
+#endif
+
+/* NOTE(nick): allocator is copied into the tree, NULL picks bt_default_allocator(NULL). */
+BT_API BT_ErrorCode
+bt_create(BT_Context *tree, bt_u32 value_size, const BT_Allocator *allocator)
+{
+  if (allocator == NULL) {
+    tree->allocator = bt_default_allocator(NULL);
+  } else if (allocator->alloc_memory == NULL || allocator->free_memory == NULL) {
+    return BT_ERROR_OpDenied;
+  } else {
+    tree->allocator = *allocator;
+  }
+  tree->value_size = value_size;
+  tree->frames = NULL;
+  tree->frames_count = 0;
+  tree->frames_max = 0;
+  tree->root = NULL;
+  bt_reset_edge_leaves(tree);
+  bt_memset(&tree->bloom, 0, sizeof(tree->bloom));
+  bt_memset(&tree->key_cache, 0, sizeof(tree->key_cache));
+  bt_set_node_search(tree, BT_NODE_SEARCH_Binary);
+  bt_memset(&tree->write_buffer, 0, sizeof(tree->write_buffer));
+  bt_memset(&tree->compact, 0, sizeof(tree->compact));
+#if defined(BT_AGGREGATES)
+  bt_memset(&tree->aggregate, 0, sizeof(tree->aggregate));
+#endif
+#if defined(BT_REGION_NODES)
+  bt_memset(&tree->pool, 0, sizeof(tree->pool));
+#else
+  tree->node_cache_count = 0;
+#endif
+#if defined(BT_EPOCH_RECLAMATION)
+  tree->epoch_thread = NULL;
+#endif
+#if defined(BT_RADIX_ENGINE)
+  tree->engine = BT_ENGINE_BTree;
+  tree->radix_root = NULL;
+#endif
+#if defined(BT_UNSORTED_LEAVES)
+  tree->unsorted_leaf_count = 0;
+#endif
+  return BT_ERROR_Ok;
+}
+
+#if defined(BT_RADIX_ENGINE)
+/* NOTE(nick): Same as bt_create, engine picks what holds the keys for the whole life of
+ * the tree. */
+BT_API BT_ErrorCode
+bt_create_engine(BT_Context *tree, bt_u32 value_size, const BT_Allocator *allocator, BT_Engine engine)
+{
+  BT_ErrorCode error_code = bt_create(tree, value_size, allocator);
+  if (error_code == BT_ERROR_Ok) {
+    tree->engine = engine;
+  }
+  return error_code;
+}
+#endif
+
+BT_API BT_ErrorCode
+bt_destroy(BT_Context *tree)
+{
+  BT_Node *node = tree->root;
+
+#if defined(BT_RADIX_ENGINE)
+  bt_radix_free_subtree(tree, tree->radix_root);
+  tree->radix_root = NULL;
+#endif
+  bt_reset_stack(tree);
+#if defined(BT_REGION_NODES)
+  /* NOTE(nick): Every node lives in the slabs, no need to walk the tree. */
+  bt_pool_release(tree);
+  node = NULL;
+#endif
+  while (node != NULL) {
+    if (bt_is_node_leaf(node)) {
+      BT_StackFrame frame;
+
+      bt_free_node(tree, node);
+      node = NULL;
+      while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
+        frame.key_index += 1;
+
+        if (frame.key_index > frame.node->key_count) {
+          /* NOTE(nick): Traversed all sub nodes and returned back to the parent node. */
+          bt_free_node(tree, frame.node);
+        } else {
+          BT_Node *sub = bt_node_get_sub(tree, frame.node, frame.key_index);
+          if (sub != NULL) {
+            BT_ErrorCode error_code;
+
+            error_code = bt_push_stack_frame(tree, frame.node, frame.key_index);
+            if (error_code != BT_ERROR_Ok) {
+              return error_code;
+            }
+
+            node = sub;
+            BT_ASSERT(node->key_count > 0);
+
+            break;
+          }
+        }
+      }
+    } else {
+      BT_ErrorCode error_code;
+
+      /* NOTE(nick): Descending down to a first sub-node */
+      BT_ASSERT(node->key_count > 0);
+
+      error_code = bt_push_stack_frame(tree, node, 0);
+      if (error_code != BT_ERROR_Ok) {
+        return error_code;
+      }
+
+      node = bt_node_get_sub(tree, node, 0);
+    }
+  }
+
+#if !defined(BT_REGION_NODES)
+  bt_node_cache_drain(tree, 0);
+#endif
+#if defined(BT_UNSORTED_LEAVES)
+  tree->unsorted_leaf_count = 0;
+#endif
+
+  if (tree->frames != NULL) {
+    bt_free_memory(&tree->allocator, tree->frames, tree->frames_max * sizeof(BT_StackFrame), 0);
+  }
+  tree->frames_count = 0;
+  tree->frames_max = 0;
+  tree->frames = NULL;
+
+  bt_bloom_disable(tree);
+  bt_key_cache_disable(tree);
+
+  /* NOTE(nick): Pending writes are dropped together with the tree. */
+  if (tree->write_buffer.messages != NULL) {
+    bt_free_memory(&tree->allocator, tree->write_buffer.messages, tree->write_buffer.capacity * sizeof(BT_Message), 0);
+  }
+  bt_memset(&tree->write_buffer, 0, sizeof(tree->write_buffer));
+
+  tree->root = NULL;
+  bt_reset_edge_leaves(tree);
+
+  return BT_ERROR_Ok;
+}
+
+BT_INTERNAL bt_u64
+bt_hash_id(BT_KeyID id)
+{
+  /* NOTE(nick): 64-bit finalizer from MurmurHash3. */
+  bt_u64 h = id;
+  h ^= h >> 33;
+  h *= BT_U64_CONST(0xFF51AFD7, 0xED558CCD);
+  h ^= h >> 33;
+  h *= BT_U64_CONST(0xC4CEB9FE, 0x1A85EC53);
+  h ^= h >> 33;
+  return h;
+}
+
+BT_INTERNAL bt_u64 *
+bt_bloom_block(BT_Bloom *bloom, bt_u64 hash, bt_u64 *mask_out)
+{
+  /* NOTE(nick): Upper half of the hash picks a block, lower half is spread over the
+   * words of the block with odd multipliers, one bit per word. */
+  static const bt_u32 salts[BT_BLOOM_BLOCK_WORDS] = {
+    0x47B6137BUL, 0x44974D91UL, 0x8824AD5BUL, 0xA2B7289DUL,
+    0x705495C7UL, 0x2DF1424BUL, 0x9EFC4947UL, 0x5C6BFB31UL
+  };
+  bt_u32 low = (bt_u32)(hash & 0xFFFFFFFFUL);
+  bt_u32 i;
+
+  for (i = 0; i < BT_BLOOM_BLOCK_WORDS; ++i) {
+    bt_u32 bit = (bt_u32)((low * salts[i]) & 0xFFFFFFFFUL) >> 26;
+    mask_out[i] = (bt_u64)1 << bit;
+  }
+
+  return bloom->blocks + ((hash >> 32) & (bloom->block_count - 1)) * BT_BLOOM_BLOCK_WORDS;
+}
+
+BT_INTERNAL void
+bt_bloom_add(BT_Bloom *bloom, BT_KeyID id)
+{
+  bt_u64 mask[BT_BLOOM_BLOCK_WORDS];
+  bt_u64 *block = bt_bloom_block(bloom, bt_hash_id(id), mask);
+  bt_u32 i;
+
+  for (i = 0; i < BT_BLOOM_BLOCK_WORDS; ++i) {
+    block[i] |= mask[i];
+  }
+}
+
+BT_INTERNAL bt_bool
+bt_bloom_may_contain(BT_Bloom *bloom, BT_KeyID id)
+{
+  bt_u64 mask[BT_BLOOM_BLOCK_WORDS];
+  bt_u64 *block = bt_bloom_block(bloom, bt_hash_id(id), mask);
+  bt_u64 miss = 0;
+  bt_u32 i;
+
+  for (i = 0; i < BT_BLOOM_BLOCK_WORDS; ++i) {
+    miss |= mask[i] & ~block[i];
+  }
+
+  return miss == 0;
+}
+
+BT_INTERNAL bt_u32
+bt_write_buffer_find(BT_WriteBuffer *buffer, BT_KeyID id)
+{
+  bt_u32 min = 0;
+  bt_u32 max = buffer->count;
+
+  while (min < max) {
+    bt_u32 mid = min + (max - min) / 2;
+    if (buffer->messages[mid].key.id < id) {
+      min = mid + 1;
+    } else {
+      max = mid;
+    }
+  }
+
+  return min;
+}
+
+BT_INTERNAL BT_Message *
+bt_write_buffer_get(BT_WriteBuffer *buffer, BT_KeyID id)
+{
+  bt_u32 index = bt_write_buffer_find(buffer, id);
+  if (index < buffer->count && buffer->messages[index].key.id == id) {
+    return &buffer->messages[index];
+  }
+  return NULL;
+}
+
+BT_INTERNAL bt_u32
+bt_node_find_key_index_in(BT_Node *node, BT_KeyID id, bt_u32 min, bt_u32 max)
+{
+  while (min < max) {
+    bt_u32 mid = min + (max - min) / 2;
+    if (node->keys[mid].id < id) {
+      min = mid + 1;
+    } else {
+      max = mid;
+    }
+  }
+
+  return min;
+}
+
+BT_INTERNAL bt_u32
+bt_node_find_key_index(BT_Node *node, BT_KeyID id)
+{
+  /* NOTE(nick): Returns index of the first key that is not less than id, key_count when
+   * all keys are less. IDs are compared as unsigned, so the whole 64-bit range works. */
+  return bt_node_find_key_index_in(node, id, 0, node->key_count);
+}
+
+/* NOTE(nick): Same result as bt_node_find_key_index. Guesses the slot from where id falls
+ * between the first and the last id of the node and walks from there. A guess that is
+ * more than BT_INTERPOLATION_PROBE keys off falls back to binary search on its side. */
+BT_INTERNAL bt_u32
+bt_node_interpolate_key_index(BT_NodeSearchState *search, BT_Node *node, BT_KeyID id)
+{
+  bt_u32 count = node->key_count;
+  BT_KeyID first = node->keys[0].id;
+  BT_KeyID last = node->keys[count - 1].id;
+  bt_u64 span;
+  bt_u64 offset;
+  bt_u32 guess;
+  bt_u32 probe;
+
+  if (id <= first) {
+    return 0;
+  }
+  if (id > last) {
+    return count;
+  }
+
+  /* NOTE(nick): Scaled down until offset * (count - 1) can't overflow. */
+  span = last - first;
+  offset = id - first;
+  while ((span >> 32) != 0) {
+    span >>= 8;
+    offset >>= 8;
+  }
+  guess = (bt_u32)(offset * (count - 1) / span);
+  search->stats.guesses += 1;
+  search->window_guesses += 1;
+
+  /* NOTE(nick): first < id <= last, so the slot is in 1..count-1 and neither walk can run
+   * off the node. */
+  if (node->keys[guess].id < id) {
+    for (probe = 0; probe < BT_INTERPOLATION_PROBE; ++probe) {
+      guess += 1;
+      if (node->keys[guess].id >= id) {
+        return guess;
+      }
+    }
+    search->stats.fallbacks += 1;
+    search->window_fallbacks += 1;
+    return bt_node_find_key_index_in(node, id, guess + 1, count);
+  }
+
+  for (probe = 0; probe < BT_INTERPOLATION_PROBE; ++probe) {
+    if (node->keys[guess - 1].id < id) {
+      return guess;
+    }
+    guess -= 1;
+  }
+  search->stats.fallbacks += 1;
+  search->window_fallbacks += 1;
+  return bt_node_find_key_index_in(node, id, 0, guess);
+}
+
+BT_INTERNAL bt_u32
+bt_node_search(BT_Context *tree, BT_Node *node, BT_KeyID id)
+{
+  BT_NodeSearchState *search = &tree->node_search;
+
+  if (search->mode == BT_NODE_SEARCH_Binary || node->key_count < BT_INTERPOLATION_MIN_KEYS) {
+    return bt_node_find_key_index(node, id);
+  }
+
+  if (search->mode == BT_NODE_SEARCH_Auto) {
+    search->window -= 1;
+    if (search->window == 0) {
+      if (search->interpolate) {
+        search->interpolate = (search->window_fallbacks * 4 <= search->window_guesses);
+      } else {
+        search->interpolate = bt_true;
+      }
+      search->window = BT_NODE_SEARCH_WINDOW;
+      search->window_guesses = 0;
+      search->window_fallbacks = 0;
+    }
+  }
+
+  if (!search->interpolate) {
+    return bt_node_find_key_index(node, id);
+  }
+  return bt_node_interpolate_key_index(search, node, id);
+}
+
+#if defined(BT_UNSORTED_LEAVES)
+#if defined(__SSE2__) && !defined(BT_NO_SIMD) && !defined(BT_UNSORTED_SSE2)
+  #define BT_UNSORTED_SSE2
+#endif
+
+#if defined(BT_UNSORTED_SSE2)
+  #include <emmintrin.h>
+#endif
+
+BT_INTERNAL bt_u08
+bt_fingerprint(BT_KeyID id)
+{
+  return (bt_u08)((id * BT_U64_CONST(0x9E3779B9, 0x7F4A7C15)) >> 56);
+}
+
+/* NOTE(nick): Slot of id among the unsorted keys at the end of a leaf, key_count when it
+ * isn't one of them. Only slots whose fingerprint matches get their id compared. */
+BT_INTERNAL bt_u32
+bt_unsorted_find(BT_Node *node, BT_KeyID id)
+{
+  bt_u32 count = node->key_count;
+  bt_u32 first = count - node->unsorted_count;
+  bt_u08 fingerprint = bt_fingerprint(id);
+  bt_u32 slot;
+#if defined(BT_UNSORTED_SSE2)
+  __m128i needle = _mm_set1_epi8((char)fingerprint);
+  bt_u32 base;
+
+  /* NOTE(nick): fingerprints is padded to a multiple of 16, blocks never read past it. */
+  for (base = first - first % 16; base < count; base += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&node->fingerprints[base]);
+    bt_u32 mask = (bt_u32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+    for (slot = base; mask != 0; ++slot, mask >>= 1) {
+      if ((mask & 1) != 0 && slot >= first && slot < count && node->keys[slot].id == id) {
+        return slot;
+      }
+    }
+  }
+#else
+  for (slot = first; slot < count; ++slot) {
+    if (node->fingerprints[slot] == fingerprint && node->keys[slot].id == id) {
+      return slot;
+    }
+  }
+#endif
+  return count;
+}
+
+/* NOTE(nick): Insertion sort of the unsorted keys into the sorted ones in front of them. */
+BT_INTERNAL void
+bt_unsorted_sort(BT_Node *node)
+{
+  bt_u32 i;
+
+  for (i = node->key_count - node->unsorted_count; i < node->key_count; ++i) {
+    BT_Key key = node->keys[i];
+    bt_u32 j = i;
+
+    while (j > 0 && node->keys[j - 1].id > key.id) {
+      node->keys[j] = node->keys[j - 1];
+      j -= 1;
+    }
+    node->keys[j] = key;
+  }
+  node->unsorted_count = 0;
+}
+
+/* NOTE(nick): Leaves only get freed, moved or walked in order after this ran, so the list
+ * never points at a node that is gone. */
+BT_INTERNAL void
+bt_sort_leaves(BT_Context *tree)
+{
+  bt_u32 i;
+
+  for (i = 0; i < tree->unsorted_leaf_count; ++i) {
+    bt_unsorted_sort(tree->unsorted_leaves[i]);
+  }
+  tree->unsorted_leaf_count = 0;
+}
+
+/* NOTE(nick): Puts id at the end of leaf unless that would fill it up and need a split. */
+BT_INTERNAL bt_bool
+bt_unsorted_append(BT_Context *tree, BT_Node *leaf, BT_KeyID id, const void *data)
+{
+  if (leaf->key_count + 1 >= BT_KEY_COUNT) {
+    return bt_false;
+  }
+  if (leaf->unsorted_count == 0) {
+    if (tree->unsorted_leaf_count == BT_UNSORTED_LEAF_COUNT) {
+      bt_sort_leaves(tree);
+    }
+    tree->unsorted_leaves[tree->unsorted_leaf_count] = leaf;
+    tree->unsorted_leaf_count += 1;
+  }
+  leaf->fingerprints[leaf->key_count] = bt_fingerprint(id);
+  bt_node_set_key(leaf, leaf->key_count, id, data);
+  leaf->key_count += 1;
+  leaf->unsorted_count += 1;
+  return bt_true;
+}
+#endif
+
+BT_INTERNAL void
+bt_cursor_push(BT_Cursor *cursor, BT_Node *node, bt_u32 key_index)
+{
+  BT_ASSERT(cursor->depth < BT_COUNTOF(cursor->frames));
+  cursor->frames[cursor->depth].node = node;
+  cursor->frames[cursor->depth].key_index = (bt_u08)key_index;
+  cursor->frames[cursor->depth].next = NULL;
+  cursor->depth += 1;
+}
+
+BT_INTERNAL BT_Key *
+bt_cursor_settle_forward(BT_Cursor *cursor)
+{
+  /* NOTE(nick): Top frame points past the last key of its node, climbing up until a
+   * parent has a key right after the sub-node we came from. */
+  while (cursor->depth > 0) {
+    BT_StackFrame *frame = &cursor->frames[cursor->depth - 1];
+    if (frame->key_index < frame->node->key_count) {
+      return bt_node_get_key(frame->node, frame->key_index);
+    }
+    cursor->depth -= 1;
+  }
+  return NULL;
+}
+
+BT_INTERNAL BT_Key *
+bt_cursor_settle_backward(BT_Cursor *cursor)
+{
+  /* NOTE(nick): Top frame points at a gap, the key we want is the one in front of it. */
+  while (cursor->depth > 0) {
+    BT_StackFrame *frame = &cursor->frames[cursor->depth - 1];
+    if (frame->key_index > 0) {
+      frame->key_index -= 1;
+      return bt_node_get_key(frame->node, frame->key_index);
+    }
+    cursor->depth -= 1;
+  }
+  return NULL;
+}
+
+BT_INTERNAL void
+bt_cursor_descend_leftmost(BT_Cursor *cursor, BT_Node *node)
+{
+  while (node != NULL) {
+    bt_cursor_push(cursor, node, 0);
+    node = bt_node_get_sub(cursor->tree, node, 0);
+  }
+}
+
+BT_INTERNAL void
+bt_cursor_descend_rightmost(BT_Cursor *cursor, BT_Node *node)
+{
+  while (node != NULL) {
+    bt_cursor_push(cursor, node, node->key_count);
+    node = bt_node_get_sub(cursor->tree, node, node->key_count);
+  }
+}
+
+BT_INTERNAL BT_Key *
+bt_seek(BT_Context *tree, BT_KeyID id, BT_SeekMode mode, BT_Cursor *cursor)
+{
+  BT_Cursor cursor_local;
+  BT_Node *node;
+
+  if (cursor == NULL) {
+    cursor = &cursor_local;
+  }
+  cursor->tree = tree;
+  cursor->depth = 0;
+
+  if (bt_flush_writes(tree) != BT_ERROR_Ok) {
+    return NULL;
+  }
+  node = tree->root;
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return bt_radix_cursor_set(cursor, bt_radix_seek_mode(tree, id, mode));
+  }
+#endif
+
+  while (node != NULL) {
+    bt_u32 key_index = bt_node_search(tree, node, id);
+
+    if (key_index < node->key_count && node->keys[key_index].id == id) {
+      if (mode == BT_SEEK_GreaterEqual || mode == BT_SEEK_LessEqual) {
+        bt_cursor_push(cursor, node, key_index);
+        return bt_node_get_key(node, key_index);
+      } else if (mode == BT_SEEK_Greater) {
+        /* NOTE(nick): Everything in the right sub-node is greater, descent keeps going
+         * to its leftmost key. */
+        key_index += 1;
+      }
+    }
+
+    bt_cursor_push(cursor, node, key_index);
+    node = bt_node_get_sub(tree, node, key_index);
+  }
+
+  if (mode == BT_SEEK_GreaterEqual || mode == BT_SEEK_Greater) {
+    return bt_cursor_settle_forward(cursor);
+  }
+  return bt_cursor_settle_backward(cursor);
+}
+
+BT_INTERNAL BT_KeyCacheEntry *
+bt_key_cache_entry(BT_KeyCache *cache, BT_KeyID id)
+{
+  return &cache->entries[(id * BT_U64_CONST(0x9E3779B9, 0x7F4A7C15)) >> cache->entry_shift];
+}
+
+BT_INTERNAL BT_Key *
+bt_search_tree(BT_Context *tree, BT_KeyID id)
+{
+  BT_Node *node = tree->root;
+  BT_KeyCacheEntry *entry = NULL;
+
+  if (tree->key_cache.entries != NULL) {
+    entry = bt_key_cache_entry(&tree->key_cache, id);
+    if (entry->id == id && entry->free_epoch == tree->key_cache.free_epoch && entry->free_count == entry->node->free_count &&
+        entry->key_index < entry->node->key_count && entry->node->keys[entry->key_index].id == id) {
+      tree->key_cache.stats.hits += 1;
+      return &entry->node->keys[entry->key_index];
+    }
+    tree->key_cache.stats.misses += 1;
+  }
+
+  if (tree->bloom.blocks != NULL) {
+    tree->bloom.stats.lookups += 1;
+    if (!bt_bloom_may_contain(&tree->bloom, id)) {
+      tree->bloom.stats.filtered += 1;
+      return NULL;
+    }
+  }
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    BT_Key *key = bt_radix_search(tree, id);
+    if (key != NULL) {
+      return key;
+    }
+  }
+#endif
+
+  while (node != NULL) {
+    bt_u32 key_index;
+
+    BT_ASSERT(node->key_count > 0);
+#if defined(BT_UNSORTED_LEAVES)
+    if (node->unsorted_count > 0) {
+      /* NOTE(nick): Leaf, either id is one of the appended keys or it's in the sorted part. */
+      key_index = bt_unsorted_find(node, id);
+      if (key_index == node->key_count) {
+        key_index = bt_node_find_key_index_in(node, id, 0, node->key_count - node->unsorted_count);
+      }
+    } else {
+      key_index = bt_node_search(tree, node, id);
+    }
+#else
+    key_index = bt_node_search(tree, node, id);
+#endif
+    if (key_index < node->key_count && node->keys[key_index].id == id) {
+      if (entry != NULL) {
+        entry->id = id;
+        entry->node = node;
+        entry->free_epoch = tree->key_cache.free_epoch;
+        entry->free_count = node->free_count;
+        entry->key_index = key_index;
+      }
+      return &node->keys[key_index];
+    }
+    node = bt_node_get_sub(tree, node, key_index);
+  }
+
+  if (tree->bloom.blocks != NULL) {
+    tree->bloom.stats.false_positives += 1;
+  }
+
+  return NULL;
+}
+
+BT_API BT_Key *
+bt_search(BT_Context *tree, BT_KeyID id, bt_bool get_nearest)
+{
+  if (get_nearest) {
+    return bt_seek(tree, id, BT_SEEK_LessEqual, NULL);
+  }
+
+  if (tree->write_buffer.count > 0) {
+    BT_Message *message = bt_write_buffer_get(&tree->write_buffer, id);
+    if (message != NULL) {
+      if (message->kind == BT_MESSAGE_Delete) {
+        return NULL;
+      } else if (message->kind == BT_MESSAGE_Upsert) {
+        return &message->key;
+      } else {
+        /* NOTE(nick): Pending insert doesn't override a key that is already in the tree. */
+        BT_Key *key = bt_search_tree(tree, id);
+        return (key != NULL) ? key : &message->key;
+      }
+    }
+  }
+
+  return bt_search_tree(tree, id);
+}
+
+BT_INTERNAL void
+bt_prefetch_node(BT_Node *node)
+{
+  bt_u32 offset;
+
+  for (offset = 0; offset < sizeof(BT_Node); offset += 64) {
+    bt_prefetch((const bt_u08 *)node + offset);
+  }
+}
+
+/* NOTE(nick): Interleaves up to BT_SEARCH_BATCH_WIDTH descents. Every step looks at one
+ * node of one lookup, prefetches the sub-node it goes down to and moves on to the next
+ * lookup, so loads of different lookups overlap instead of waiting on each other. Results
+ * come in the order lookups finish, keys stay valid until the tree is modified. */
+BT_API BT_ErrorCode
+bt_search_batch(BT_Context *tree, const BT_KeyID *ids, bt_u64 id_count, void *user_context, bt_search_result_sig *result)
+{
+  BT_Node *nodes[BT_SEARCH_BATCH_WIDTH];
+  bt_u64 probes[BT_SEARCH_BATCH_WIDTH];
+  bt_u64 next_probe = 0;
+  bt_u32 active_count = 0;
+  bt_u32 slot;
+  BT_ErrorCode error_code;
+
+  if (result == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    for (next_probe = 0; next_probe < id_count; ++next_probe) {
+      if (result(user_context, next_probe, ids[next_probe], bt_search_tree(tree, ids[next_probe])) == bt_false) {
+        break;
+      }
+    }
+    return BT_ERROR_Ok;
+  }
+#endif
+
+  for (slot = 0; slot < BT_SEARCH_BATCH_WIDTH; ++slot) {
+    nodes[slot] = NULL;
+  }
+
+  for (slot = 0; ; slot = (slot + 1) % BT_SEARCH_BATCH_WIDTH) {
+    BT_Node *node = nodes[slot];
+    BT_KeyID id;
+    bt_u32 key_index;
+
+    if (node == NULL) {
+      /* NOTE(nick): Free slot takes the next probe, probes the filter rules out finish
+       * right here. */
+      while (next_probe < id_count) {
+        id = ids[next_probe];
+        if (tree->bloom.blocks != NULL) {
+          tree->bloom.stats.lookups += 1;
+          if (!bt_bloom_may_contain(&tree->bloom, id)) {
+            tree->bloom.stats.filtered += 1;
+            node = NULL;
+          } else {
+            node = tree->root;
+          }
+        } else {
+          node = tree->root;
+        }
+        if (node != NULL) {
+          break;
+        }
+        if (result(user_context, next_probe, id, NULL) == bt_false) {
+          return BT_ERROR_Ok;
+        }
+        next_probe += 1;
+      }
+
+      if (node != NULL) {
+        bt_prefetch_node(node);
+        nodes[slot] = node;
+        probes[slot] = next_probe;
+        next_probe += 1;
+        active_count += 1;
+      } else if (active_count == 0) {
+        break;
+      }
+      continue;
+    }
+
+    id = ids[probes[slot]];
+    key_index = bt_node_search(tree, node, id);
+    if (key_index < node->key_count && node->keys[key_index].id == id) {
+      nodes[slot] = NULL;
+      active_count -= 1;
+      if (result(user_context, probes[slot], id, &node->keys[key_index]) == bt_false) {
+        return BT_ERROR_Ok;
+      }
+    } else {
+      node = bt_node_get_sub(tree, node, key_index);
+      if (node != NULL) {
+        bt_prefetch_node(node);
+        nodes[slot] = node;
+      } else {
+        nodes[slot] = NULL;
+        active_count -= 1;
+        if (tree->bloom.blocks != NULL) {
+          tree->bloom.stats.false_positives += 1;
+        }
+        if (result(user_context, probes[slot], id, NULL) == bt_false) {
+          return BT_ERROR_Ok;
+        }
+      }
+    }
+  }
+
+  return BT_ERROR_Ok;
+}
+
+/* NOTE(nick): Seeks apply buffered writes first, which modifies the tree and invalidates
+ * its other cursors. NULL with an invalid cursor when applying them fails. */
+BT_API BT_Key *
+bt_lower_bound(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor)
+{
+  return bt_seek(tree, id, BT_SEEK_GreaterEqual, cursor);
+}
+
+BT_API BT_Key *
+bt_upper_bound(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor)
+{
+  return bt_seek(tree, id, BT_SEEK_Greater, cursor);
+}
+
+BT_API BT_Key *
+bt_floor(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor)
+{
+  return bt_seek(tree, id, BT_SEEK_LessEqual, cursor);
+}
+
+BT_API BT_Key *
+bt_ceiling(BT_Context *tree, BT_KeyID id, BT_Cursor *cursor)
+{
+  return bt_seek(tree, id, BT_SEEK_GreaterEqual, cursor);
+}
+
+BT_INTERNAL BT_Key *
+bt_cursor_seek_first(BT_Context *tree, BT_Cursor *cursor)
+{
+  cursor->tree = tree;
+  cursor->depth = 0;
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    BT_RadixLeaf *leaf = bt_radix_edge(tree->radix_root, bt_false);
+    return bt_radix_cursor_set(cursor, (leaf != NULL) ? &leaf->key : NULL);
+  }
+#endif
+  bt_cursor_descend_leftmost(cursor, tree->root);
+  return bt_cursor_settle_forward(cursor);
+}
+
+BT_INTERNAL BT_Key *
+bt_cursor_seek_last(BT_Context *tree, BT_Cursor *cursor)
+{
+  cursor->tree = tree;
+  cursor->depth = 0;
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    BT_RadixLeaf *leaf = bt_radix_edge(tree->radix_root, bt_true);
+    return bt_radix_cursor_set(cursor, (leaf != NULL) ? &leaf->key : NULL);
+  }
+#endif
+  bt_cursor_descend_rightmost(cursor, tree->root);
+  return bt_cursor_settle_backward(cursor);
+}
+
+/* NOTE(nick): Same as the seeks, buffered writes get applied before the cursor is placed
+ * and a failure to apply them leaves it invalid. */
+BT_API BT_Key *
+bt_cursor_first(BT_Context *tree, BT_Cursor *cursor)
+{
+  if (bt_flush_writes(tree) != BT_ERROR_Ok) {
+    cursor->tree = tree;
+    cursor->depth = 0;
+    return NULL;
+  }
+  return bt_cursor_seek_first(tree, cursor);
+}
+
+BT_API BT_Key *
+bt_cursor_last(BT_Context *tree, BT_Cursor *cursor)
+{
+  if (bt_flush_writes(tree) != BT_ERROR_Ok) {
+    cursor->tree = tree;
+    cursor->depth = 0;
+    return NULL;
+  }
+  return bt_cursor_seek_last(tree, cursor);
+}
+
+BT_API BT_Key *
+bt_cursor_key(BT_Cursor *cursor)
+{
+  BT_StackFrame *frame;
+
+  if (cursor->depth == 0) {
+    return NULL;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (cursor->tree->engine == BT_ENGINE_Radix) {
+    return cursor->radix_key;
+  }
+#endif
+  frame = &cursor->frames[cursor->depth - 1];
+  return bt_node_get_key(frame->node, frame->key_index);
+}
+
+BT_API BT_Key *
+bt_cursor_next(BT_Cursor *cursor)
+{
+  BT_StackFrame *frame;
+
+  if (cursor->depth == 0) {
+    return NULL;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (cursor->tree->engine == BT_ENGINE_Radix) {
+    return bt_radix_cursor_set(cursor, bt_radix_seek_mode(cursor->tree, cursor->radix_key->id, BT_SEEK_Greater));
+  }
+#endif
+  frame = &cursor->frames[cursor->depth - 1];
+  frame->key_index += 1;
+  bt_cursor_descend_leftmost(cursor, bt_node_get_sub(cursor->tree, frame->node, frame->key_index));
+  return bt_cursor_settle_forward(cursor);
+}
+
+BT_API BT_Key *
+bt_cursor_prev(BT_Cursor *cursor)
+{
+  BT_StackFrame *frame;
+
+  if (cursor->depth == 0) {
+    return NULL;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (cursor->tree->engine == BT_ENGINE_Radix) {
+    return bt_radix_cursor_set(cursor, bt_radix_seek_mode(cursor->tree, cursor->radix_key->id, BT_SEEK_Less));
+  }
+#endif
+  frame = &cursor->frames[cursor->depth - 1];
+  bt_cursor_descend_rightmost(cursor, bt_node_get_sub(cursor->tree, frame->node, frame->key_index));
+  return bt_cursor_settle_backward(cursor);
+}
+
+/* NOTE(nick): Moves cursor forward to the first key not less than id. Climbs only as high
+ * as the first ancestor whose separator is not less than id and descends from there, so
+ * a skip over d keys costs O(log d) instead of a search from the root. */
+BT_INTERNAL BT_Key *
+bt_cursor_gallop(BT_Cursor *cursor, BT_KeyID id)
+{
+  BT_Key *key = bt_cursor_key(cursor);
+  BT_Node *node;
+
+  if (key == NULL || key->id >= id) {
+    return key;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (cursor->tree->engine == BT_ENGINE_Radix) {
+    return bt_radix_cursor_set(cursor, bt_radix_seek_mode(cursor->tree, id, BT_SEEK_GreaterEqual));
+  }
+#endif
+
+  while (cursor->depth > 1) {
+    BT_StackFrame *parent = &cursor->frames[cursor->depth - 2];
+    if (parent->key_index < parent->node->key_count && parent->node->keys[parent->key_index].id >= id) {
+      break;
+    }
+    cursor->depth -= 1;
+  }
+
+  cursor->depth -= 1;
+  node = cursor->frames[cursor->depth].node;
+  while (node != NULL) {
+    bt_u32 key_index = bt_node_search(cursor->tree, node, id);
+
+    bt_cursor_push(cursor, node, key_index);
+    if (key_index < node->key_count && node->keys[key_index].id == id) {
+      return bt_node_get_key(node, key_index);
+    }
+    node = bt_node_get_sub(cursor->tree, node, key_index);
+  }
+  return bt_cursor_settle_forward(cursor);
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_bloom_build(BT_Context *tree, bt_u64 key_capacity)
+{
+  BT_Bloom *bloom = &tree->bloom;
+  BT_Cursor cursor;
+  BT_Key *key;
+  bt_u64 *blocks;
+  bt_u64 block_count = 1;
+  bt_u64 key_count = 0;
+
+  while (block_count * BT_BLOOM_BLOCK_WORDS * 64 < key_capacity * BT_BLOOM_BITS_PER_KEY) {
+    block_count *= 2;
+  }
+
+  blocks = (bt_u64 *)bt_alloc_memory(&tree->allocator, block_count * BT_BLOOM_BLOCK_WORDS * sizeof(bt_u64), 0);
+  if (blocks == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  bt_memset(blocks, 0, block_count * BT_BLOOM_BLOCK_WORDS * sizeof(bt_u64));
+
+  if (bloom->blocks != NULL) {
+    bt_free_memory(&tree->allocator, bloom->blocks, bloom->block_count * BT_BLOOM_BLOCK_WORDS * sizeof(bt_u64), 0);
+  }
+  bloom->blocks = blocks;
+  bloom->block_count = block_count;
+
+  for (key = bt_cursor_seek_first(tree, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+    bt_bloom_add(bloom, key->id);
+    key_count += 1;
+  }
+
+  bloom->key_count = key_count;
+  bloom->delete_count = 0;
+  bloom->stats.rebuilds += 1;
+
+  return BT_ERROR_Ok;
+}
+
+BT_INTERNAL bt_u64
+bt_bloom_capacity(BT_Bloom *bloom)
+{
+  return bloom->block_count * BT_BLOOM_BLOCK_WORDS * 64 / BT_BLOOM_BITS_PER_KEY;
+}
+
+BT_API BT_ErrorCode
+bt_bloom_enable(BT_Context *tree, bt_u64 expected_key_count)
+{
+  if (expected_key_count == 0) {
+    expected_key_count = 1;
+  }
+  tree->bloom.key_capacity = expected_key_count;
+  return bt_bloom_build(tree, expected_key_count);
+}
+
+BT_API void
+bt_bloom_disable(BT_Context *tree)
+{
+  if (tree->bloom.blocks != NULL) {
+    bt_free_memory(&tree->allocator, tree->bloom.blocks, tree->bloom.block_count * BT_BLOOM_BLOCK_WORDS * sizeof(bt_u64), 0);
+  }
+  bt_memset(&tree->bloom, 0, sizeof(tree->bloom));
+}
+
+BT_API BT_ErrorCode
+bt_bloom_rebuild(BT_Context *tree)
+{
+  BT_Bloom *bloom = &tree->bloom;
+  bt_u64 capacity;
+
+  if (bloom->blocks == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+  capacity = bloom->key_capacity;
+  if (capacity < bloom->key_count) {
+    capacity = bloom->key_count;
+  }
+  return bt_bloom_build(tree, capacity);
+}
+
+BT_API void
+bt_bloom_get_stats(BT_Context *tree, BT_BloomStats *stats_out)
+{
+  *stats_out = tree->bloom.stats;
+}
+
+/* NOTE(nick): entry_count is rounded up to a power of two, at least 2. Enabling again
+ * drops the entries and the stats. */
+BT_API BT_ErrorCode
+bt_key_cache_enable(BT_Context *tree, bt_u64 entry_count)
+{
+  BT_KeyCache *cache = &tree->key_cache;
+  BT_KeyCacheEntry *entries;
+  bt_u32 entry_bits = 1;
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return BT_ERROR_OpDenied;
+  }
+#endif
+
+  while (((bt_u64)1 << entry_bits) < entry_count && entry_bits < 63) {
+    entry_bits += 1;
+  }
+  entries = (BT_KeyCacheEntry *)bt_alloc_memory(&tree->allocator, ((bt_u64)1 << entry_bits) * sizeof(BT_KeyCacheEntry), 64);
+  if (entries == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  bt_memset(entries, 0, ((bt_u64)1 << entry_bits) * sizeof(BT_KeyCacheEntry));
+
+  bt_key_cache_disable(tree);
+  cache->entries = entries;
+  cache->entry_count = (bt_u64)1 << entry_bits;
+  cache->entry_shift = 64 - entry_bits;
+  cache->free_epoch = 1;
+  return BT_ERROR_Ok;
+}
+
+BT_API void
+bt_key_cache_disable(BT_Context *tree)
+{
+  BT_KeyCache *cache = &tree->key_cache;
+
+  if (cache->entries != NULL) {
+    bt_free_memory(&tree->allocator, cache->entries, cache->entry_count * sizeof(BT_KeyCacheEntry), 64);
+  }
+  bt_memset(cache, 0, sizeof(*cache));
+}
+
+BT_API void
+bt_key_cache_get_stats(BT_Context *tree, BT_KeyCacheStats *stats_out)
+{
+  *stats_out = tree->key_cache.stats;
+}
+
+/* NOTE(nick): Only lookups (search, seek, cursors, batches) use the mode, inserts and
+ * deletes keep walking their nodes as before. Setting the mode resets the stats. */
+BT_API void
+bt_set_node_search(BT_Context *tree, BT_NodeSearch mode)
+{
+  BT_NodeSearchState *search = &tree->node_search;
+
+  bt_memset(search, 0, sizeof(*search));
+  search->mode = mode;
+  search->interpolate = (mode != BT_NODE_SEARCH_Binary);
+  search->window = BT_NODE_SEARCH_WINDOW;
+}
+
+BT_API void
+bt_node_search_get_stats(BT_Context *tree, BT_NodeSearchStats *stats_out)
+{
+  *stats_out = tree->node_search.stats;
+}
+
+BT_INTERNAL void
+bt_bloom_on_insert(BT_Context *tree, BT_KeyID id)
+{
+  BT_Bloom *bloom = &tree->bloom;
+
+  if (bloom->blocks != NULL) {
+    bt_bloom_add(bloom, id);
+    bloom->key_count += 1;
+    if (bloom->key_count > bt_bloom_capacity(bloom) * 2) {
+      /* NOTE(nick): Filter got saturated, growing it. On failure the old one still
+       * answers correctly, just with more false positives. */
+      bt_bloom_build(tree, bloom->key_count * 2);
+    }
+  }
+}
+
+BT_INTERNAL void
+bt_bloom_on_delete(BT_Context *tree, bt_u64 deleted_count)
+{
+  BT_Bloom *bloom = &tree->bloom;
+
+  if (bloom->blocks != NULL) {
+    /* NOTE(nick): Bits can't be cleared, deleted keys only make the filter less selective.
+     * Rebuilding once a quarter of the keys are gone keeps it amortized O(1). */
+    bloom->key_count -= (deleted_count < bloom->key_count) ? deleted_count : bloom->key_count;
+    bloom->delete_count += deleted_count;
+    if (bloom->delete_count > bloom->key_count / 4 && bloom->delete_count >= BT_BLOOM_MIN_REBUILD) {
+      bt_bloom_rebuild(tree);
+    }
+  }
+}
+
+#if defined(BT_ORDER_STATISTICS)
+BT_INTERNAL bt_u64
+bt_rank_internal(BT_Context *tree, BT_KeyID id, bt_bool inclusive)
+{
+  /* NOTE(nick): Counts keys that are less than id (or equal when inclusive). */
+  BT_WriteBuffer *buffer = &tree->write_buffer;
+  BT_Node *node;
+  bt_u64 result = 0;
+  bt_u64 removed = 0;
+  bt_u32 message_index;
+
+  /* NOTE(nick): Messages left in the buffer after a failed flush are counted one by one
+   * against the keys they would add or remove. */
+  if (bt_flush_writes(tree) != BT_ERROR_Ok) {
+    for (message_index = 0; message_index < buffer->count; ++message_index) {
+      BT_Message *message = &buffer->messages[message_index];
+      bt_bool present;
+
+      if (message->key.id > id || (message->key.id == id && !inclusive)) {
+        break;
+      }
+      present = (bt_search_tree(tree, message->key.id) != NULL);
+      if (message->kind == BT_MESSAGE_Delete) {
+        removed += present ? 1 : 0;
+      } else {
+        result += present ? 0 : 1;
+      }
+    }
+  }
+  node = tree->root;
+
+  while (node != NULL) {
+    bt_u32 key_index = bt_node_find_key_index(node, id);
+    bt_u32 i;
+
+    for (i = 0; i < key_index; ++i) {
+      result += node->counts[i];
+    }
+    result += key_index;
+
+    if (key_index < node->key_count && node->keys[key_index].id == id) {
+      result += node->counts[key_index];
+      if (inclusive) {
+        result += 1;
+      }
+      break;
+    }
+
+    node = bt_node_get_sub(tree, node, key_index);
+  }
+
+  return result - removed;
+}
+
+/* NOTE(nick): Rank and count_range apply buffered writes first. If that fails, the
+ * messages still in the buffer are folded into the count, so the result stays exact. */
+BT_API bt_u64
+bt_rank(BT_Context *tree, BT_KeyID id)
+{
+  return bt_rank_internal(tree, id, bt_false);
+}
+
+/* NOTE(nick): Applies buffered writes first like a seek, NULL when that fails. */
+BT_API BT_Key *
+bt_select(BT_Context *tree, bt_u64 rank, BT_Cursor *cursor)
+{
+  BT_Cursor cursor_local;
+  BT_Node *node;
+
+  if (cursor == NULL) {
+    cursor = &cursor_local;
+  }
+  cursor->tree = tree;
+  cursor->depth = 0;
+
+  if (bt_flush_writes(tree) != BT_ERROR_Ok) {
+    return NULL;
+  }
+  node = tree->root;
+
+  while (node != NULL) {
+    bt_u32 i;
+
+    for (i = 0; i <= node->key_count; ++i) {
+      if (rank < node->counts[i]) {
+        break;
+      }
+      rank -= node->counts[i];
+
+      if (i < node->key_count) {
+        if (rank == 0) {
+          bt_cursor_push(cursor, node, i);
+          return bt_node_get_key(node, i);
+        }
+        rank -= 1;
+      }
+    }
+
+    if (i > node->key_count) {
+      /* NOTE(nick): Rank is past the last key of the tree. */
+      break;
+    }
+
+    bt_cursor_push(cursor, node, i);
+    node = bt_node_get_sub(tree, node, i);
+  }
+
+  cursor->depth = 0;
+  return NULL;
+}
+
+BT_API bt_u64
+bt_count_range(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_max)
+{
+  if (id_min > id_max) {
+    return 0;
+  }
+  return bt_rank_internal(tree, id_max, bt_true) - bt_rank_internal(tree, id_min, bt_false);
+}
+#endif
+
+#if defined(BT_AGGREGATES)
+BT_API BT_ErrorCode
+bt_set_aggregate(BT_Context *tree, const BT_Aggregate *aggregate)
+{
+  if (tree->root != NULL) {
+    /* NOTE(nick): Cached aggregates of existing nodes would be stale. */
+    return BT_ERROR_OpDenied;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return BT_ERROR_OpDenied;
+  }
+#endif
+  if (aggregate != NULL) {
+    if (aggregate->map == NULL || aggregate->combine == NULL) {
+      return BT_ERROR_OpDenied;
+    }
+    tree->aggregate = *aggregate;
+  } else {
+    bt_memset(&tree->aggregate, 0, sizeof(tree->aggregate));
+  }
+  return BT_ERROR_Ok;
+}
+
+/* NOTE(nick): Applies buffered writes first, which modifies the tree and invalidates its
+ * cursors. A failure to apply them is returned and result_out is left as it is. */
+BT_API BT_ErrorCode
+bt_aggregate_range(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_max, BT_AggregateValue *result_out)
+{
+  BT_Aggregate *aggregate = &tree->aggregate;
+  BT_AggregateValue result = aggregate->identity;
+  BT_Node *node;
+  BT_Node *node_left = NULL;
+  BT_Node *node_right = NULL;
+  BT_ErrorCode error_code;
+
+  if (aggregate->map == NULL || id_min > id_max) {
+    *result_out = result;
+    return BT_ERROR_Ok;
+  }
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+  node = tree->root;
+
+  /* NOTE(nick): Descending until the range gets split by keys of a node. */
+  while (node != NULL) {
+    bt_u32 key_first = bt_node_find_key_index(node, id_min);
+    bt_u32 key_end = bt_node_find_key_index(node, id_max);
+    bt_bool left_inclusive, right_inclusive;
+
+    right_inclusive = (key_end < node->key_count && node->keys[key_end].id == id_max);
+    if (right_inclusive) {
+      key_end += 1;
+    }
+
+    if (key_first == key_end) {
+      node = bt_node_get_sub(tree, node, key_first);
+      continue;
+    }
+
+    left_inclusive = (node->keys[key_first].id == id_min);
+    if (!left_inclusive) {
+      node_left = bt_node_get_sub(tree, node, key_first);
+    }
+    if (!right_inclusive) {
+      node_right = bt_node_get_sub(tree, node, key_end);
+    }
+
+    /* NOTE(nick): Sub-node after the last key is handled by the right walk. */
+    result = bt_aggregate_keys(tree, node, key_first, key_end - 1, bt_false);
+    result = aggregate->combine(aggregate->user_context, result, bt_aggregate_key(tree, node, key_end - 1));
+    break;
+  }
+
+  /* NOTE(nick): Left walk, everything that is not less than id_min. Deeper levels are
+   * further left in key order, so they get prepended. */
+  while (node_left != NULL) {
+    bt_u32 key_first = bt_node_find_key_index(node_left, id_min);
+    BT_AggregateValue part = bt_aggregate_keys(tree, node_left, key_first, node_left->key_count, bt_false);
+
+    result = aggregate->combine(aggregate->user_context, part, result);
+    if (key_first < node_left->key_count && node_left->keys[key_first].id == id_min) {
+      break;
+    }
+    node_left = bt_node_get_sub(tree, node_left, key_first);
+  }
+
+  /* NOTE(nick): Right walk, everything that is not greater than id_max. */
+  while (node_right != NULL) {
+    bt_u32 key_end = bt_node_find_key_index(node_right, id_max);
+    bt_bool inclusive = (key_end < node_right->key_count && node_right->keys[key_end].id == id_max);
+    BT_AggregateValue part = aggregate->identity;
+
+    if (inclusive) {
+      key_end += 1;
+    }
+    if (key_end > 0) {
+      part = bt_aggregate_keys(tree, node_right, 0, key_end - 1, bt_true);
+      part = aggregate->combine(aggregate->user_context, part, bt_aggregate_key(tree, node_right, key_end - 1));
+    }
+
+    result = aggregate->combine(aggregate->user_context, result, part);
+    if (inclusive) {
+      break;
+    }
+    node_right = bt_node_get_sub(tree, node_right, key_end);
+  }
+
+  *result_out = result;
+  return BT_ERROR_Ok;
+}
+#endif
+
+BT_INTERNAL BT_ErrorCode
+bt_insert_key(BT_Context *tree, BT_KeyID id, const void *data, BT_InsertMode mode,
+              void *user_context, bt_update_sig *update, BT_Key **key_out, bt_bool *inserted_out)
+{
+  BT_ErrorCode error_code = BT_ERROR_OpDenied;
+  BT_StackFrame frame;
+  BT_Node *track_node;
+  bt_u32 track_index;
+  bt_u32 path_count;
+  bt_bool appended = bt_false;
+
+  if (key_out != NULL) {
+    *key_out = NULL;
+  }
+  if (inserted_out != NULL) {
+    *inserted_out = bt_false;
+  }
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    bt_bool inserted = bt_false;
+
+    error_code = bt_radix_insert(tree, id, data, mode, user_context, update, key_out, &inserted);
+    if (inserted) {
+      bt_bloom_on_insert(tree, id);
+    }
+    if (inserted_out != NULL) {
+      *inserted_out = inserted;
+    }
+    return error_code;
+  }
+#endif
+
+  if (tree->root == NULL) {
+    tree->root = bt_new_node(tree);
+    if (tree->root == NULL) {
+      return BT_ERROR_AllocationFailed;
+    }
+  }
+
+  {
+    BT_Node *node = tree->root;
+    bt_reset_stack(tree);
+    while (node != NULL) {
+      bt_u32 key_index;
+      bt_u32 key_start = 0;
+      bt_u32 key_end = node->key_count;
+      BT_ErrorCode error_code;
+
+#if defined(BT_UNSORTED_LEAVES)
+      if (node->unsorted_count > 0) {
+        /* NOTE(nick): An appended key is looked at on its own, otherwise the walk stays in
+         * the sorted part. */
+        key_start = bt_unsorted_find(node, id);
+        if (key_start < node->key_count) {
+          key_end = key_start + 1;
+        } else {
+          key_start = 0;
+          key_end = node->key_count - node->unsorted_count;
+        }
+      }
+#endif
+      for (key_index = key_start; key_index < key_end; ++key_index) {
+        BT_Key *key = bt_node_get_key(node, key_index);
+        if (key->id == id) {
+          /* NOTE(nick): Key already exists, resolve it in place without touching the structure. */
+          if (mode == BT_INSERT_Replace) {
+            key->data = data;
+          } else if (mode == BT_INSERT_Update) {
+            key->data = update(user_context, id, key->data, bt_true);
+          }
+#if defined(BT_AGGREGATES)
+          if (mode != BT_INSERT_Keep) {
+            /* NOTE(nick): Data changed, aggregates cached by the parents are stale. */
+            bt_update_path_summaries(tree, tree->frames_count);
+          }
+#endif
+          if (key_out != NULL) {
+            *key_out = key;
+          }
+          return BT_ERROR_Ok;
+        } else if (id < key->id) {
+          break;
+        }
+      }
+      /* NOTE(nick): Pushing frame in case we need to split. */
+      error_code = bt_push_stack_frame(tree, node, key_index);
+      if (error_code != BT_ERROR_Ok) {
+        return error_code;
+      }
+
+      node = bt_node_get_sub(tree, node, key_index);
+    }
+  }
+
+  if (mode == BT_INSERT_Update) {
+    data = update(user_context, id, NULL, bt_false);
+  }
+  path_count = tree->frames_count;
+
+  error_code = bt_peek_stack_frame(tree, &frame);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+  BT_ASSERT(frame.node->key_count < BT_COUNTOF(frame.node->keys));
+#if defined(BT_UNSORTED_LEAVES)
+  /* NOTE(nick): A key that goes last anyway is added in place and keeps the leaf sorted. */
+  if (frame.node->unsorted_count > 0 || frame.key_index < frame.node->key_count) {
+    appended = bt_unsorted_append(tree, frame.node, id, data);
+    if (appended) {
+      frame.key_index = frame.node->key_count - 1;
+    } else if (frame.node->unsorted_count > 0) {
+      bt_unsorted_sort(frame.node);
+      frame.key_index = bt_node_find_key_index(frame.node, id);
+    }
+  }
+#endif
+  if (!appended) {
+    bt_shift_keys_right(frame.node, frame.key_index);
+    frame.node->key_count += 1;
+    bt_node_set_key(frame.node, frame.key_index, id, data);
+  }
+  error_code = BT_ERROR_Ok;
+
+  if (inserted_out != NULL) {
+    *inserted_out = bt_true;
+  }
+
+  /* NOTE(nick): Following the inserted key through the splits, so that the caller gets
+   * the final slot without having to search for it again. */
+  track_node = frame.node;
+  track_index = frame.key_index;
+
+  {
+    while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
+      BT_Node *node_split = NULL;
+      BT_Key median_key;
+      bt_bool track_median = bt_false;
+      bt_u32 i;
+
+      error_code = BT_ERROR_RebalanceFailed;
+      if (frame.node->key_count < BT_COUNTOF(frame.node->keys)) {
+        error_code = BT_ERROR_Ok;
+        break;
+      }
+
+      node_split = bt_new_node(tree);
+      if (node_split == NULL) {
+        error_code = BT_ERROR_AllocationFailed;
+        break;
+      }
+      if (frame.node == tree->max_leaf) {
+        tree->max_leaf = node_split;
+      }
+
+      /* NOTE(nick): Copy upper-half of the sub-nodes to the split node. */
+      for (i = BT_COUNTOF(frame.node->subs) / 2; i < BT_COUNTOF(frame.node->subs); ++i) {
+        BT_Node *sub = bt_node_get_sub(tree, frame.node, i);
+        bt_node_set_sub(tree, node_split, i - BT_COUNTOF(node_split->subs) / 2, sub);
+        bt_node_set_sub(tree, frame.node, i, NULL);
+      }
+
+      /* NOTE(nick): Copy upper-half of the keys to the split node. */
+      for (i = BT_COUNTOF(frame.node->keys) / 2; i < BT_COUNTOF(frame.node->keys); ++i) {
+        BT_Key *key = bt_node_get_key(frame.node, i);
+        bt_node_add_key(node_split, key->id, key->data);
+        bt_node_invalidate_key(frame.node, i);
+        frame.node->key_count -= 1;
+      }
+
+      if (track_node == frame.node && track_index >= BT_COUNTOF(frame.node->keys) / 2) {
+        track_node = node_split;
+        track_index -= BT_COUNTOF(frame.node->keys) / 2;
+      }
+
+      if (node_split->key_count > frame.node->key_count) {
+        median_key = *bt_node_get_key(node_split, 0);
+        bt_shift_keys_left(node_split, 0);
+        node_split->key_count -= 1;
+
+        if (track_node == node_split) {
+          if (track_index == 0) {
+            track_median = bt_true;
+          } else {
+            track_index -= 1;
+          }
+        }
+      } else {
+        median_key = *bt_node_get_key(frame.node, frame.node->key_count - 1);
+        bt_node_invalidate_key(frame.node, frame.node->key_count - 1);
+        frame.node->key_count -= 1;
+
+        if (track_node == frame.node && track_index == frame.node->key_count) {
+          track_median = bt_true;
+        }
+      }
+
+      BT_ASSERT(node_split->key_count > 0);
+      BT_ASSERT(frame.node->key_count > 0);
+
+      bt_node_update_summaries(tree, frame.node);
+      bt_node_update_summaries(tree, node_split);
+
+      { 
+        /* NOTE(nick): Inserting a new median key. */
+
+        BT_StackFrame frame_parent;
+
+        if (bt_peek_stack_frame(tree, &frame_parent) == BT_ERROR_Ok) {
+          BT_ASSERT(frame_parent.node->key_count < BT_COUNTOF(frame_parent.node->keys));
+          bt_shift_keys_right(frame_parent.node, frame_parent.key_index);
+          bt_node_set_key(frame_parent.node, frame_parent.key_index, median_key.id, median_key.data);
+
+          if (track_median) {
+            track_node = frame_parent.node;
+            track_index = frame_parent.key_index;
+          }
+
+          frame_parent.node->key_count += 1;
+          frame_parent.key_index += 1;
+
+          bt_shift_subs_right(tree, frame_parent.node, frame_parent.key_index);
+          BT_ASSERT(bt_node_get_sub(tree, frame_parent.node, frame_parent.key_index) == NULL);
+          bt_node_set_sub(tree, frame_parent.node, frame_parent.key_index, node_split);
+        } else {
+          /* NOTE(nick): Splitting reached root node, inserting a new root. */
+          BT_Node *new_root = bt_new_node(tree);
+          if (new_root != NULL) {
+            bt_node_add_key(new_root, median_key.id, median_key.data);
+            bt_node_set_sub(tree, new_root, 0, frame.node);
+            bt_node_set_sub(tree, new_root, 1, node_split);
+            bt_node_update_summaries(tree, new_root);
+            tree->root = new_root;
+
+            if (track_median) {
+              track_node = new_root;
+              track_index = 0;
+            }
+            error_code = BT_ERROR_Ok;
+          } else {
+            error_code = BT_ERROR_AllocationFailed;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  bt_update_path_summaries(tree, path_count);
+  bt_bloom_on_insert(tree, id);
+
+  if (key_out != NULL && error_code == BT_ERROR_Ok) {
+    *key_out = bt_node_get_key(track_node, track_index);
+  }
+
+  return error_code;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_delete_key(BT_Context *tree, BT_KeyID id)
+{
+  BT_Node *node = tree->root;
+  BT_Node *node_delete = NULL;
+  BT_KeyID key_index_delete = BT_INVALID_ID;
+  bt_u32 path_count;
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    BT_ErrorCode error_code = bt_radix_delete(tree, id);
+    if (error_code == BT_ERROR_Ok) {
+      bt_bloom_on_delete(tree, 1);
+    }
+    return error_code;
+  }
+#endif
+
+#if defined(BT_UNSORTED_LEAVES)
+  /* NOTE(nick): Rebalancing moves keys between leaves by position, so they have to be sorted. */
+  bt_sort_leaves(tree);
+#endif
+
+  bt_reset_stack(tree);
+  while (node && node_delete == NULL) {
+    bt_u32 key_index;
+    BT_ErrorCode error_code;
+
+    for (key_index = 0; key_index < node->key_count; ++key_index) {
+      BT_Key *key = bt_node_get_key(node, key_index);
+      if (key->id == id) {
+        node_delete = node;
+        key_index_delete = key_index;
+        break;
+      } else if (id < key->id) {
+        break;
+      }
+    }
+
+    error_code = bt_push_stack_frame(tree, node, key_index);
+    if (error_code != BT_ERROR_Ok) {
+      return error_code;
+    }
+    node = bt_node_get_sub(tree, node, key_index);
+  }
+
+  if (node_delete == NULL) {
+    return BT_ERROR_IDNotFound;
+  }
+
+  {
+    /* NOTE(nick): Picking largest ID on the left branch of node_delete and inserting it
+     * instead of the key that is being deleted, because after delete branch becomes
+     * unbalanced and to compensate for it we insert largest ID. */
+
+    BT_Node *node_new_separator = NULL;
+
+    while (node != NULL) {
+      BT_Key *key;
+      BT_Key *key_separator;
+      BT_ErrorCode error_code;
+
+      error_code = bt_push_stack_frame(tree, node, node->key_count);
+      if (error_code != BT_ERROR_Ok) {
+        return error_code;
+      }
+
+      if (node_new_separator == NULL) {
+        node_new_separator = node;
+      }
+
+      key = bt_node_get_key(node, node->key_count - 1);
+      key_separator = bt_node_get_key(node_new_separator, node_new_separator->key_count - 1);
+
+      if (key->id > key_separator->id) {
+        node_new_separator = node;
+      }
+
+      node = bt_node_get_sub(tree, node, node->key_count);
+    }
+
+    if (node_new_separator != NULL) {
+      BT_Key *key;
+      BT_Node *sub;
+
+      BT_ASSERT(node_new_separator->key_count > 0);
+      key = bt_node_get_key(node_new_separator, node_new_separator->key_count - 1);
+      bt_node_set_key(node_delete, key_index_delete, key->id, key->data);
+      bt_node_invalidate_key(node_new_separator, node_new_separator->key_count - 1);
+      node_new_separator->key_count -= 1;
+    } else {
+      bt_shift_keys_left(node_delete, key_index_delete);
+      node_delete->key_count -= 1;
+    }
+  }
+
+  /* NOTE(nick): re-balance tree */
+  path_count = tree->frames_count;
+  while (bt_true) {
+    BT_StackFrame frame, frame_parent;
+    BT_Node *node_right, *node_left;
+    BT_Node *node_separator;
+    BT_Node *sub;
+    BT_Node *node_deficient;
+    BT_Key *key;
+    bt_u32 key_index_separator;
+
+    if (bt_pop_stack_frame(tree, &frame) != BT_ERROR_Ok) {
+      break;
+    }
+    if (bt_peek_stack_frame(tree, &frame_parent) != BT_ERROR_Ok) {
+      break;
+    }
+    if (frame.node->key_count >  0) {
+      break;
+    }
+
+    node_deficient = frame.node;
+    node_separator = frame_parent.node;
+    key_index_separator = frame_parent.key_index;
+
+    node_left = NULL;
+    if (key_index_separator > 0) {
+      node_left = bt_node_get_sub(tree, node_separator, key_index_separator - 1);
+    }
+
+    node_right = NULL;
+    if ((key_index_separator + 1) < BT_COUNTOF(node_separator->subs)) {
+      node_right = bt_node_get_sub(tree, node_separator, key_index_separator + 1);
+    }
+
+    if (node_right != NULL && node_right->key_count > 1) {
+      BT_ASSERT(bt_node_get_sub(tree, node_deficient, 2) == NULL);
+      BT_ASSERT(frame_parent.key_index == key_index_separator);
+
+      key = bt_node_get_key(node_separator, key_index_separator);
+      bt_node_add_key(node_deficient, key->id, key->data);
+
+      key = bt_node_get_key(node_right, 0);
+      bt_node_set_key(node_separator, key_index_separator, key->id, key->data);
+
+      /* NOTE(nick): Don't forget to move sub-node too. It belongs to the key that we 
+       * moved from right-node to the deficient-node. */
+      sub = bt_node_get_sub(tree, node_right, 0);
+      bt_node_set_sub(tree, node_deficient, 1, sub);
+      bt_shift_subs_left(tree, node_right, 0);
+
+      bt_shift_keys_left(node_right, 0);
+      node_right->key_count -= 1;
+    } else if (node_left != NULL && node_left->key_count > 1) {
+      BT_ASSERT(bt_node_get_sub(tree, node_deficient, 2) == NULL);
+      BT_ASSERT(frame_parent.key_index == key_index_separator);
+      BT_ASSERT(key_index_separator > 0);
+
+      key = bt_node_get_key(node_separator, key_index_separator - 1);
+      bt_node_add_key(node_deficient, key->id, key->data);
+
+      bt_shift_subs_right(tree, node_deficient, 0);
+      sub = bt_node_get_sub(tree, node_left, node_left->key_count);
+      bt_node_set_sub(tree, node_deficient, 0, sub);
+      bt_node_set_sub(tree, node_left, node_left->key_count, NULL);
+
+      key = bt_node_get_key(node_left, node_left->key_count - 1);
+      bt_node_set_key(node_separator, key_index_separator - 1, key->id, key->data);
+      bt_node_invalidate_key(node_left, node_left->key_count - 1);
+      node_left->key_count -= 1;
+    } else {
+      BT_Node *node_dst;
+      BT_Node *node_src;
+      bt_s32 copy_count, i;
+
+      if (node_left != NULL) {
+        BT_ASSERT(node_left->key_count < BT_COUNTOF(node_left->keys));
+        BT_ASSERT(key_index_separator > 0 );
+
+        node_dst = node_left;
+        node_src = (node_deficient != NULL) ? node_deficient : node_right;
+
+        /* NOTE(nick): Copy down key from parent to this deficient node. */
+        key = bt_node_get_key(node_separator, key_index_separator - 1);
+        bt_node_add_key(node_dst, key->id, key->data);
+        bt_shift_keys_left(node_separator, key_index_separator - 1);
+        bt_shift_subs_left(tree, node_separator, key_index_separator);
+      } else {
+        node_dst = node_deficient;
+        node_src = node_right;
+        BT_ASSERT(node_dst->key_count == 0);
+
+        node_dst->keys[node_dst->key_count++] = node_separator->keys[key_index_separator];
+        BT_ASSERT(key_index_separator == frame_parent.key_index);
+        bt_shift_keys_left(node_separator, key_index_separator);
+      }
+
+      copy_count = (bt_s32)node_src->key_count;
+      if ((node_dst->key_count + copy_count) >= BT_COUNTOF(node_dst->keys)) {
+        copy_count = BT_COUNTOF(node_dst->keys) - node_src->key_count - node_dst->key_count - 1;
+      }
+
+      for (i = 0; i < copy_count; ++i) {
+        BT_ASSERT(node_dst->key_count < BT_COUNTOF(node_dst->keys));
+        BT_ASSERT(node_src->key_count < BT_COUNTOF(node_src->keys));
+
+        key = bt_node_get_key(node_src, i);
+        sub = bt_node_get_sub(tree, node_src, i);
+
+        bt_node_set_key(node_dst, node_dst->key_count + i, key->id, key->data);
+        bt_node_set_sub(tree, node_dst, node_dst->key_count + i, sub);
+
+        bt_node_invalidate_key(node_src, i);
+        bt_shift_subs_left(tree, node_src, i);
+
+        node_src->key_count -= 1;
+        node_dst->key_count += 1;
+      }
+
+      sub = bt_node_get_sub(tree, node_src, node_src->key_count);
+      bt_node_set_sub(tree, node_src, node_src->key_count, NULL);
+      bt_node_set_sub(tree, node_dst, node_dst->key_count, sub);
+
+      if (node_src->key_count == 0) {
+        if (node_src == tree->root) {
+          bt_free_node(tree, tree->root);
+          tree->root = node_dst;
+        }
+
+        if (node_src == node_right) {
+          BT_ASSERT(bt_node_get_sub(tree, node_separator, key_index_separator + 1) == node_src);
+          bt_shift_subs_left(tree, node_separator, key_index_separator + 1);
+          node_right = NULL;
+        } else if (node_src == node_deficient) {
+          /* NOTE(nick): Popped frame still points to the deficient node. */
+          tree->frames[tree->frames_count].node = NULL;
+          node_deficient = NULL;
+        }
+
+        bt_free_node(tree, node_src);
+        node_src = NULL;
+      }
+
+      BT_ASSERT(node_separator->key_count > 0);
+      bt_node_invalidate_key(node_separator, node_separator->key_count - 1);
+      node_separator->key_count -= 1;
+    }
+
+    bt_node_update_summaries(tree, node_deficient);
+    bt_node_update_summaries(tree, node_left);
+    bt_node_update_summaries(tree, node_right);
+  }
+
+  if (tree->root->key_count == 0) {
+    /* NOTE(nick): Last separator of the root got merged down, the only remaining sub-node
+     * becomes the new root. For a leaf root this empties the tree. */
+    BT_Node *node_root = tree->root;
+    tree->root = bt_node_get_sub(tree, node_root, 0);
+    bt_free_node(tree, node_root);
+    BT_ASSERT(tree->frames[0].node == node_root);
+    tree->frames[0].node = NULL;
+  }
+
+  bt_update_path_summaries(tree, path_count);
+  bt_bloom_on_delete(tree, 1);
+
+  return BT_ERROR_Ok;
+}
+
+#if !defined(BT_REGION_NODES)
+BT_INTERNAL bt_u32
+bt_node_height(BT_Context *tree, BT_Node *node)
+{
+  bt_u32 height = 0;
+
+  while (node != NULL) {
+    height += 1;
+    node = bt_node_get_sub(tree, node, 0);
+  }
+
+  return height;
+}
+#endif
+
+/* NOTE(nick): Frees every node under node, returns how many keys they held. */
+BT_INTERNAL bt_u64
+bt_free_subtree(BT_Context *tree, BT_Node *node)
+{
+  BT_StackFrame stack[BT_MAX_DEPTH];
+  bt_u32 depth = 0;
+  bt_u64 key_count = 0;
+
+  if (node == NULL) {
+    return 0;
+  }
+
+  stack[depth].node = node;
+  stack[depth].key_index = 0;
+  depth += 1;
+  while (depth > 0) {
+    BT_StackFrame *frame = &stack[depth - 1];
+    BT_Node *sub = NULL;
+
+    if (frame->key_index <= frame->node->key_count) {
+      sub = bt_node_get_sub(tree, frame->node, frame->key_index);
+      frame->key_index += 1;
+    }
+
+    if (sub != NULL) {
+      BT_ASSERT(depth < BT_COUNTOF(stack));
+      stack[depth].node = sub;
+      stack[depth].key_index = 0;
+      depth += 1;
+    } else if (frame->key_index > frame->node->key_count) {
+      key_count += frame->node->key_count;
+      bt_free_node(tree, frame->node);
+      depth -= 1;
+    }
+  }
+
+  return key_count;
+}
+
+/* NOTE(nick): Inserts key at key_index and sub at sub_index. A full node is split in two
+ * halves, upper half is returned in split_out and the key between them in median_out.
+ * Node stays untouched when the split node can't be allocated. */
+BT_INTERNAL BT_ErrorCode
+bt_node_insert_split(BT_Context *tree, BT_Node *node, bt_u32 key_index, BT_Key key, bt_u32 sub_index, BT_Node *sub, BT_Key *median_out, BT_Node **split_out)
+{
+  BT_Key keys[BT_KEY_COUNT + 1];
+  BT_Node *subs[BT_NODE_COUNT + 1];
+  BT_Node *node_split = NULL;
+  bt_u32 count = node->key_count;
+  bt_u32 i, k;
+
+  for (i = 0, k = 0; i <= count; ++i) {
+    if (i == key_index) {
+      keys[k++] = key;
+    }
+    if (i < count) {
+      keys[k++] = node->keys[i];
+    }
+  }
+  for (i = 0, k = 0; i <= count + 1; ++i) {
+    if (i == sub_index) {
+      subs[k++] = sub;
+    }
+    if (i < count + 1) {
+      subs[k++] = bt_node_get_sub(tree, node, i);
+    }
+  }
+  count += 1;
+
+  /* NOTE(nick): Same as bt_insert_key, a node is never left with all key slots used. */
+  if (count >= BT_KEY_COUNT) {
+    bt_u32 median = count / 2;
+
+    node_split = bt_new_node(tree);
+    if (node_split == NULL) {
+      return BT_ERROR_AllocationFailed;
+    }
+    for (i = median + 1; i < count; ++i) {
+      bt_node_add_key(node_split, keys[i].id, keys[i].data);
+    }
+    for (i = median + 1; i <= count; ++i) {
+      bt_node_set_sub(tree, node_split, i - (median + 1), subs[i]);
+    }
+    bt_node_update_summaries(tree, node_split);
+    *median_out = keys[median];
+    count = median;
+  }
+
+  for (i = 0; i < BT_COUNTOF(node->keys); ++i) {
+    if (i < count) {
+      bt_node_set_key(node, i, keys[i].id, keys[i].data);
+    } else {
+      bt_node_invalidate_key(node, i);
+    }
+  }
+  for (i = 0; i < BT_COUNTOF(node->subs); ++i) {
+    bt_node_set_sub(tree, node, i, (i <= count) ? subs[i] : NULL);
+  }
+  node->key_count = (bt_u08)count;
+  bt_node_update_summaries(tree, node);
+
+  *split_out = node_split;
+  return BT_ERROR_Ok;
+}
+
+/* NOTE(nick): Joins two subtrees and a key between them, every key of left is less than
+ * key and every key of right is greater. Heights count nodes down to a leaf, 0 is an
+ * empty subtree. Lower subtree is hung off the spine of the higher one at the matching
+ * height, so it takes O(difference in height) node operations. */
+BT_INTERNAL BT_ErrorCode
+bt_graft(BT_Context *tree, BT_Node *left, bt_u32 left_height, BT_Key key, BT_Node *right, bt_u32 right_height, BT_Node **root_out, bt_u32 *height_out)
+{
+  BT_Node *path[BT_MAX_DEPTH];
+  bt_u32 path_count = 0;
+  bt_bool into_left = (left_height > right_height);
+  BT_Node *node;
+  BT_Node *sub;
+  BT_Node *node_split = NULL;
+  bt_u32 height;
+  bt_u32 target_height;
+  bt_u32 key_index;
+  bt_u32 sub_index;
+  bt_u32 i;
+
+  bt_reset_edge_leaves(tree);
+  if (left_height == right_height) {
+    node = bt_new_node(tree);
+    if (node == NULL) {
+      return BT_ERROR_AllocationFailed;
+    }
+    bt_node_add_key(node, key.id, key.data);
+    bt_node_set_sub(tree, node, 0, left);
+    bt_node_set_sub(tree, node, 1, right);
+    bt_node_update_summaries(tree, node);
+    *root_out = node;
+    *height_out = left_height + 1;
+    return BT_ERROR_Ok;
+  }
+
+  if (into_left) {
+    node = left;
+    height = left_height;
+    target_height = right_height + 1;
+    sub = right;
+  } else {
+    node = right;
+    height = right_height;
+    target_height = left_height + 1;
+    sub = left;
+  }
+  *root_out = node;
+  *height_out = height;
+
+  for (;;) {
+    BT_ASSERT(path_count < BT_COUNTOF(path));
+    path[path_count++] = node;
+    if (height == target_height) {
+      break;
+    }
+    node = bt_node_get_sub(tree, node, into_left ? node->key_count : 0);
+    height -= 1;
+  }
+
+  /* NOTE(nick): Along the right spine key goes last with sub after it, along the left
+   * spine key goes first with sub before it. Splits move up the same way. */
+  key_index = into_left ? node->key_count : 0;
+  sub_index = into_left ? key_index + 1 : 0;
+  for (i = path_count; i > 0; --i) {
+    BT_Key median = key;
+    BT_ErrorCode error_code;
+
+    node = path[i - 1];
+    if (i < path_count) {
+      key_index = into_left ? node->key_count : 0;
+      sub_index = key_index + 1;
+    }
+
+    error_code = bt_node_insert_split(tree, node, key_index, key, sub_index, sub, &median, &node_split);
+    if (error_code != BT_ERROR_Ok) {
+      return error_code;
+    }
+    if (node_split == NULL) {
+      break;
+    }
+    key = median;
+    sub = node_split;
+  }
+
+  for (i = path_count; i > 0; --i) {
+    bt_node_update_summaries(tree, path[i - 1]);
+  }
+
+  if (node_split != NULL) {
+    node = bt_new_node(tree);
+    if (node == NULL) {
+      return BT_ERROR_AllocationFailed;
+    }
+    bt_node_add_key(node, key.id, key.data);
+    bt_node_set_sub(tree, node, 0, path[0]);
+    bt_node_set_sub(tree, node, 1, node_split);
+    bt_node_update_summaries(tree, node);
+    *root_out = node;
+    *height_out += 1;
+  }
+
+  return BT_ERROR_Ok;
+}
+
+/* NOTE(nick): Splits subtree into keys less than id and keys not less than id. Goes down
+ * to the leaf once and grafts the pieces of every node on the way back up. */
+BT_INTERNAL BT_ErrorCode
+bt_split_subtree(BT_Context *tree, BT_Node *root, BT_KeyID id, BT_Node **left_out, bt_u32 *left_height_out, BT_Node **right_out, bt_u32 *right_height_out)
+{
+  BT_StackFrame path[BT_MAX_DEPTH];
+  bt_u32 path_count = 0;
+  BT_Node *left = NULL;
+  BT_Node *right = NULL;
+  bt_u32 left_height = 0;
+  bt_u32 right_height = 0;
+  BT_Node *node = root;
+  bt_u32 i;
+
+  bt_reset_edge_leaves(tree);
+  while (node != NULL) {
+    BT_ASSERT(path_count < BT_COUNTOF(path));
+    path[path_count].node = node;
+    path[path_count].key_index = (bt_u08)bt_node_find_key_index(node, id);
+    node = bt_node_get_sub(tree, node, path[path_count].key_index);
+    path_count += 1;
+  }
+
+  for (i = path_count; i > 0; --i) {
+    BT_Key keys[BT_KEY_COUNT];
+    BT_Node *subs[BT_NODE_COUNT];
+    bt_u32 height = path_count - i + 1;
+    bt_u32 key_index = path[i - 1].key_index;
+    bt_u32 count;
+    bt_bool node_used = bt_false;
+    BT_Node *piece;
+    bt_u32 piece_height;
+    BT_ErrorCode error_code;
+    bt_u32 k;
+
+    node = path[i - 1].node;
+    count = node->key_count;
+    for (k = 0; k < count; ++k) {
+      keys[k] = node->keys[k];
+    }
+    for (k = 0; k <= count; ++k) {
+      subs[k] = bt_node_get_sub(tree, node, k);
+    }
+
+    /* NOTE(nick): Keys before key_index go left, the last of them joins the rest of the
+     * left piece with what was split off below. A piece without keys is just its sub. */
+    if (key_index > 0) {
+      if (key_index == 1) {
+        piece = subs[0];
+        piece_height = height - 1;
+      } else {
+        piece = node;
+        piece_height = height;
+        node_used = bt_true;
+        for (k = key_index - 1; k < count; ++k) {
+          bt_node_invalidate_key(node, k);
+        }
+        for (k = key_index; k <= count; ++k) {
+          bt_node_set_sub(tree, node, k, NULL);
+        }
+        node->key_count = (bt_u08)(key_index - 1);
+        bt_node_update_summaries(tree, node);
+      }
+      error_code = bt_graft(tree, piece, piece_height, keys[key_index - 1], left, left_height, &left, &left_height);
+      if (error_code != BT_ERROR_Ok) {
+        return error_code;
+      }
+    }
+
+    if (key_index < count) {
+      if (key_index + 1 == count) {
+        piece = subs[count];
+        piece_height = height - 1;
+      } else {
+        piece = node_used ? bt_new_node(tree) : node;
+        if (piece == NULL) {
+          return BT_ERROR_AllocationFailed;
+        }
+        piece_height = height;
+        if (!node_used) {
+          for (k = 0; k < BT_COUNTOF(node->keys); ++k) {
+            bt_node_invalidate_key(node, k);
+          }
+          for (k = 0; k < BT_COUNTOF(node->subs); ++k) {
+            bt_node_set_sub(tree, node, k, NULL);
+          }
+          node->key_count = 0;
+          node_used = bt_true;
+        }
+        for (k = key_index + 1; k < count; ++k) {
+          bt_node_add_key(piece, keys[k].id, keys[k].data);
+        }
+        for (k = key_index + 1; k <= count; ++k) {
+          bt_node_set_sub(tree, piece, k - (key_index + 1), subs[k]);
+        }
+        bt_node_update_summaries(tree, piece);
+      }
+      error_code = bt_graft(tree, right, right_height, keys[key_index], piece, piece_height, &right, &right_height);
+      if (error_code != BT_ERROR_Ok) {
+        return error_code;
+      }
+    }
+
+    if (!node_used) {
+      bt_free_node(tree, node);
+    }
+  }
+
+  *left_out = left;
+  *left_height_out = left_height;
+  *right_out = right;
+  *right_height_out = right_height;
+  return BT_ERROR_Ok;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_write_buffer_apply(BT_Context *tree, BT_Message *message)
+{
+  BT_ErrorCode error_code = BT_ERROR_Ok;
+
+  switch (message->kind) {
+  case BT_MESSAGE_Insert: {
+    error_code = bt_insert_key(tree, message->key.id, message->key.data, BT_INSERT_Keep, NULL, NULL, NULL, NULL);
+  } break;
+
+  case BT_MESSAGE_Upsert: {
+    error_code = bt_insert_key(tree, message->key.id, message->key.data, BT_INSERT_Replace, NULL, NULL, NULL, NULL);
+  } break;
+
+  case BT_MESSAGE_Delete: {
+    error_code = bt_delete_key(tree, message->key.id);
+    if (error_code == BT_ERROR_IDNotFound) {
+      error_code = BT_ERROR_Ok;
+    }
+  } break;
+
+  default: break;
+  }
+
+  return error_code;
+}
+
+BT_API BT_ErrorCode
+bt_flush_writes(BT_Context *tree)
+{
+  BT_WriteBuffer *buffer = &tree->write_buffer;
+  BT_ErrorCode error_code = BT_ERROR_Ok;
+  bt_u32 i;
+
+  if (buffer->flushing) {
+    return BT_ERROR_Ok;
+  }
+
+  if (buffer->count > 0) {
+    /* NOTE(nick): Messages are sorted, consecutive descents mostly walk the same nodes. */
+    buffer->flushing = bt_true;
+    for (i = 0; i < buffer->count; ++i) {
+      error_code = bt_write_buffer_apply(tree, &buffer->messages[i]);
+      if (error_code != BT_ERROR_Ok) {
+        break;
+      }
+    }
+    buffer->flushing = bt_false;
+
+    bt_memmove(&buffer->messages[0], &buffer->messages[i], (buffer->count - i) * sizeof(BT_Message));
+    buffer->count -= i;
+  }
+
+#if defined(BT_UNSORTED_LEAVES)
+  /* NOTE(nick): Everything that calls this walks keys in order, appended keys are sorted in here. */
+  bt_sort_leaves(tree);
+#endif
+
+  return error_code;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_write_buffer_resolve(BT_Context *tree, BT_KeyID id)
+{
+  /* NOTE(nick): Applies the pending message of a single key, operations on other keys
+   * commute with it so the rest of the buffer can stay. */
+  BT_WriteBuffer *buffer = &tree->write_buffer;
+  BT_ErrorCode error_code = BT_ERROR_Ok;
+  bt_u32 index;
+
+  if (buffer->count == 0) {
+    return BT_ERROR_Ok;
+  }
+  index = bt_write_buffer_find(buffer, id);
+  if (index < buffer->count && buffer->messages[index].key.id == id) {
+    error_code = bt_write_buffer_apply(tree, &buffer->messages[index]);
+    if (error_code == BT_ERROR_Ok) {
+      bt_memmove(&buffer->messages[index], &buffer->messages[index + 1], (buffer->count - index - 1) * sizeof(BT_Message));
+      buffer->count -= 1;
+    }
+  }
+
+  return error_code;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_write_buffer_push(BT_Context *tree, BT_KeyID id, const void *data, BT_MessageKind kind)
+{
+  BT_WriteBuffer *buffer = &tree->write_buffer;
+  bt_u32 index = bt_write_buffer_find(buffer, id);
+  BT_Message *message;
+
+  if (index < buffer->count && buffer->messages[index].key.id == id) {
+    /* NOTE(nick): Newer message for the same key absorbs the older one. Insert keeps an
+     * existing key, so it only wins over a pending delete, and then it's an upsert. */
+    message = &buffer->messages[index];
+    if (kind == BT_MESSAGE_Insert) {
+      if (message->kind == BT_MESSAGE_Delete) {
+        message->kind = BT_MESSAGE_Upsert;
+        message->key.data = data;
+      }
+    } else {
+      message->kind = kind;
+      message->key.data = data;
+    }
+    return BT_ERROR_Ok;
+  }
+
+  if (buffer->count >= buffer->capacity) {
+    BT_ErrorCode error_code = bt_flush_writes(tree);
+    if (error_code != BT_ERROR_Ok) {
+      return error_code;
+    }
+    index = 0;
+  }
+
+  bt_memmove(&buffer->messages[index + 1], &buffer->messages[index], (buffer->count - index) * sizeof(BT_Message));
+  message = &buffer->messages[index];
+  message->key.id = id;
+  message->key.data = data;
+  message->kind = kind;
+  buffer->count += 1;
+
+  return BT_ERROR_Ok;
+}
+
+BT_API BT_ErrorCode
+bt_write_buffer_enable(BT_Context *tree, bt_u32 capacity)
+{
+  BT_WriteBuffer *buffer = &tree->write_buffer;
+  BT_Message *messages;
+  BT_ErrorCode error_code;
+
+  if (capacity == 0) {
+    return BT_ERROR_OpDenied;
+  }
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+  messages = (BT_Message *)bt_alloc_memory(&tree->allocator, capacity * sizeof(BT_Message), 0);
+  if (messages == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  if (buffer->messages != NULL) {
+    bt_free_memory(&tree->allocator, buffer->messages, buffer->capacity * sizeof(BT_Message), 0);
+  }
+  buffer->messages = messages;
+  buffer->capacity = capacity;
+  buffer->count = 0;
+  buffer->flushing = bt_false;
+
+  return BT_ERROR_Ok;
+}
+
+BT_API BT_ErrorCode
+bt_write_buffer_disable(BT_Context *tree)
+{
+  BT_ErrorCode error_code = bt_flush_writes(tree);
+
+  if (error_code == BT_ERROR_Ok) {
+    if (tree->write_buffer.messages != NULL) {
+      bt_free_memory(&tree->allocator, tree->write_buffer.messages, tree->write_buffer.capacity * sizeof(BT_Message), 0);
+    }
+    bt_memset(&tree->write_buffer, 0, sizeof(tree->write_buffer));
+  }
+
+  return error_code;
+}
+
+BT_API BT_ErrorCode
+bt_insert(BT_Context *tree, BT_KeyID id, const void *data)
+{
+  if (tree->write_buffer.messages != NULL) {
+    return bt_write_buffer_push(tree, id, data, BT_MESSAGE_Insert);
+  }
+  return bt_insert_key(tree, id, data, BT_INSERT_Keep, NULL, NULL, NULL, NULL);
+}
+
+BT_API BT_ErrorCode
+bt_upsert(BT_Context *tree, BT_KeyID id, const void *data)
+{
+  if (tree->write_buffer.messages != NULL) {
+    return bt_write_buffer_push(tree, id, data, BT_MESSAGE_Upsert);
+  }
+  return bt_insert_key(tree, id, data, BT_INSERT_Replace, NULL, NULL, NULL, NULL);
+}
+
+BT_API BT_ErrorCode
+bt_insert_or_get(BT_Context *tree, BT_KeyID id, const void *data, BT_Key **key_out, bt_bool *inserted_out)
+{
+  BT_ErrorCode error_code = bt_write_buffer_resolve(tree, id);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+  return bt_insert_key(tree, id, data, BT_INSERT_Keep, NULL, NULL, key_out, inserted_out);
+}
+
+BT_API BT_ErrorCode
+bt_update(BT_Context *tree, BT_KeyID id, void *user_context, bt_update_sig *update)
+{
+  BT_ErrorCode error_code;
+
+  if (update == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+  error_code = bt_write_buffer_resolve(tree, id);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+  return bt_insert_key(tree, id, NULL, BT_INSERT_Update, user_context, update, NULL, NULL);
+}
+
+BT_API BT_ErrorCode
+bt_delete(BT_Context *tree, BT_KeyID id)
+{
+  if (tree->write_buffer.messages != NULL) {
+    /* NOTE(nick): Buffered delete can't tell whether the key exists. */
+    return bt_write_buffer_push(tree, id, NULL, BT_MESSAGE_Delete);
+  }
+  return bt_delete_key(tree, id);
+}
+
+BT_INTERNAL BT_Node *
+bt_edge_leaf(BT_Context *tree, bt_bool last)
+{
+  BT_Node **cached = last ? &tree->max_leaf : &tree->min_leaf;
+
+  if (*cached == NULL && tree->root != NULL) {
+    BT_Node *node = tree->root;
+    while (!bt_is_node_leaf(node)) {
+      node = bt_node_get_sub(tree, node, last ? node->key_count : 0);
+    }
+    *cached = node;
+  }
+  return *cached;
+}
+
+BT_API BT_Key *
+bt_min(BT_Context *tree)
+{
+  BT_Node *leaf;
+
+  if (tree->write_buffer.count > 0 && bt_flush_writes(tree) != BT_ERROR_Ok) {
+    return NULL;
+  }
+#if defined(BT_UNSORTED_LEAVES)
+  bt_sort_leaves(tree);
+#endif
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return bt_radix_seek_mode(tree, 0, BT_SEEK_GreaterEqual);
+  }
+#endif
+  leaf = bt_edge_leaf(tree, bt_false);
+  return (leaf != NULL && leaf->key_count > 0) ? bt_node_get_key(leaf, 0) : NULL;
+}
+
+BT_API BT_Key *
+bt_max(BT_Context *tree)
+{
+  BT_Node *leaf;
+
+  if (tree->write_buffer.count > 0 && bt_flush_writes(tree) != BT_ERROR_Ok) {
+    return NULL;
+  }
+#if defined(BT_UNSORTED_LEAVES)
+  bt_sort_leaves(tree);
+#endif
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return bt_radix_seek_mode(tree, BT_INVALID_ID, BT_SEEK_LessEqual);
+  }
+#endif
+  leaf = bt_edge_leaf(tree, bt_true);
+  return (leaf != NULL && leaf->key_count > 0) ? bt_node_get_key(leaf, leaf->key_count - 1) : NULL;
+}
+
+BT_INTERNAL BT_ErrorCode
+bt_pop_edge(BT_Context *tree, bt_bool last, BT_Key *key_out)
+{
+  BT_ErrorCode error_code;
+  BT_Node *leaf;
+  BT_Key key;
+  bt_bool removed = bt_false;
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    BT_Key *edge = last ? bt_max(tree) : bt_min(tree);
+    if (edge == NULL) {
+      return BT_ERROR_IDNotFound;
+    }
+    key = *edge;
+    error_code = bt_delete_key(tree, key.id);
+    if (error_code == BT_ERROR_Ok && key_out != NULL) {
+      *key_out = key;
+    }
+    return error_code;
+  }
+#endif
+
+  leaf = bt_edge_leaf(tree, last);
+  if (leaf == NULL || leaf->key_count == 0) {
+    return BT_ERROR_IDNotFound;
+  }
+  key = *bt_node_get_key(leaf, last ? leaf->key_count - 1 : 0);
+
+#if !defined(BT_ORDER_STATISTICS) && !defined(BT_AGGREGATES)
+  /* NOTE(nick): Edge leaf that keeps a key needs no rebalancing, and without per sub-node
+   * summaries the parents don't care, so the key is taken out in place. */
+  if (leaf->key_count > 1) {
+    if (!last) {
+      bt_shift_keys_left(leaf, 0);
+    } else {
+      bt_node_invalidate_key(leaf, leaf->key_count - 1);
+    }
+    leaf->key_count -= 1;
+    bt_bloom_on_delete(tree, 1);
+    removed = bt_true;
+  }
+#endif
+  if (!removed) {
+    error_code = bt_delete_key(tree, key.id);
+  }
+
+  if (error_code == BT_ERROR_Ok && key_out != NULL) {
+    *key_out = key;
+  }
+  return error_code;
+}
+
+/* NOTE(nick): Removes the smallest key and hands it out through key_out, IDNotFound when
+ * the tree is empty. */
+BT_API BT_ErrorCode
+bt_pop_min(BT_Context *tree, BT_Key *key_out)
+{
+  return bt_pop_edge(tree, bt_false, key_out);
+}
+
+BT_API BT_ErrorCode
+bt_pop_max(BT_Context *tree, BT_Key *key_out)
+{
+  return bt_pop_edge(tree, bt_true, key_out);
+}
+
+/* NOTE(nick): Buffered writes are applied first, otherwise pending inserts inside the
+ * range would bring keys back on a later flush. Nothing is deleted when that fails. */
+BT_API BT_ErrorCode
+bt_delete_range(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_max)
+{
+  BT_Key *key;
+  BT_Key key_middle;
+  BT_Node *left, *middle, *right;
+  bt_u32 left_height, middle_height, right_height;
+  bt_u64 deleted_count;
+  BT_ErrorCode error_code;
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    /* NOTE(nick): Keys of a radix tree are taken out one at a time. */
+    error_code = BT_ERROR_Ok;
+    while (id_min <= id_max && error_code == BT_ERROR_Ok) {
+      key = bt_radix_seek_mode(tree, id_min, BT_SEEK_GreaterEqual);
+      if (key == NULL || key->id > id_max) {
+        break;
+      }
+      id_min = key->id;
+      error_code = bt_delete_key(tree, id_min);
+      if (id_min == BT_INVALID_ID) {
+        break;
+      }
+      id_min += 1;
+    }
+    return error_code;
+  }
+#endif
+  if (tree->root == NULL || id_min > id_max) {
+    return BT_ERROR_Ok;
+  }
+
+  /* NOTE(nick): Pieces left and right of the range get joined through a key that stays
+   * in the tree, taking it out first keeps it out of the way of the splits. */
+  key = bt_seek(tree, id_max, BT_SEEK_Greater, NULL);
+  if (key == NULL) {
+    key = bt_seek(tree, id_min, BT_SEEK_Less, NULL);
+  }
+  if (key == NULL) {
+    deleted_count = bt_free_subtree(tree, tree->root);
+    tree->root = NULL;
+    bt_bloom_on_delete(tree, deleted_count);
+    return BT_ERROR_Ok;
+  }
+
+  key_middle = *key;
+  error_code = bt_delete_key(tree, key_middle.id);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+  error_code = bt_split_subtree(tree, tree->root, id_min, &left, &left_height, &middle, &middle_height);
+  tree->root = NULL;
+  if (error_code == BT_ERROR_Ok) {
+    right = NULL;
+    right_height = 0;
+    if (id_max != BT_INVALID_ID) {
+      error_code = bt_split_subtree(tree, middle, id_max + 1, &middle, &middle_height, &right, &right_height);
+    }
+    if (error_code == BT_ERROR_Ok) {
+      deleted_count = bt_free_subtree(tree, middle);
+      error_code = bt_graft(tree, left, left_height, key_middle, right, right_height, &tree->root, &left_height);
+      /* NOTE(nick): key_middle is back in the tree, a rebuild by on_delete counts it. */
+      bt_bloom_on_insert(tree, key_middle.id);
+      bt_bloom_on_delete(tree, deleted_count);
+    }
+  }
+
+  return error_code;
+}
+
+BT_INTERNAL void
+bt_clear_reset(BT_Context *tree)
+{
+  BT_Bloom *bloom = &tree->bloom;
+
+  tree->root = NULL;
+  bt_reset_edge_leaves(tree);
+  tree->key_cache.free_epoch += 1;
+  tree->write_buffer.count = 0;
+  bt_memset(&tree->compact, 0, sizeof(tree->compact));
+#if defined(BT_UNSORTED_LEAVES)
+  tree->unsorted_leaf_count = 0;
+#endif
+  bt_reset_stack(tree);
+  if (bloom->blocks != NULL) {
+    bt_memset(bloom->blocks, 0, bloom->block_count * BT_BLOOM_BLOCK_WORDS * sizeof(bt_u64));
+    bloom->key_count = 0;
+    bloom->delete_count = 0;
+  }
+}
+
+/* NOTE(nick): Removes every key, pending buffered writes are dropped. Settings of the
+ * tree stay as they are. */
+BT_API BT_ErrorCode
+bt_clear(BT_Context *tree)
+{
+#if defined(BT_RADIX_ENGINE)
+  bt_radix_free_subtree(tree, tree->radix_root);
+  tree->radix_root = NULL;
+#endif
+#if defined(BT_REGION_NODES)
+  bt_pool_release(tree);
+#else
+  bt_free_subtree(tree, tree->root);
+#endif
+  bt_clear_reset(tree);
+  return BT_ERROR_Ok;
+}
+
+#if defined(BT_REGION_NODES)
+/* NOTE(nick): Same as bt_clear, but the slabs go to region_out instead of being freed. */
+BT_API BT_ErrorCode
+bt_clear_detached(BT_Context *tree, BT_NodeRegion *region_out)
+{
+#if defined(BT_RADIX_ENGINE)
+  bt_radix_free_subtree(tree, tree->radix_root);
+  tree->radix_root = NULL;
+#endif
+  bt_pool_detach(tree, region_out);
+  bt_clear_reset(tree);
+  return BT_ERROR_Ok;
+}
+#endif
+
+/* NOTE(nick): Merges neighbouring leaves of node whose keys fit into one leaf together
+ * with the key between them. node keeps at least one key unless it's the root, a root
+ * left without keys is replaced by its only leaf. Returns how many leaves were merged. */
+BT_INTERNAL bt_u64
+bt_compact_merge_leaves(BT_Context *tree, BT_Node *node)
+{
+  bt_u64 merged = 0;
+  bt_u32 i = 0;
+
+  while (i < node->key_count) {
+    BT_Node *left = bt_node_get_sub(tree, node, i);
+    BT_Node *right = bt_node_get_sub(tree, node, i + 1);
+
+    if ((node->key_count > 1 || node == tree->root) &&
+        left->key_count + right->key_count + 1 < BT_KEY_COUNT) {
+      bt_node_add_key(left, node->keys[i].id, node->keys[i].data);
+      bt_memcpy(&left->keys[left->key_count], &right->keys[0], right->key_count * sizeof(right->keys[0]));
+      left->key_count += right->key_count;
+      bt_shift_keys_left(node, i);
+      bt_shift_subs_left(tree, node, i + 1);
+      bt_node_remove_key(node);
+      bt_node_update_summaries(tree, left);
+      bt_free_node(tree, right);
+      merged += 1;
+    } else {
+      i += 1;
+    }
+  }
+
+  if (merged > 0) {
+    bt_node_update_summaries(tree, node);
+    if (node->key_count == 0) {
+      tree->root = bt_node_get_sub(tree, node, 0);
+      bt_free_node(tree, node);
+    }
+  }
+  return merged;
+}
+
+#if defined(BT_REGION_NODES)
+BT_INTERNAL BT_Node *
+bt_compact_swapped(BT_Node *node, BT_Node *a, BT_Node *b)
+{
+  if (node == a) {
+    return b;
+  }
+  if (node == b) {
+    return a;
+  }
+  return node;
+}
+
+/* NOTE(nick): Returns the node that links to target, NULL for the root or a node that
+ * isn't in the tree. Keys are unique, descending by the first key of target finds it. */
+BT_INTERNAL BT_Node *
+bt_compact_find_parent(BT_Context *tree, BT_Node *target, bt_u32 *sub_index_out)
+{
+  BT_Node *node = tree->root;
+  BT_KeyID id = target->keys[0].id;
+
+  while (node != NULL && node != target) {
+    bt_u32 sub_index = bt_node_find_key_index(node, id);
+    BT_Node *sub = bt_node_get_sub(tree, node, sub_index);
+    if (sub == target) {
+      *sub_index_out = sub_index;
+      return node;
+    }
+    node = sub;
+  }
+  return NULL;
+}
+
+/* NOTE(nick): Moves node into the next slot of the pass, whatever was in that slot takes
+ * the slot node came from. parent links to node and is NULL for the root. Slots keep
+ * their handles. Returns where node is now, *moved_out gets the slot it came from so the
+ * caller can swap pointers it holds to either of them. */
+BT_INTERNAL BT_Node *
+bt_compact_place(BT_Context *tree, BT_Node *node, BT_Node *parent, bt_u32 sub_index, BT_Node **moved_out)
+{
+  BT_NodePool *pool = &tree->pool;
+  BT_Node *slot;
+  BT_Node *other_parent = NULL;
+  bt_u32 other_index = 0;
+  bt_bool slot_free;
+  BT_Node scratch;
+  bt_u16 free_count;
+#if defined(BT_COMPACT_HANDLES)
+  BT_NodeHandle handle;
+#endif
+
+  *moved_out = node;
+  if (tree->compact.next_slot >= pool->used_count) {
+    return node;
+  }
+  slot = bt_pool_node(pool, tree->compact.next_slot);
+  tree->compact.next_slot += 1;
+  if (slot == node) {
+    return node;
+  }
+
+  slot_free = (slot->key_count == BT_POOL_FREE_MARK);
+  if (slot_free) {
+    bt_pool_unlink_free(pool, slot);
+  } else {
+    other_parent = bt_compact_find_parent(tree, slot, &other_index);
+    if (other_parent == NULL && slot != tree->root) {
+      return node;
+    }
+  }
+
+  free_count = slot->free_count;
+  scratch = *slot;
+  *slot = *node;
+  *node = scratch;
+  /* NOTE(nick): Both slots hold something else now, cache entries pointing at either go stale. */
+  node->free_count = slot->free_count + 1;
+  slot->free_count = free_count + 1;
+  if (node->free_count == 0 || slot->free_count == 0) {
+    tree->key_cache.free_epoch += 1;
+  }
+#if defined(BT_COMPACT_HANDLES)
+  handle = slot->handle;
+  slot->handle = node->handle;
+  node->handle = handle;
+#endif
+
+  /* NOTE(nick): Parents can be one of the two nodes that were just swapped. */
+  parent = bt_compact_swapped(parent, node, slot);
+  if (parent != NULL) {
+    bt_node_set_sub(tree, parent, sub_index, slot);
+  } else {
+    tree->root = slot;
+  }
+  if (slot_free) {
+    bt_pool_push_free(pool, node);
+  } else {
+    other_parent = bt_compact_swapped(other_parent, node, slot);
+    if (other_parent != NULL) {
+      bt_node_set_sub(tree, other_parent, other_index, node);
+    } else {
+      tree->root = node;
+    }
+  }
+
+  bt_reset_edge_leaves(tree);
+  *moved_out = node;
+  return slot;
+}
+
+/* NOTE(nick): Takes the last slot of the pool off the free list, bt_false once the last
+ * slot holds a node. */
+BT_INTERNAL bt_bool
+bt_compact_trim_step(BT_NodePool *pool)
+{
+  BT_Node *node;
+
+  if (pool->used_count == 0) {
+    return bt_false;
+  }
+  node = bt_pool_node(pool, pool->used_count - 1);
+  if (node->key_count != BT_POOL_FREE_MARK) {
+    return bt_false;
+  }
+  bt_pool_unlink_free(pool, node);
+  pool->used_count -= 1;
+  return bt_true;
+}
+
+BT_INTERNAL void
+bt_compact_release_slabs(BT_Context *tree)
+{
+  BT_NodePool *pool = &tree->pool;
+
+  while (pool->chunk_count > 0 && (bt_u64)(pool->chunk_count - 1) * BT_POOL_CHUNK_NODES >= pool->used_count) {
+    pool->chunk_count -= 1;
+    tree->key_cache.free_epoch += 1;
+    bt_free_memory(&tree->allocator, pool->chunks[pool->chunk_count], BT_POOL_CHUNK_NODES * sizeof(BT_Node), tree->allocator.node_alignment);
+    pool->chunks[pool->chunk_count] = NULL;
+  }
+}
+#endif
+
+/* NOTE(nick): One step of the pass over the lowest internal node that holds the first key
+ * the pass hasn't handled yet. Its leaves get merged where they fit, then its ancestors
+ * reached for the first time, the node and its leaves are placed in that order. Returns
+ * one for the step plus how many nodes were merged or placed. */
+BT_INTERNAL bt_u64
+bt_compact_step(BT_Context *tree, bt_bool *pass_done_out)
+{
+  BT_StackFrame path[BT_MAX_DEPTH];
+  bt_u32 depth = 0;
+  bt_u64 work = 1;
+  bt_bool rightmost = bt_true;
+  BT_KeyID next_id = 0;
+  BT_Node *node = tree->root;
+  bt_u32 i;
+#if defined(BT_REGION_NODES)
+  BT_Node *placed;
+  BT_Node *moved;
+  bt_u32 j;
+#endif
+
+  *pass_done_out = bt_false;
+  while (!bt_is_node_leaf(node)) {
+    BT_ASSERT(depth < BT_COUNTOF(path));
+    path[depth].node = node;
+    path[depth].key_index = (bt_u08)bt_node_find_key_index(node, tree->compact.resume_id);
+    node = bt_node_get_sub(tree, node, path[depth].key_index);
+    depth += 1;
+  }
+  /* NOTE(nick): The pass goes on right after the ancestor key that follows this subtree. */
+  for (i = 0; i + 1 < depth; ++i) {
+    if (path[i].key_index < path[i].node->key_count) {
+      rightmost = bt_false;
+      next_id = path[i].node->keys[path[i].key_index].id + 1;
+    }
+  }
+
+  if (depth > 0) {
+    work += bt_compact_merge_leaves(tree, path[depth - 1].node);
+  }
+  if (bt_is_node_leaf(tree->root)) {
+#if defined(BT_REGION_NODES)
+    bt_compact_place(tree, tree->root, NULL, 0, &moved);
+#endif
+    *pass_done_out = bt_true;
+    return work;
+  }
+
+#if defined(BT_REGION_NODES)
+  for (i = 0; i < depth; ++i) {
+    bt_bool first_visit = bt_true;
+    for (j = i; j + 1 < depth; ++j) {
+      if (path[j].key_index != 0) {
+        first_visit = bt_false;
+      }
+    }
+    if (!first_visit) {
+      continue;
+    }
+    placed = bt_compact_place(tree, path[i].node, (i > 0) ? path[i - 1].node : NULL,
+                              (i > 0) ? path[i - 1].key_index : 0, &moved);
+    for (j = 0; j < depth; ++j) {
+      path[j].node = bt_compact_swapped(path[j].node, moved, placed);
+    }
+    work += 1;
+  }
+#endif
+
+#if defined(BT_REGION_NODES)
+  node = path[depth - 1].node;
+  for (i = 0; i <= node->key_count; ++i) {
+    placed = bt_compact_place(tree, bt_node_get_sub(tree, node, i), node, i, &moved);
+    node = bt_compact_swapped(node, moved, placed);
+    work += 1;
+  }
+#endif
+
+  if (rightmost) {
+    *pass_done_out = bt_true;
+  } else {
+    tree->compact.resume_id = next_id;
+  }
+  return work;
+}
+
+/* NOTE(nick): Spends about budget units of work on compaction and returns, the next call
+ * picks up where this one stopped. A unit is a node merged, placed or a slot trimmed.
+ * Every pass goes over the tree in key order and merges neighbouring leaves that fit
+ * into one. With BT_REGION_NODES it also moves nodes into pool slots in pre-order and,
+ * once every node is in place, gives back the slabs at the end of the pool that are left
+ * empty. *finished_out is set when a pass completes, the next call starts a new one.
+ * Cursors, keys and values returned before are invalid after a call. */
+BT_API BT_ErrorCode
+bt_compact(BT_Context *tree, bt_u64 budget, bt_bool *finished_out)
+{
+  BT_ErrorCode error_code;
+  bt_bool finished = bt_false;
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return BT_ERROR_OpDenied;
+  }
+#endif
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+  while (budget > 0 && !finished) {
+    bt_u64 work = 1;
+
+#if defined(BT_REGION_NODES)
+    if (tree->compact.trimming) {
+      if (!bt_compact_trim_step(&tree->pool)) {
+        bt_compact_release_slabs(tree);
+        finished = bt_true;
+      }
+    } else if (tree->root == NULL) {
+      tree->compact.trimming = bt_true;
+    } else {
+      work = bt_compact_step(tree, &tree->compact.trimming);
+    }
+#else
     if (tree->root == NULL) {
-      return BT_ERROR_AllocationFailed;
+      finished = bt_true;
+    } else {
+      work = bt_compact_step(tree, &finished);
     }
+#endif
+    budget -= (work < budget) ? work : budget;
+  }
+
+  if (finished) {
+    bt_memset(&tree->compact, 0, sizeof(tree->compact));
+  }
+  if (finished_out != NULL) {
+    *finished_out = finished;
+  }
+  return BT_ERROR_Ok;
+}
+
+/* NOTE(nick): Moves every key not less than id into right, which gets created with the
+ * same settings as tree: node search, aggregate, Bloom filter, key cache and write buffer.
+ * Keys of tree stay in its Bloom filter until the next rebuild.
+ * O(log n) with plain nodes. With BT_REGION_NODES nodes can't leave the slabs of their
+ * tree, the moved keys are copied one by one and it's O(n). */
+BT_API BT_ErrorCode
+bt_split_at(BT_Context *tree, BT_KeyID id, BT_Context *right)
+{
+  BT_ErrorCode error_code;
+
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    return BT_ERROR_OpDenied;
+  }
+#endif
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
   }
 
+  bt_create(right, tree->value_size, &tree->allocator);
+  bt_set_node_search(right, tree->node_search.mode);
+#if defined(BT_AGGREGATES)
+  right->aggregate = tree->aggregate;
+#endif
+
+#if defined(BT_REGION_NODES)
   {
-    BT_Node *node = tree->root;
-    bt_reset_stack(tree);
-    while (node != NULL) {
-      bt_u32 key_index;
-      BT_ErrorCode error_code;
+    /* NOTE(nick): Nodes can't move between slabs of different trees, keys are copied. */
+    BT_Cursor cursor;
+    BT_Key *key;
 
-      for (key_index = 0; key_index < node->key_count; ++key_index) {
-        BT_Key *key = bt_node_get_key(node, key_index);
-        if (key->id == id) {
-          return BT_ERROR_Ok;
-        } else if (id < key->id) {
-          break;
-        }
-      }
-      /* NOTE(nick): Pushing frame in case we need to split. */
-      error_code = bt_push_stack_frame(tree, node, key_index);
+    for (key = bt_seek(tree, id, BT_SEEK_GreaterEqual, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+      error_code = bt_insert_key(right, key->id, key->data, BT_INSERT_Keep, NULL, NULL, NULL, NULL);
       if (error_code != BT_ERROR_Ok) {
         return error_code;
       }
-
-      node = bt_node_get_sub(node, key_index);
+    }
+    error_code = bt_delete_range(tree, id, BT_INVALID_ID);
+  }
+#else
+  {
+    BT_Node *left_root;
+    BT_Node *right_root;
+    bt_u32 left_height;
+    bt_u32 right_height;
+
+    if (tree->root != NULL) {
+      error_code = bt_split_subtree(tree, tree->root, id, &left_root, &left_height, &right_root, &right_height);
+      if (error_code == BT_ERROR_Ok) {
+        tree->root = left_root;
+        right->root = right_root;
+      }
+      /* NOTE(nick): Nodes that went to right can't be reached through the cache of tree. */
+      tree->key_cache.free_epoch += 1;
     }
   }
+#endif
 
-  error_code = bt_peek_stack_frame(tree, &frame);
+  /* NOTE(nick): Same as bt_clone, except the filter of right only gets the moved keys. */
+  if (error_code == BT_ERROR_Ok && tree->bloom.blocks != NULL) {
+    error_code = bt_bloom_enable(right, tree->bloom.key_capacity);
+  }
+  if (error_code == BT_ERROR_Ok && tree->key_cache.entries != NULL) {
+    error_code = bt_key_cache_enable(right, tree->key_cache.entry_count);
+  }
+  if (error_code == BT_ERROR_Ok && tree->write_buffer.messages != NULL) {
+    error_code = bt_write_buffer_enable(right, tree->write_buffer.capacity);
+  }
+
+  return error_code;
+}
+
+/* NOTE(nick): Moves every key of right into left, right is left empty. Every key of left
+ * has to be less than every key of right. O(log n) with plain nodes, O(n) in the keys of
+ * right with BT_REGION_NODES, which copies them into the slabs of left. */
+BT_API BT_ErrorCode
+bt_join(BT_Context *left, BT_Context *right)
+{
+  BT_Key *key_left;
+  BT_Key *key_right;
+  BT_Key key_middle;
+  BT_ErrorCode error_code;
+
+#if defined(BT_RADIX_ENGINE)
+  if (left->engine == BT_ENGINE_Radix || right->engine == BT_ENGINE_Radix) {
+    return BT_ERROR_OpDenied;
+  }
+#endif
+  /* NOTE(nick): Nodes of right end up in left and get freed by its allocator. */
+  if (left->allocator.free_memory != right->allocator.free_memory ||
+      left->allocator.free_memory_context != right->allocator.free_memory_context ||
+      left->allocator.node_alignment != right->allocator.node_alignment) {
+    return BT_ERROR_OpDenied;
+  }
+#if defined(BT_AGGREGATES)
+  if (left->aggregate.map != right->aggregate.map || left->aggregate.combine != right->aggregate.combine) {
+    return BT_ERROR_OpDenied;
+  }
+#endif
+
+  error_code = bt_flush_writes(right);
   if (error_code != BT_ERROR_Ok) {
     return error_code;
   }
-  BT_ASSERT(frame.node->key_count < BT_COUNTOF(frame.node->keys));
-  bt_shift_keys_right(frame.node, frame.key_index);
-  frame.node->key_count += 1;
-  bt_node_set_key(frame.node, frame.key_index, id, data);
-  error_code = BT_ERROR_Ok;
+  key_right = bt_seek(right, 0, BT_SEEK_GreaterEqual, NULL);
+  if (key_right == NULL) {
+    return BT_ERROR_Ok;
+  }
+  key_left = bt_seek(left, BT_INVALID_ID, BT_SEEK_LessEqual, NULL);
+  if (key_left != NULL && key_left->id >= key_right->id) {
+    return BT_ERROR_OpDenied;
+  }
 
+#if defined(BT_REGION_NODES)
   {
-    while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
-      BT_Node *node_split = NULL;
-      BT_Key median_key;
-      bt_u32 i;
+    /* NOTE(nick): Nodes can't move between slabs of different trees, keys are copied. */
+    BT_Cursor cursor;
+    BT_Key *key;
 
-      error_code = BT_ERROR_RebalanceFailed;
-      if (frame.node->key_count < BT_COUNTOF(frame.node->keys)) {
-        break;
+    for (key = bt_cursor_first(right, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+      error_code = bt_insert_key(left, key->id, key->data, BT_INSERT_Keep, NULL, NULL, NULL, NULL);
+      if (error_code != BT_ERROR_Ok) {
+        return error_code;
       }
+    }
+    (void)key_middle;
+    error_code = bt_delete_range(right, 0, BT_INVALID_ID);
+  }
+#else
+  /* NOTE(nick): Smallest key of right joins the two trees. */
+  key_middle = *key_right;
+  error_code = bt_delete_key(right, key_middle.id);
+  if (error_code == BT_ERROR_Ok) {
+    bt_u32 height;
+
+    error_code = bt_graft(left, left->root, bt_node_height(left, left->root), key_middle,
+                          right->root, bt_node_height(right, right->root), &left->root, &height);
+    right->root = NULL;
+    bt_reset_edge_leaves(right);
+    right->key_cache.free_epoch += 1;
+    if (error_code == BT_ERROR_Ok && left->bloom.blocks != NULL) {
+      /* NOTE(nick): Filter of left knows nothing about the keys of right. */
+      error_code = bt_bloom_rebuild(left);
+    }
+  }
+#endif
 
-      node_split = bt_new_node(tree);
-      if (node_split == NULL) {
-        error_code = BT_ERROR_AllocationFailed;
-        break;
-      }
+  return error_code;
+}
 
-      /* NOTE(nick): Copy upper-half of the sub-nodes to the split node. */
-      for (i = BT_COUNTOF(frame.node->subs) / 2; i < BT_COUNTOF(frame.node->subs); ++i) {
-        BT_Node *sub = bt_node_get_sub(frame.node, i);
-        bt_node_set_sub(node_split, i - BT_COUNTOF(node_split->subs) / 2, sub);
-        bt_node_set_sub(frame.node, i, NULL);
+/* NOTE(nick): Buffered writes are applied before the walk, the walk doesn't start when
+ * that fails. Cursors of the tree are invalid afterwards either way. */
+BT_API BT_ErrorCode
+bt_visit_keys(BT_Context *tree, BT_VisitNodesMode mode, void *user_context, bt_visit_keys_sig *visit)
+{
+  BT_Node *node;
+  BT_ErrorCode error_code;
+  bt_u32 i;
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+#if defined(BT_RADIX_ENGINE)
+  if (tree->engine == BT_ENGINE_Radix) {
+    /* NOTE(nick): Every key of a radix tree is in a leaf, both orders are key order. */
+    if (visit == NULL) {
+      return BT_ERROR_OpDenied;
+    }
+    if (tree->radix_root != NULL && mode != BT_VISIT_NODE_Null) {
+      bt_radix_visit(tree->radix_root, user_context, visit);
+    }
+    return BT_ERROR_Ok;
+  }
+#endif
+  if (tree->root == NULL) {
+    return BT_ERROR_Ok;
+  } 
+
+  if (visit == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+
+  node = tree->root;
+  bt_reset_stack(tree);
+
+  switch (mode) {
+  case BT_VISIT_NODE_TopDown: {
+    while (node != NULL) {
+      for (i = 0; i < node->key_count; ++i) {
+        BT_Key *key = bt_node_get_key(node, i);
+        if (visit(user_context, key->id, key->data) == bt_false) {
+          return BT_ERROR_Ok;
+        }
       }
 
-      /* NOTE(nick): Copy upper-half of the keys to the split node. */
-      for (i = BT_COUNTOF(frame.node->keys) / 2; i < BT_COUNTOF(frame.node->keys); ++i) {
-        BT_Key *key = bt_node_get_key(frame.node, i);
-        bt_node_add_key(node_split, key->id, key->data);
-        bt_node_invalidate_key(frame.node, i);
-        frame.node->key_count -= 1;
+      if (bt_is_node_leaf(node)) {
+        BT_StackFrame frame;
+
+        node = NULL;
+        while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
+          frame.key_index += 1;
+          if (frame.key_index <= frame.node->key_count) {
+            BT_Node *sub = bt_node_get_sub(tree, frame.node, frame.key_index);
+            if (sub != NULL) {
+              BT_ErrorCode error_code;
+
+              error_code = bt_push_stack_frame(tree, frame.node, frame.key_index);
+              if (error_code != BT_ERROR_Ok) {
+                return error_code;
+              }
+
+              node = sub;
+              BT_ASSERT(node->key_count > 0);
+              break;
+            }
+          }
+        }
+      } else {
+        BT_ErrorCode error_code;
+
+        BT_ASSERT(node->key_count > 0);
+        error_code = bt_push_stack_frame(tree, node, 0);
+        if (error_code != BT_ERROR_Ok) {
+          return error_code;
+        }
+
+        node = bt_node_get_sub(tree, node, 0);
       }
+    }
+  } break;
 
-      if (node_split->key_count > frame.node->key_count) {
-        median_key = *bt_node_get_key(node_split, 0);
-        bt_shift_keys_left(node_split, 0);
-        node_split->key_count -= 1;
+  case BT_VISIT_NODE_BottomUp: {
+    while (node != NULL) {
+      if (bt_is_node_leaf(node)) {
+        BT_StackFrame frame;
+
+        for (i = 0; i < node->key_count; ++i) {
+          BT_Key *key = bt_node_get_key(node, i);
+          if (visit(user_context, key->id, key->data) == bt_false) {
+            return BT_ERROR_Ok;
+          }
+        }
+
+        node = NULL;
+        while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
+          frame.key_index += 1;
+
+          if (frame.key_index > frame.node->key_count) {
+            for (i = 0; i < frame.node->key_count; ++i) {
+              BT_Key *key = bt_node_get_key(frame.node, i);
+              if (visit(user_context, key->id, key->data) == bt_false) {
+                return BT_ERROR_Ok;
+              }
+            }
+          } else {
+            BT_Node *sub = bt_node_get_sub(tree, frame.node, frame.key_index);
+            if (sub != NULL) {
+              BT_ErrorCode error_code;
+
+              error_code = bt_push_stack_frame(tree, frame.node, frame.key_index);
+              if (error_code != BT_ERROR_Ok) {
+                return error_code;
+              }
+
+              node = sub;
+              BT_ASSERT(node->key_count > 0);
+              break;
+            }
+          }
+        }
       } else {
-        median_key = *bt_node_get_key(frame.node, frame.node->key_count - 1);
-        bt_node_invalidate_key(frame.node, frame.node->key_count - 1);
-        frame.node->key_count -= 1;
+        BT_ErrorCode error_code;
+
+        BT_ASSERT(node->key_count > 0);
+        error_code = bt_push_stack_frame(tree, node, 0);
+        if (error_code != BT_ERROR_Ok) {
+          return error_code;
+        }
+
+        node = bt_node_get_sub(tree, node, 0);
       }
+    }
+  } break;
+
+  default: break;
+  }
+
+  return BT_ERROR_Ok;
+}
+
+#if defined(BT_COMPACT_HANDLES)
+/* NOTE(nick): Handles don't depend on where the slabs are, copied slabs need no fixups. */
+BT_INTERNAL BT_ErrorCode
+bt_pool_clone(BT_Context *src, BT_Context *dst)
+{
+  BT_NodePool *pool = &dst->pool;
+  bt_u32 i;
+
+  if (src->pool.chunk_count == 0) {
+    return BT_ERROR_Ok;
+  }
+
+  pool->chunks = (BT_Node **)bt_alloc_memory(&dst->allocator, src->pool.chunk_count * sizeof(BT_Node *), 0);
+  if (pool->chunks == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  pool->chunk_capacity = src->pool.chunk_count;
+  for (i = 0; i < src->pool.chunk_count; ++i) {
+    BT_Node *chunk = (BT_Node *)bt_alloc_memory(&dst->allocator, BT_POOL_CHUNK_NODES * sizeof(BT_Node), dst->allocator.node_alignment);
+    if (chunk == NULL) {
+      bt_pool_release(dst);
+      return BT_ERROR_AllocationFailed;
+    }
+    bt_memcpy(chunk, src->pool.chunks[i], BT_POOL_CHUNK_NODES * sizeof(BT_Node));
+    pool->chunks[i] = chunk;
+    pool->chunk_count += 1;
+  }
+  pool->used_count = src->pool.used_count;
+  pool->free_list = src->pool.free_list;
+
+  dst->root = (src->root != NULL) ? bt_pool_resolve(pool, src->root->handle) : NULL;
+  return BT_ERROR_Ok;
+}
+#else
+/* NOTE(nick): Copies nodes top-down in a single pass, keys and cached summaries are taken
+ * over as they are. */
+BT_INTERNAL BT_ErrorCode
+bt_clone_nodes(BT_Context *src, BT_Context *dst)
+{
+  BT_StackFrame stack[BT_MAX_DEPTH];
+  BT_Node *copies[BT_MAX_DEPTH];
+  bt_u32 depth = 0;
+
+  if (src->root == NULL) {
+    return BT_ERROR_Ok;
+  }
+
+  dst->root = bt_new_node(dst);
+  if (dst->root == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  bt_memcpy(dst->root, src->root, sizeof(BT_Node));
+  bt_memset(&dst->root->subs[0], 0, sizeof(dst->root->subs));
+
+  stack[0].node = src->root;
+  stack[0].key_index = 0;
+  copies[0] = dst->root;
+  depth = 1;
+  while (depth > 0) {
+    BT_StackFrame *frame = &stack[depth - 1];
+    BT_Node *sub;
+    BT_Node *copy;
+
+    if (frame->key_index > frame->node->key_count) {
+      depth -= 1;
+      continue;
+    }
+    sub = bt_node_get_sub(src, frame->node, frame->key_index);
+    frame->key_index += 1;
+    if (sub == NULL) {
+      continue;
+    }
+
+    copy = bt_new_node(dst);
+    if (copy == NULL) {
+      bt_free_subtree(dst, dst->root);
+      dst->root = NULL;
+      return BT_ERROR_AllocationFailed;
+    }
+    bt_memcpy(copy, sub, sizeof(BT_Node));
+    bt_memset(&copy->subs[0], 0, sizeof(copy->subs));
+    bt_node_set_sub(dst, copies[depth - 1], frame->key_index - 1, copy);
+
+    BT_ASSERT(depth < BT_COUNTOF(stack));
+    stack[depth].node = sub;
+    stack[depth].key_index = 0;
+    copies[depth] = copy;
+    depth += 1;
+  }
+
+  return BT_ERROR_Ok;
+}
+#endif
+
+/* NOTE(nick): Creates dst as a copy of src with the same settings. Nodes are copied as
+ * they are, nothing gets compared or split again. */
+BT_API BT_ErrorCode
+bt_clone(BT_Context *src, BT_Context *dst)
+{
+  BT_ErrorCode error_code;
+
+  error_code = bt_flush_writes(src);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+  bt_create(dst, src->value_size, &src->allocator);
+  bt_set_node_search(dst, src->node_search.mode);
+#if defined(BT_AGGREGATES)
+  dst->aggregate = src->aggregate;
+#endif
+
+#if defined(BT_COMPACT_HANDLES)
+  error_code = bt_pool_clone(src, dst);
+#else
+  error_code = bt_clone_nodes(src, dst);
+#endif
+#if defined(BT_RADIX_ENGINE)
+  dst->engine = src->engine;
+  if (error_code == BT_ERROR_Ok && src->engine == BT_ENGINE_Radix) {
+    /* NOTE(nick): Radix nodes are rebuilt key by key, in key order. */
+    BT_Cursor cursor;
+    BT_Key *key;
 
-      BT_ASSERT(node_split->key_count > 0);
-      BT_ASSERT(frame.node->key_count > 0);
+    for (key = bt_cursor_seek_first(src, &cursor); key != NULL && error_code == BT_ERROR_Ok; key = bt_cursor_next(&cursor)) {
+      error_code = bt_radix_insert(dst, key->id, key->data, BT_INSERT_Keep, NULL, NULL, NULL, NULL);
+    }
+  }
+#endif
 
-      { 
-        /* NOTE(nick): Inserting a new median key. */
+  if (error_code == BT_ERROR_Ok && src->bloom.blocks != NULL) {
+    bt_u64 size = src->bloom.block_count * BT_BLOOM_BLOCK_WORDS * sizeof(bt_u64);
 
-        BT_StackFrame frame_parent;
+    dst->bloom = src->bloom;
+    dst->bloom.blocks = (bt_u64 *)bt_alloc_memory(&dst->allocator, size, 0);
+    if (dst->bloom.blocks == NULL) {
+      bt_memset(&dst->bloom, 0, sizeof(dst->bloom));
+      error_code = BT_ERROR_AllocationFailed;
+    } else {
+      bt_memcpy(dst->bloom.blocks, src->bloom.blocks, size);
+    }
+  }
+  if (error_code == BT_ERROR_Ok && src->key_cache.entries != NULL) {
+    error_code = bt_key_cache_enable(dst, src->key_cache.entry_count);
+  }
+  if (error_code == BT_ERROR_Ok && src->write_buffer.messages != NULL) {
+    error_code = bt_write_buffer_enable(dst, src->write_buffer.capacity);
+  }
 
-        if (bt_peek_stack_frame(tree, &frame_parent) == BT_ERROR_Ok) {
-          BT_ASSERT(frame_parent.node->key_count < BT_COUNTOF(frame_parent.node->keys));
-          bt_shift_keys_right(frame_parent.node, frame_parent.key_index);
-          bt_node_set_key(frame_parent.node, frame_parent.key_index, median_key.id, median_key.data);
+  if (error_code != BT_ERROR_Ok) {
+    bt_destroy(dst);
+  }
+  return error_code;
+}
 
-          frame_parent.node->key_count += 1;
-          frame_parent.key_index += 1;
+/* NOTE(nick): Set operations merge both trees in key order and gallop over runs of keys
+ * that can't be in the result, so the cost follows the output and the number of skips.
+ * Keys are passed to visit with the data from a, union takes data from b for keys that
+ * are only in b. Neither tree can be modified from visit. */
+BT_API BT_ErrorCode
+bt_intersect(BT_Context *a, BT_Context *b, void *user_context, bt_visit_keys_sig *visit)
+{
+  BT_Cursor cursor_a;
+  BT_Cursor cursor_b;
+  BT_Key *key_a;
+  BT_Key *key_b;
 
-          bt_shift_subs_right(frame_parent.node, frame_parent.key_index);
-          BT_ASSERT(bt_node_get_sub(frame_parent.node, frame_parent.key_index) == NULL);
-          bt_node_set_sub(frame_parent.node, frame_parent.key_index, node_split);
-        } else {
-          /* NOTE(nick): Splitting reached root node, inserting a new root. */
-          BT_Node *new_root = bt_new_node(tree);
-          if (new_root != NULL) {
-            bt_node_add_key(new_root, median_key.id, median_key.data);
-            bt_node_set_sub(new_root, 0, frame.node);
-            bt_node_set_sub(new_root, 1, node_split);
-            tree->root = new_root;
-          } else {
-            error_code = BT_ERROR_AllocationFailed;
-            break;
-          }
-        }
+  if (visit == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+
+  key_a = bt_cursor_first(a, &cursor_a);
+  key_b = bt_cursor_first(b, &cursor_b);
+  while (key_a != NULL && key_b != NULL) {
+    if (key_a->id < key_b->id) {
+      key_a = bt_cursor_gallop(&cursor_a, key_b->id);
+    } else if (key_b->id < key_a->id) {
+      key_b = bt_cursor_gallop(&cursor_b, key_a->id);
+    } else {
+      if (visit(user_context, key_a->id, key_a->data) == bt_false) {
+        break;
       }
+      key_a = bt_cursor_next(&cursor_a);
+      key_b = bt_cursor_next(&cursor_b);
     }
   }
 
-  return error_code;
+  return BT_ERROR_Ok;
 }
 
 BT_API BT_ErrorCode
-bt_delete(BT_Context *tree, BT_KeyID id)
+bt_union(BT_Context *a, BT_Context *b, void *user_context, bt_visit_keys_sig *visit)
 {
-  BT_Node *node = tree->root;
-  BT_Node *node_delete = NULL;
-  BT_KeyID key_index_delete = BT_INVALID_ID;
+  BT_Cursor cursor_a;
+  BT_Cursor cursor_b;
+  BT_Key *key_a;
+  BT_Key *key_b;
 
-  bt_reset_stack(tree);
-  while (node && node_delete == NULL) {
-    bt_u32 key_index;
-    BT_ErrorCode error_code;
+  if (visit == NULL) {
+    return BT_ERROR_OpDenied;
+  }
 
-    for (key_index = 0; key_index < node->key_count; ++key_index) {
-      BT_Key *key = bt_node_get_key(node, key_index);
-      if (key->id == id) {
-        node_delete = node;
-        key_index_delete = key_index;
+  key_a = bt_cursor_first(a, &cursor_a);
+  key_b = bt_cursor_first(b, &cursor_b);
+  while (key_a != NULL || key_b != NULL) {
+    if (key_b == NULL || (key_a != NULL && key_a->id <= key_b->id)) {
+      if (visit(user_context, key_a->id, key_a->data) == bt_false) {
         break;
-      } else if (id < key->id) {
+      }
+      if (key_b != NULL && key_b->id == key_a->id) {
+        key_b = bt_cursor_next(&cursor_b);
+      }
+      key_a = bt_cursor_next(&cursor_a);
+    } else {
+      if (visit(user_context, key_b->id, key_b->data) == bt_false) {
         break;
       }
+      key_b = bt_cursor_next(&cursor_b);
     }
+  }
 
-    error_code = bt_push_stack_frame(tree, node, key_index);
-    if (error_code != BT_ERROR_Ok) {
-      return error_code;
+  return BT_ERROR_Ok;
+}
+
+BT_API BT_ErrorCode
+bt_difference(BT_Context *a, BT_Context *b, void *user_context, bt_visit_keys_sig *visit)
+{
+  BT_Cursor cursor_a;
+  BT_Cursor cursor_b;
+  BT_Key *key_a;
+  BT_Key *key_b;
+
+  if (visit == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+
+  key_a = bt_cursor_first(a, &cursor_a);
+  key_b = bt_cursor_first(b, &cursor_b);
+  while (key_a != NULL) {
+    if (key_b != NULL && key_b->id < key_a->id) {
+      key_b = bt_cursor_gallop(&cursor_b, key_a->id);
     }
-    node = bt_node_get_sub(node, key_index);
+    if (key_b != NULL && key_b->id == key_a->id) {
+      key_a = bt_cursor_next(&cursor_a);
+      key_b = bt_cursor_next(&cursor_b);
+      continue;
+    }
+    if (visit(user_context, key_a->id, key_a->data) == bt_false) {
+      break;
+    }
+    key_a = bt_cursor_next(&cursor_a);
   }
 
-  if (node_delete == NULL) {
-    return BT_ERROR_IDNotFound;
+  return BT_ERROR_Ok;
+}
+
+#if defined(__AVX2__) && (BT_FROZEN_BLOCK == 8) && !defined(BT_NO_SIMD) && !defined(BT_FROZEN_AVX2)
+  #define BT_FROZEN_AVX2
+#endif
+
+#if defined(BT_FROZEN_AVX2)
+  #include <immintrin.h>
+#endif
+
+/* NOTE(nick): Number of ids in the block that are less than id. */
+BT_INTERNAL bt_u32
+bt_frozen_block_rank(BT_KeyID *block, BT_KeyID id)
+{
+#if defined(BT_FROZEN_AVX2)
+  static const bt_u08 bit_counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+  /* NOTE(nick): AVX2 only has a signed 64-bit compare, flipping the sign bit makes it
+   * compare unsigned ids. */
+  __m256i bias = _mm256_slli_epi64(_mm256_set1_epi64x(1), 63);
+  __m256i x = _mm256_xor_si256(_mm256_set1_epi64x((bt_s64)id), bias);
+  __m256i lo = _mm256_xor_si256(_mm256_load_si256((__m256i *)block), bias);
+  __m256i hi = _mm256_xor_si256(_mm256_load_si256((__m256i *)(block + 4)), bias);
+  bt_u32 mask_lo = (bt_u32)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, lo)));
+  bt_u32 mask_hi = (bt_u32)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, hi)));
+  return bit_counts[mask_lo] + bit_counts[mask_hi];
+#else
+  bt_u32 rank = 0;
+  bt_u32 i;
+
+  for (i = 0; i < BT_FROZEN_BLOCK; ++i) {
+    rank += (block[i] < id);
   }
+  return rank;
+#endif
+}
 
-  {
-    /* NOTE(nick): Picking largest ID on the left branch of node_delete and inserting it
-     * instead of the key that is being deleted, because after delete branch becomes
-     * unbalanced and to compensate for it we insert largest ID. */
+BT_INTERNAL bt_u64
+bt_frozen_block_count(bt_u64 id_count)
+{
+  return (id_count + BT_FROZEN_BLOCK - 1) / BT_FROZEN_BLOCK;
+}
 
-    BT_Node *node_new_separator = NULL;
+BT_INTERNAL bt_u64
+bt_frozen_leaf_stride(BT_Frozen *frozen)
+{
+  return sizeof(BT_KeyID) + BT_FROZEN_BLOCK * frozen->delta_size;
+}
 
-    while (node != NULL) {
-      BT_Key *key;
-      BT_Key *key_separator;
-      BT_ErrorCode error_code;
+BT_INTERNAL BT_KeyID
+bt_frozen_leaf_id(BT_Frozen *frozen, bt_u64 position)
+{
+  bt_u08 *leaf;
+  bt_u32 slot = (bt_u32)(position % BT_FROZEN_BLOCK);
 
-      error_code = bt_push_stack_frame(tree, node, node->key_count);
-      if (error_code != BT_ERROR_Ok) {
-        return error_code;
-      }
+  if (frozen->leaves == NULL) {
+    return frozen->ids[position];
+  }
 
-      if (node_new_separator == NULL) {
-        node_new_separator = node;
-      }
+  leaf = frozen->leaves + (position / BT_FROZEN_BLOCK) * bt_frozen_leaf_stride(frozen);
+  switch (frozen->delta_size) {
+  case 1:  return *(BT_KeyID *)leaf + ((bt_u08 *)(leaf + sizeof(BT_KeyID)))[slot];
+  case 2:  return *(BT_KeyID *)leaf + ((bt_u16 *)(leaf + sizeof(BT_KeyID)))[slot];
+  default: return *(BT_KeyID *)leaf + ((unsigned int *)(leaf + sizeof(BT_KeyID)))[slot];
+  }
+}
 
-      key = bt_node_get_key(node, node->key_count - 1);
-      key_separator = bt_node_get_key(node_new_separator, node_new_separator->key_count - 1);
+/* NOTE(nick): Number of ids in layer 0 block that are less than id. Packed blocks are
+ * searched without decoding, comparing offsets against id - first id of the block. */
+BT_INTERNAL bt_u32
+bt_frozen_leaf_rank(BT_Frozen *frozen, bt_u64 block, BT_KeyID id)
+{
+  bt_u08 *leaf;
+  bt_u08 *deltas;
+  BT_KeyID base;
+  bt_u64 offset;
+  bt_u32 rank = 0;
+  bt_u32 i;
 
-      if (key->id > key_separator->id) {
-        node_new_separator = node;
-      }
+  if (frozen->leaves == NULL) {
+    return bt_frozen_block_rank(frozen->ids + block * BT_FROZEN_BLOCK, id);
+  }
+
+  leaf = frozen->leaves + block * bt_frozen_leaf_stride(frozen);
+  deltas = leaf + sizeof(BT_KeyID);
+  base = *(BT_KeyID *)leaf;
+  if (id <= base) {
+    return 0;
+  }
+  offset = id - base;
+  if ((offset >> (frozen->delta_size * 8)) != 0) {
+    return BT_FROZEN_BLOCK;
+  }
 
-      node = bt_node_get_sub(node, node->key_count);
+  switch (frozen->delta_size) {
+  case 1: {
+    for (i = 0; i < BT_FROZEN_BLOCK; ++i) {
+      rank += (deltas[i] < offset);
     }
+  } break;
 
-    if (node_new_separator != NULL) {
-      BT_Key *key;
-      BT_Node *sub;
+  case 2: {
+    bt_u16 *deltas16 = (bt_u16 *)deltas;
+    for (i = 0; i < BT_FROZEN_BLOCK; ++i) {
+      rank += (deltas16[i] < offset);
+    }
+  } break;
 
-      BT_ASSERT(node_new_separator->key_count > 0);
-      key = bt_node_get_key(node_new_separator, node_new_separator->key_count - 1);
-      bt_node_set_key(node_delete, key_index_delete, key->id, key->data);
-      bt_node_invalidate_key(node_new_separator, node_new_separator->key_count - 1);
-      node_new_separator->key_count -= 1;
-    } else {
-      bt_shift_keys_left(node_delete, key_index_delete);
-      node_delete->key_count -= 1;
+  default: {
+#if defined(BT_FROZEN_AVX2)
+    /* NOTE(nick): Same sign flip as in bt_frozen_block_rank, for 32-bit lanes. */
+    __m256i bias = _mm256_set1_epi32((int)0x80000000U);
+    __m256i x = _mm256_xor_si256(_mm256_set1_epi32((int)(unsigned int)offset), bias);
+    __m256i d = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)deltas), bias);
+    bt_u32 mask = (bt_u32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(x, d)));
+    for (i = 0; i < BT_FROZEN_BLOCK; ++i) {
+      rank += (mask >> i) & 1;
+    }
+#else
+    unsigned int *deltas32 = (unsigned int *)deltas;
+    for (i = 0; i < BT_FROZEN_BLOCK; ++i) {
+      rank += (deltas32[i] < offset);
     }
+#endif
+  } break;
   }
 
-  /* NOTE(nick): re-balance tree */
-  while (bt_true) {
-    BT_StackFrame frame, frame_parent;
-    BT_Node *node_right, *node_left;
-    BT_Node *node_separator;
-    BT_Node *sub;
-    BT_Node *node_deficient;
-    BT_Key *key;
-    bt_u32 key_index_separator;
+  return rank;
+}
 
-    if (bt_pop_stack_frame(tree, &frame) != BT_ERROR_Ok) {
-      break;
+BT_INTERNAL BT_ErrorCode
+bt_freeze_layout(BT_Context *tree, BT_Frozen *frozen, bt_bool packed)
+{
+  BT_Cursor cursor;
+  BT_Key *key;
+  BT_ErrorCode error_code;
+  BT_KeyID block_first = 0;
+  bt_u64 max_span = 0;
+  bt_u64 key_count = 0;
+  bt_u64 id_count = 0;
+  bt_u64 leaf_size = 0;
+  bt_u64 layer_keys;
+  bt_u64 i;
+  bt_u32 layer;
+
+  bt_memset(frozen, 0, sizeof(*frozen));
+  frozen->allocator = tree->allocator;
+
+  error_code = bt_flush_writes(tree);
+  if (error_code != BT_ERROR_Ok) {
+    return error_code;
+  }
+
+  for (key = bt_cursor_seek_first(tree, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+    if (key_count % BT_FROZEN_BLOCK == 0) {
+      block_first = key->id;
     }
-    if (bt_peek_stack_frame(tree, &frame_parent) != BT_ERROR_Ok) {
-      break;
+    if (key->id - block_first > max_span) {
+      max_span = key->id - block_first;
     }
-    if (frame.node->key_count >  0) {
+    key_count += 1;
+  }
+  if (key_count == 0) {
+    return BT_ERROR_Ok;
+  }
+
+  /* NOTE(nick): Offsets share one size so every packed block has the same stride. Spans
+   * that need more than 32 bits aren't worth packing. */
+  if (packed) {
+    if (max_span <= 0xFF) {
+      frozen->delta_size = 1;
+    } else if (max_span <= 0xFFFF) {
+      frozen->delta_size = 2;
+    } else if (max_span <= (bt_u64)0xFFFFFFFF) {
+      frozen->delta_size = 4;
+    }
+  }
+
+  /* NOTE(nick): Every layer has one separator per sub-block, so it needs
+   * 1 / (BT_FROZEN_BLOCK + 1) of the blocks of the layer below. */
+  layer_keys = key_count;
+  for (layer = 0; ; ++layer) {
+    BT_ASSERT(layer < BT_COUNTOF(frozen->layer_offsets));
+    frozen->layer_offsets[layer] = id_count;
+    if (layer == 0 && frozen->delta_size != 0) {
+      leaf_size = bt_frozen_block_count(layer_keys) * bt_frozen_leaf_stride(frozen);
+    } else {
+      id_count += bt_frozen_block_count(layer_keys) * BT_FROZEN_BLOCK;
+    }
+    if (layer_keys <= BT_FROZEN_BLOCK) {
       break;
     }
+    layer_keys = (bt_frozen_block_count(layer_keys) + BT_FROZEN_BLOCK) / (BT_FROZEN_BLOCK + 1) * BT_FROZEN_BLOCK;
+  }
+  frozen->layer_count = layer + 1;
 
-    node_deficient = frame.node;
-    node_separator = frame_parent.node;
-    key_index_separator = frame_parent.key_index;
+  /* NOTE(nick): Blocks are aligned to the cache line. */
+  frozen->memory_size = id_count * sizeof(BT_KeyID) + leaf_size + key_count * sizeof(void *);
+  frozen->memory = bt_alloc_memory(&frozen->allocator, frozen->memory_size, 64);
+  if (frozen->memory == NULL) {
+    return BT_ERROR_AllocationFailed;
+  }
+  frozen->ids = (BT_KeyID *)frozen->memory;
+  if (frozen->delta_size != 0) {
+    frozen->leaves = (bt_u08 *)(frozen->ids + id_count);
+  }
+  frozen->data = (const void **)((bt_u08 *)(frozen->ids + id_count) + leaf_size);
+  frozen->key_count = key_count;
+
+  i = 0;
+  for (key = bt_cursor_seek_first(tree, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+    if (frozen->leaves != NULL) {
+      bt_u08 *leaf = frozen->leaves + (i / BT_FROZEN_BLOCK) * bt_frozen_leaf_stride(frozen);
+      bt_u64 delta;
+
+      if (i % BT_FROZEN_BLOCK == 0) {
+        *(BT_KeyID *)leaf = key->id;
+        /* NOTE(nick): Unused slots of the last block get the largest offset delta_size
+         * can hold, so they never count as less than a searched id. */
+        bt_memset(leaf + sizeof(BT_KeyID), 0xFF, BT_FROZEN_BLOCK * frozen->delta_size);
+      }
+      delta = key->id - *(BT_KeyID *)leaf;
+      switch (frozen->delta_size) {
+      case 1:  ((bt_u08 *)(leaf + sizeof(BT_KeyID)))[i % BT_FROZEN_BLOCK] = (bt_u08)delta; break;
+      case 2:  ((bt_u16 *)(leaf + sizeof(BT_KeyID)))[i % BT_FROZEN_BLOCK] = (bt_u16)delta; break;
+      default: ((unsigned int *)(leaf + sizeof(BT_KeyID)))[i % BT_FROZEN_BLOCK] = (unsigned int)delta; break;
+      }
+    } else {
+      frozen->ids[i] = key->id;
+    }
+    frozen->data[i] = key->data;
+    i += 1;
+  }
+  if (frozen->leaves == NULL) {
+    for (; i < bt_frozen_block_count(key_count) * BT_FROZEN_BLOCK; ++i) {
+      frozen->ids[i] = BT_INVALID_ID;
+    }
+  }
 
-    node_left = NULL;
-    if (key_index_separator > 0) {
-      node_left = node_separator->subs[key_index_separator - 1];
+  /* NOTE(nick): Separator i of a block is the smallest id of its sub-block i + 1, that's
+   * the first id of the leftmost layer 0 block under it. Missing sub-blocks get
+   * BT_INVALID_ID, which is never less than a searched id. */
+  for (layer = 1; layer < frozen->layer_count; ++layer) {
+    bt_u64 layer_end = (layer + 1 < frozen->layer_count) ? frozen->layer_offsets[layer + 1] : id_count;
+    BT_KeyID *ids = frozen->ids + frozen->layer_offsets[layer];
+
+    for (i = 0; i < layer_end - frozen->layer_offsets[layer]; ++i) {
+      bt_u64 block = (i / BT_FROZEN_BLOCK) * (BT_FROZEN_BLOCK + 1) + (i % BT_FROZEN_BLOCK) + 1;
+      bt_u32 l;
+
+      for (l = 1; l < layer; ++l) {
+        block *= BT_FROZEN_BLOCK + 1;
+      }
+      ids[i] = (block * BT_FROZEN_BLOCK < key_count) ? bt_frozen_leaf_id(frozen, block * BT_FROZEN_BLOCK) : BT_INVALID_ID;
     }
+  }
 
-    node_right = NULL;
-    if ((key_index_separator + 1) < BT_COUNTOF(node_separator->subs)) {
-      node_right = node_separator->subs[key_index_separator + 1];
+  return BT_ERROR_Ok;
+}
+
+BT_API BT_ErrorCode
+bt_freeze(BT_Context *tree, BT_Frozen *frozen)
+{
+  return bt_freeze_layout(tree, frozen, bt_false);
+}
+
+BT_API BT_ErrorCode
+bt_freeze_packed(BT_Context *tree, BT_Frozen *frozen)
+{
+  return bt_freeze_layout(tree, frozen, bt_true);
+}
+
+BT_API void
+bt_frozen_destroy(BT_Frozen *frozen)
+{
+  if (frozen->memory != NULL) {
+    bt_free_memory(&frozen->allocator, frozen->memory, frozen->memory_size, 64);
+  }
+  bt_memset(frozen, 0, sizeof(*frozen));
+}
+
+BT_API bt_u64
+bt_frozen_lower_bound(BT_Frozen *frozen, BT_KeyID id)
+{
+  bt_u64 position = 0;
+  bt_u32 layer;
+
+  if (frozen->key_count == 0) {
+    return 0;
+  }
+
+  /* NOTE(nick): position is the offset of the current block within its layer, rank in
+   * the last layer 0 block may step over to the first id of the next one. */
+  for (layer = frozen->layer_count - 1; layer > 0; --layer) {
+    bt_u32 rank = bt_frozen_block_rank(frozen->ids + frozen->layer_offsets[layer] + position, id);
+    position = position * (BT_FROZEN_BLOCK + 1) + rank * BT_FROZEN_BLOCK;
+  }
+  position += bt_frozen_leaf_rank(frozen, position / BT_FROZEN_BLOCK, id);
+
+  return (position < frozen->key_count) ? position : frozen->key_count;
+}
+
+BT_API bt_u64
+bt_frozen_upper_bound(BT_Frozen *frozen, BT_KeyID id)
+{
+  if (id == BT_INVALID_ID) {
+    return frozen->key_count;
+  }
+  return bt_frozen_lower_bound(frozen, id + 1);
+}
+
+BT_API bt_bool
+bt_frozen_search(BT_Frozen *frozen, BT_KeyID id, const void **data_out)
+{
+  bt_u64 position = bt_frozen_lower_bound(frozen, id);
+
+  if (position < frozen->key_count && bt_frozen_leaf_id(frozen, position) == id) {
+    if (data_out != NULL) {
+      *data_out = frozen->data[position];
     }
+    return bt_true;
+  }
+  return bt_false;
+}
 
-    if (node_right != NULL && node_right->key_count > 1) {
-      BT_ASSERT(node_deficient->subs[2] == NULL);
-      BT_ASSERT(frame_parent.key_index == key_index_separator);
+BT_API BT_KeyID
+bt_frozen_get_id(BT_Frozen *frozen, bt_u64 position)
+{
+  BT_ASSERT(position < frozen->key_count);
+  return bt_frozen_leaf_id(frozen, position);
+}
 
-      key = bt_node_get_key(node_separator, key_index_separator);
-      bt_node_add_key(node_deficient, key->id, key->data);
+BT_API const void *
+bt_frozen_get_data(BT_Frozen *frozen, bt_u64 position)
+{
+  BT_ASSERT(position < frozen->key_count);
+  return frozen->data[position];
+}
+
+BT_API BT_ErrorCode
+bt_frozen_visit_range(BT_Frozen *frozen, BT_KeyID id_min, BT_KeyID id_max, void *user_context, bt_visit_keys_sig *visit)
+{
+  bt_u64 position;
+
+  if (visit == NULL) {
+    return BT_ERROR_OpDenied;
+  }
+
+  for (position = bt_frozen_lower_bound(frozen, id_min); position < frozen->key_count; ++position) {
+    BT_KeyID id = bt_frozen_leaf_id(frozen, position);
+    if (id > id_max) {
+      break;
+    }
+    if (visit(user_context, id, frozen->data[position]) == bt_false) {
+      break;
+    }
+  }
+
+  return BT_ERROR_Ok;
+}
 
-      key = bt_node_get_key(node_right, 0);
-      bt_node_set_key(node_separator, key_index_separator, key->id, key->data);
+BT_INTERNAL void
+bt_sharded_lock(BT_Sharded *sharded, bt_u32 shard_index)
+{
+  if (sharded->lock != NULL) {
+    sharded->lock(sharded->lock_context, shard_index);
+  }
+}
 
-      /* NOTE(nick): Don't forget to move sub-node too. It belongs to the key that we 
-       * moved from right-node to the deficient-node. */
-      sub = bt_node_get_sub(node_right, 0);
-      bt_node_set_sub(node_deficient, 1, sub);
-      bt_shift_subs_left(node_right, 0);
+BT_INTERNAL void
+bt_sharded_unlock(BT_Sharded *sharded, bt_u32 shard_index)
+{
+  if (sharded->unlock != NULL) {
+    sharded->unlock(sharded->lock_context, shard_index);
+  }
+}
 
-      bt_shift_keys_left(node_right, 0);
-      node_right->key_count -= 1;
-    } else if (node_left != NULL && node_left->key_count > 1) {
-      BT_ASSERT(node_deficient->subs[2] == NULL);
-      BT_ASSERT(frame_parent.key_index == key_index_separator);
-      BT_ASSERT(key_index_separator > 0);
+BT_INTERNAL bt_bool
+bt_sharded_owns(BT_Sharded *sharded, bt_u32 shard_index, BT_KeyID id)
+{
+  return id >= sharded->shards[shard_index].id_min &&
+         (shard_index + 1 == sharded->shard_count || id < sharded->shards[shard_index + 1].id_min);
+}
 
-      key = bt_node_get_key(node_separator, key_index_separator - 1);
-      bt_node_add_key(node_deficient, key->id, key->data);
+/* NOTE(nick): Boundaries are read before the lock is taken and may move in between, the
+ * range is checked again once the shard is locked. */
+BT_INTERNAL bt_u32
+bt_sharded_lock_id(BT_Sharded *sharded, BT_KeyID id)
+{
+  for (;;) {
+    bt_u32 low = 0;
+    bt_u32 high = sharded->shard_count;
+
+    while (high - low > 1) {
+      bt_u32 middle = low + (high - low) / 2;
+      if (sharded->shards[middle].id_min <= id) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
 
-      bt_shift_subs_right(node_deficient, 0);
-      sub = bt_node_get_sub(node_left, node_left->key_count);
-      bt_node_set_sub(node_deficient, 0, sub);
-      bt_node_set_sub(node_left, node_left->key_count, NULL);
+    bt_sharded_lock(sharded, low);
+    if (bt_sharded_owns(sharded, low, id)) {
+      sharded->shards[low].load += 1;
+      return low;
+    }
+    bt_sharded_unlock(sharded, low);
+  }
+}
 
-      key = bt_node_get_key(node_left, node_left->key_count - 1);
-      bt_node_set_key(node_separator, key_index_separator - 1, key->id, key->data);
-      bt_node_invalidate_key(node_left, node_left->key_count - 1);
-      node_left->key_count -= 1;
-    } else {
-      BT_Node *node_dst;
-      BT_Node *node_src;
-      bt_s32 copy_count, i;
+/* NOTE(nick): Shards start with equal slices of the id space, allocators is either NULL
+ * or holds one allocator per shard. lock and unlock can be NULL for single-threaded use. */
+BT_API BT_ErrorCode
+bt_sharded_create(BT_Sharded *sharded, bt_u32 shard_count, bt_u32 value_size, const BT_Allocator *allocators,
+                  void *lock_context, bt_lock_sig *lock, bt_lock_sig *unlock)
+{
+  bt_u32 i;
 
-      if (node_left != NULL) {
-        BT_ASSERT(node_left->key_count < BT_COUNTOF(node_left->keys));
-        BT_ASSERT(key_index_separator > 0 );
+  if (shard_count == 0 || shard_count > BT_SHARD_MAX_COUNT) {
+    return BT_ERROR_OpDenied;
+  }
 
-        node_dst = node_left;
-        node_src = (node_deficient != NULL) ? node_deficient : node_right;
+  sharded->lock_context = lock_context;
+  sharded->lock = lock;
+  sharded->unlock = unlock;
+  sharded->shard_count = 0;
+  for (i = 0; i < shard_count; ++i) {
+    BT_Shard *shard = &sharded->shards[i];
+    BT_ErrorCode error_code;
 
-        /* NOTE(nick): Copy down key from parent to this deficient node. */
-        key = bt_node_get_key(node_separator, key_index_separator - 1);
-        bt_node_add_key(node_dst, key->id, key->data);
-        bt_shift_keys_left(node_separator, key_index_separator - 1);
-        bt_shift_subs_left(node_separator, key_index_separator);
-      } else {
-        node_dst = node_deficient;
-        node_src = node_right;
-        BT_ASSERT(node_dst->key_count == 0);
+    error_code = bt_create(&shard->tree, value_size, (allocators != NULL) ? &allocators[i] : NULL);
+    if (error_code != BT_ERROR_Ok) {
+      bt_sharded_destroy(sharded);
+      return error_code;
+    }
+    shard->id_min = (BT_KeyID)i * (BT_INVALID_ID / shard_count);
+    shard->load = 0;
+    sharded->shard_count += 1;
+  }
 
-        node_dst->keys[node_dst->key_count++] = node_separator->keys[key_index_separator];
-        BT_ASSERT(key_index_separator == frame_parent.key_index);
-        bt_shift_keys_left(node_separator, key_index_separator);
-      }
+  return BT_ERROR_Ok;
+}
 
-      copy_count = (bt_s32)node_src->key_count;
-      if ((node_dst->key_count + copy_count) >= BT_COUNTOF(node_dst->keys)) {
-        copy_count = BT_COUNTOF(node_dst->keys) - node_src->key_count - node_dst->key_count - 1;
-      }
+/* NOTE(nick): Takes no locks, nothing else may use the shards. */
+BT_API void
+bt_sharded_destroy(BT_Sharded *sharded)
+{
+  bt_u32 i;
 
-      for (i = 0; i < copy_count; ++i) {
-        BT_ASSERT(node_dst->key_count < BT_COUNTOF(node_dst->keys));
-        BT_ASSERT(node_src->key_count < BT_COUNTOF(node_src->keys));
+  for (i = 0; i < sharded->shard_count; ++i) {
+    bt_destroy(&sharded->shards[i].tree);
+  }
+  sharded->shard_count = 0;
+}
 
-        key = bt_node_get_key(node_src, i);
-        sub = bt_node_get_sub(node_src, i);
+BT_API bt_bool
+bt_sharded_search(BT_Sharded *sharded, BT_KeyID id, const void **data_out)
+{
+  bt_u32 shard_index = bt_sharded_lock_id(sharded, id);
+  BT_Key *key = bt_search(&sharded->shards[shard_index].tree, id, bt_false);
 
-        bt_node_set_key(node_dst, node_dst->key_count + i, key->id, key->data);
-        bt_node_set_sub(node_dst, node_dst->key_count + i, sub);
+  if (key != NULL && data_out != NULL) {
+    *data_out = key->data;
+  }
+  bt_sharded_unlock(sharded, shard_index);
+  return key != NULL;
+}
 
-        bt_node_invalidate_key(node_src, i);
-        bt_shift_subs_left(node_src, i);
+BT_API BT_ErrorCode
+bt_sharded_insert(BT_Sharded *sharded, BT_KeyID id, const void *data)
+{
+  bt_u32 shard_index = bt_sharded_lock_id(sharded, id);
+  BT_ErrorCode error_code = bt_insert(&sharded->shards[shard_index].tree, id, data);
 
-        node_src->key_count -= 1;
-        node_dst->key_count += 1;
-      }
+  bt_sharded_unlock(sharded, shard_index);
+  return error_code;
+}
 
-      sub = bt_node_get_sub(node_src, node_src->key_count);
-      bt_node_set_sub(node_src, node_src->key_count, NULL);
-      bt_node_set_sub(node_dst, node_dst->key_count, sub);
+BT_API BT_ErrorCode
+bt_sharded_upsert(BT_Sharded *sharded, BT_KeyID id, const void *data)
+{
+  bt_u32 shard_index = bt_sharded_lock_id(sharded, id);
+  BT_ErrorCode error_code = bt_upsert(&sharded->shards[shard_index].tree, id, data);
 
-      if (node_src->key_count == 0) {
-        if (node_src == tree->root) {
-          bt_free(tree->root, tree->malloc_ud);
-          tree->root = node_dst;
-        }
+  bt_sharded_unlock(sharded, shard_index);
+  return error_code;
+}
 
-        if (node_src == node_right) {
-          BT_ASSERT(bt_node_get_sub(node_separator, key_index_separator + 1) == node_src);
-          bt_shift_subs_left(node_separator, key_index_separator + 1);
-        }
+BT_API BT_ErrorCode
+bt_sharded_delete(BT_Sharded *sharded, BT_KeyID id)
+{
+  bt_u32 shard_index = bt_sharded_lock_id(sharded, id);
+  BT_ErrorCode error_code = bt_delete(&sharded->shards[shard_index].tree, id);
 
-        bt_free(node_src, tree->malloc_ud);
-        node_src = NULL;
-      }
+  bt_sharded_unlock(sharded, shard_index);
+  return error_code;
+}
 
-      BT_ASSERT(node_separator->key_count > 0);
-      bt_node_invalidate_key(node_separator, node_separator->key_count - 1);
-      node_separator->key_count -= 1;
+/* NOTE(nick): Locks the shard that owns id and seeks from there, moving on to the next shard
+ * in the given direction while the sought ones have no keys. Boundaries of a shard only move
+ * while its lock is held, so the one read before unlocking is where the next seek starts. */
+BT_INTERNAL BT_Key *
+bt_sharded_cursor_find(BT_ShardedCursor *cursor, BT_KeyID id, bt_bool forward)
+{
+  BT_Sharded *sharded = cursor->sharded;
+  BT_Key *key;
+
+  for (;;) {
+    bt_u32 shard_index = bt_sharded_lock_id(sharded, id);
+
+    cursor->shard_index = shard_index;
+    key = bt_seek(&sharded->shards[shard_index].tree, id, forward ? BT_SEEK_GreaterEqual : BT_SEEK_LessEqual,
+                  &cursor->cursor);
+    if (key != NULL) {
+      cursor->last_id = key->id;
+      return key;
     }
+    if (forward ? (shard_index + 1 == sharded->shard_count) : (shard_index == 0)) {
+      break;
+    }
+    id = forward ? sharded->shards[shard_index + 1].id_min : sharded->shards[shard_index].id_min - 1;
+    bt_sharded_unlock(sharded, shard_index);
   }
 
-  return BT_ERROR_Ok;
+  bt_sharded_unlock(sharded, cursor->shard_index);
+  cursor->shard_index = sharded->shard_count;
+  return NULL;
 }
 
-BT_API BT_ErrorCode
-bt_visit_keys(BT_Context *tree, BT_VisitNodesMode mode, void *user_context, bt_visit_keys_sig *visit)
+/* NOTE(nick): Steps over to the neighbouring shard when the current one runs out of keys.
+ * Only one shard is locked at a time and a rebalance may move the boundary once the lock is
+ * dropped, so the cursor goes on from the id next to the last one it returned rather than
+ * from the first key of the next shard. That way no key is skipped or returned twice. */
+BT_INTERNAL BT_Key *
+bt_sharded_cursor_step(BT_ShardedCursor *cursor, BT_Key *key, bt_bool forward)
 {
-  BT_Node *node;
-  bt_u32 i;
+  BT_Sharded *sharded = cursor->sharded;
 
-  if (tree->root == NULL) {
-    return BT_ERROR_Ok;
-  } 
-
-  if (visit == NULL) {
-    return BT_ERROR_OpDenied;
+  if (key != NULL) {
+    cursor->last_id = key->id;
+    return key;
   }
 
-  node = tree->root;
-  bt_reset_stack(tree);
+  bt_sharded_unlock(sharded, cursor->shard_index);
+  if (forward ? (cursor->last_id + 1 >= BT_INVALID_ID) : (cursor->last_id == 0)) {
+    cursor->shard_index = sharded->shard_count;
+    return NULL;
+  }
+  return bt_sharded_cursor_find(cursor, forward ? cursor->last_id + 1 : cursor->last_id - 1, forward);
+}
 
-  switch (mode) {
-  case BT_VISIT_NODE_TopDown: {
-    while (node != NULL) {
-      for (i = 0; i < node->key_count; ++i) {
-        BT_Key *key = bt_node_get_key(node, i);
-        if (visit(user_context, key->id, key->data) == bt_false) {
-          return BT_ERROR_Ok;
-        }
-      }
+BT_API BT_Key *
+bt_sharded_cursor_seek(BT_Sharded *sharded, BT_KeyID id, BT_ShardedCursor *cursor)
+{
+  cursor->sharded = sharded;
+  cursor->last_id = id;
+  return bt_sharded_cursor_find(cursor, id, bt_true);
+}
 
-      if (bt_is_node_leaf(node)) {
-        BT_StackFrame frame;
+BT_API BT_Key *
+bt_sharded_cursor_next(BT_ShardedCursor *cursor)
+{
+  if (cursor->shard_index >= cursor->sharded->shard_count) {
+    return NULL;
+  }
+  return bt_sharded_cursor_step(cursor, bt_cursor_next(&cursor->cursor), bt_true);
+}
 
-        node = NULL;
-        while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
-          frame.key_index += 1;
-          if (frame.key_index <= frame.node->key_count) {
-            BT_Node *sub = bt_node_get_sub(frame.node, frame.key_index);
-            if (sub != NULL) {
-              BT_ErrorCode error_code;
+BT_API BT_Key *
+bt_sharded_cursor_prev(BT_ShardedCursor *cursor)
+{
+  if (cursor->shard_index >= cursor->sharded->shard_count) {
+    return NULL;
+  }
+  return bt_sharded_cursor_step(cursor, bt_cursor_prev(&cursor->cursor), bt_false);
+}
 
-              error_code = bt_push_stack_frame(tree, frame.node, frame.key_index);
-              if (error_code != BT_ERROR_Ok) {
-                return error_code;
-              }
+BT_API void
+bt_sharded_cursor_close(BT_ShardedCursor *cursor)
+{
+  if (cursor->shard_index < cursor->sharded->shard_count) {
+    bt_sharded_unlock(cursor->sharded, cursor->shard_index);
+    cursor->shard_index = cursor->sharded->shard_count;
+  }
+}
 
-              node = sub;
-              BT_ASSERT(node->key_count > 0);
-              break;
-            }
-          }
-        }
-      } else {
-        BT_ErrorCode error_code;
+/* NOTE(nick): Picks the middle key of tree as a new boundary, or the middle of the range
+ * when there are too few keys. Returns bt_false when the range can't be split. */
+BT_INTERNAL bt_bool
+bt_sharded_pick_boundary(BT_Context *tree, BT_KeyID id_min, BT_KeyID id_end, BT_KeyID *boundary_out)
+{
+  bt_u64 key_count = 0;
+  BT_Key *key;
 
-        BT_ASSERT(node->key_count > 0);
-        error_code = bt_push_stack_frame(tree, node, 0);
-        if (error_code != BT_ERROR_Ok) {
-          return error_code;
-        }
+#if defined(BT_ORDER_STATISTICS)
+  key_count = bt_rank(tree, BT_INVALID_ID);
+  key = (key_count >= 2) ? bt_select(tree, key_count / 2, NULL) : NULL;
+#else
+  {
+    BT_Cursor cursor;
+    bt_u64 i;
 
-        node = bt_node_get_sub(node, 0);
-      }
+    for (key = bt_cursor_first(tree, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+      key_count += 1;
     }
-  } break;
+    key = bt_cursor_first(tree, &cursor);
+    for (i = 0; key != NULL && i < key_count / 2; ++i) {
+      key = bt_cursor_next(&cursor);
+    }
+    if (key_count < 2) {
+      key = NULL;
+    }
+  }
+#endif
 
-  case BT_VISIT_NODE_BottomUp: {
-    while (node != NULL) {
-      if (bt_is_node_leaf(node)) {
-        BT_StackFrame frame;
+  if (key != NULL) {
+    *boundary_out = key->id;
+    return bt_true;
+  }
+  if (id_end - id_min >= 2) {
+    *boundary_out = id_min + (id_end - id_min) / 2;
+    return bt_true;
+  }
+  return bt_false;
+}
 
-        for (i = 0; i < node->key_count; ++i) {
-          BT_Key *key = bt_node_get_key(node, i);
-          if (visit(user_context, key->id, key->data) == bt_false) {
-            return BT_ERROR_Ok;
-          }
-        }
+/* NOTE(nick): Moves every key of src into dst, ranges of the two don't overlap. Nodes are
+ * handed over by bt_join when both trees share an allocator, otherwise keys are copied. */
+BT_INTERNAL BT_ErrorCode
+bt_sharded_merge(BT_Context *dst, BT_Context *src, bt_bool src_is_left)
+{
+  BT_ErrorCode error_code;
 
-        node = NULL;
-        while (bt_pop_stack_frame(tree, &frame) == BT_ERROR_Ok) {
-          frame.key_index += 1;
+  if (src_is_left) {
+    error_code = bt_join(src, dst);
+    if (error_code == BT_ERROR_Ok) {
+      error_code = bt_join(dst, src);
+    }
+  } else {
+    error_code = bt_join(dst, src);
+  }
 
-          if (frame.key_index > frame.node->key_count) {
-            for (i = 0; i < frame.node->key_count; ++i) {
-              BT_Key *key = bt_node_get_key(frame.node, i);
-              if (visit(user_context, key->id, key->data) == bt_false) {
-                return BT_ERROR_Ok;
-              }
-            }
-          } else {
-            BT_Node *sub = bt_node_get_sub(frame.node, frame.key_index);
-            if (sub != NULL) {
-              BT_ErrorCode error_code;
+  if (error_code == BT_ERROR_OpDenied) {
+    BT_Cursor cursor;
+    BT_Key *key;
 
-              error_code = bt_push_stack_frame(tree, frame.node, frame.key_index);
-              if (error_code != BT_ERROR_Ok) {
-                return error_code;
-              }
+    error_code = BT_ERROR_Ok;
+    for (key = bt_cursor_first(src, &cursor); key != NULL && error_code == BT_ERROR_Ok; key = bt_cursor_next(&cursor)) {
+      error_code = bt_insert(dst, key->id, key->data);
+    }
+    if (error_code == BT_ERROR_Ok) {
+      error_code = bt_clear(src);
+    }
+  }
 
-              node = sub;
-              BT_ASSERT(node->key_count > 0);
-              break;
-            }
-          }
-        }
-      } else {
-        BT_ErrorCode error_code;
+  return error_code;
+}
 
-        BT_ASSERT(node->key_count > 0);
-        error_code = bt_push_stack_frame(tree, node, 0);
-        if (error_code != BT_ERROR_Ok) {
-          return error_code;
-        }
+/* NOTE(nick): Walks neighbouring pairs of shards and moves half of the keys of the busier
+ * one over when its load is more than BT_SHARD_REBALANCE_RATIO times the other, then halves
+ * every load. Only the pair being looked at is locked. Moves go through bt_split_at and
+ * bt_join, so with BT_REGION_NODES a move costs O(n) in the moved keys. */
+BT_API BT_ErrorCode
+bt_sharded_rebalance(BT_Sharded *sharded)
+{
+  BT_ErrorCode error_code = BT_ERROR_Ok;
+  bt_u32 i;
 
-        node = bt_node_get_sub(node, 0);
+  for (i = 0; i + 1 < sharded->shard_count && error_code == BT_ERROR_Ok; ++i) {
+    BT_Shard *left = &sharded->shards[i];
+    BT_Shard *right = &sharded->shards[i + 1];
+    BT_KeyID id_end = (i + 2 < sharded->shard_count) ? sharded->shards[i + 2].id_min : BT_INVALID_ID;
+    BT_KeyID boundary;
+    BT_Context temp;
+
+    bt_memset(&temp, 0, sizeof(temp));
+    bt_sharded_lock(sharded, i);
+    bt_sharded_lock(sharded, i + 1);
+
+    if (left->load > BT_SHARD_REBALANCE_RATIO * right->load &&
+        bt_sharded_pick_boundary(&left->tree, left->id_min, right->id_min, &boundary)) {
+      error_code = bt_split_at(&left->tree, boundary, &temp);
+      if (error_code == BT_ERROR_Ok) {
+        error_code = bt_sharded_merge(&right->tree, &temp, bt_true);
+      }
+      bt_destroy(&temp);
+      if (error_code == BT_ERROR_Ok) {
+        right->id_min = boundary;
+      }
+    } else if (right->load > BT_SHARD_REBALANCE_RATIO * left->load &&
+               bt_sharded_pick_boundary(&right->tree, right->id_min, id_end, &boundary)) {
+      error_code = bt_split_at(&right->tree, boundary, &temp);
+      if (error_code == BT_ERROR_Ok) {
+        error_code = bt_sharded_merge(&left->tree, &right->tree, bt_false);
+      }
+      if (error_code == BT_ERROR_Ok) {
+        error_code = bt_sharded_merge(&right->tree, &temp, bt_false);
+      }
+      bt_destroy(&temp);
+      if (error_code == BT_ERROR_Ok) {
+        right->id_min = boundary;
       }
     }
-  } break;
 
-  default: break;
+    left->load /= 2;
+    if (i + 2 == sharded->shard_count) {
+      right->load /= 2;
+    }
+
+    bt_sharded_unlock(sharded, i + 1);
+    bt_sharded_unlock(sharded, i);
   }
 
-  return BT_ERROR_Ok;
+  return error_code;
 }
 
 #if 0
@@ -18,13 +18,20 @@
 #include "xlib/core/arena.h"
 
 #if 1
-static U32 ids[] = { 48, 85, 45, 92, 26, 49, 27, 22, 10, 93, 94, 96, 97, 98, 39, 83, 52, 73, 84, 76, 99, }; //32, 33, 75, 78, 102, 33, 1, 5, 8, 9, 13, 4, 25 }; 
+static U32 ids[] = { 48, 85, 45, 92, 26, 49, 27, 22, 10, 93, 94, 96, 97, 98, 39, 83, 52, 73, 84, 76, 99, }; /* 32, 33, 75, 78, 102, 33, 1, 5, 8, 9, 13, 4, 25 }; */
 #else
 #include "test_set.h"
 #endif
 
 static S32 memory_usage = 0;
 
+/* NOTE(nick): Sits right in front of every block handed out by test_malloc. Blocks are
+ * aligned to at least 16 bytes, so is the header. */
+typedef struct TestAllocHeader {
+    void *memory;
+    U32 size;
+} TestAllocHeader;
+
 BT_MALLOC_SIG(test_malloc)
 {
 #if 0
@@ -39,24 +46,41 @@ BT_MALLOC_SIG(test_malloc)
 
     return result;
 #else
-    void *result;
-    result = malloc(size + sizeof(U32));
-    *(U32 *)result = size;
-    result = (void *)((U8 *)result + sizeof(U32));
+    U8 *memory;
+    TestAllocHeader *header;
+
+    if (alignment < 16) {
+        alignment = 16;
+    }
+    memory = (U8 *)malloc(size + alignment - 1 + sizeof(TestAllocHeader));
+    if (memory == NULL) {
+        return NULL;
+    }
+    header = (TestAllocHeader *)(((size_t)(memory + sizeof(TestAllocHeader)) + (size_t)(alignment - 1)) & ~(size_t)(alignment - 1)) - 1;
+    header->memory = memory;
+    header->size = size;
     memory_usage += size;
-    return result;
+    if (context != NULL) {
+        *(S32 *)context += size;
+    }
+    return header + 1;
 #endif
 }
 
 BT_FREE_SIG(test_free)
 {
     if (ptr != NULL) {
-        void *ptr_header = (void *)((U8 *)ptr - sizeof(U32)); 
-        U32 ptr_size = *(U32 *)(ptr_header);
+        TestAllocHeader *header = (TestAllocHeader *)ptr - 1;
+        U32 ptr_size = header->size;
+        x_assert(ptr_size == size);
         memory_usage -= ptr_size;
         x_assert(memory_usage >= 0);
+        if (context != NULL) {
+            *(S32 *)context -= ptr_size;
+            x_assert(*(S32 *)context >= 0);
+        }
         x_memset(ptr, 0xfe, ptr_size);
-        free(ptr_header);
+        free(header->memory);
     }
 }
 
@@ -71,74 +95,2734 @@ BT_VISIT_KEYS_SIG(test_visit_keys)
     return bt_true;
 }
 
-bt_bool
-test_id(U32 test_id)
+static void
+test_init_allocator(BT_Allocator *allocator)
+{
+    x_memset(allocator, 0, sizeof(*allocator));
+    allocator->alloc_memory = test_malloc;
+    allocator->free_memory = test_free;
+}
+
+static U32
+test_random(void)
+{
+    static U32 state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+#define TEST_KEY_COUNT 512
+
+/* NOTE(nick): Keys of the reference set are i * 3 + 1, so there are gaps to put range
+ * bounds into. present[TEST_KEY_COUNT] stands for BT_INVALID_ID - 1. */
+static U8 test_present[TEST_KEY_COUNT + 1];
+
+static BT_KeyID
+test_key_id(U32 i)
+{
+    return (i == TEST_KEY_COUNT) ? BT_INVALID_ID - 1 : (BT_KeyID)i * 3 + 1;
+}
+
+static bt_bool
+test_same_key(BT_Key *a, BT_Key *b)
+{
+    return (a == NULL) ? (b == NULL) : (b != NULL && a->id == b->id && a->data == b->data);
+}
+
+static bt_bool
+test_check_keys(BT_Context *btree, const char *name)
+{
+    BT_Cursor cursor;
+    BT_Key *key;
+    U32 i = 0;
+    U32 first = TEST_KEY_COUNT + 1;
+    U32 last = TEST_KEY_COUNT + 1;
+
+    for (key = bt_cursor_first(btree, &cursor); key != NULL; key = bt_cursor_next(&cursor)) {
+        while (i <= TEST_KEY_COUNT && !test_present[i]) {
+            i += 1;
+        }
+        if (i > TEST_KEY_COUNT || key->id != test_key_id(i)) {
+            printf("%s: iteration has an unexpected key\n", name);
+            return bt_false;
+        }
+        if (first > TEST_KEY_COUNT) {
+            first = i;
+        }
+        last = i;
+        i += 1;
+    }
+    while (i <= TEST_KEY_COUNT && !test_present[i]) {
+        i += 1;
+    }
+    if (i <= TEST_KEY_COUNT) {
+        printf("%s: iteration misses key %u\n", name, i);
+        return bt_false;
+    }
+
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if ((bt_search(btree, test_key_id(i), bt_false) != NULL) != (test_present[i] != 0)) {
+            printf("%s: search disagrees on key %u\n", name, i);
+            return bt_false;
+        }
+    }
+
+    if (first > TEST_KEY_COUNT) {
+        if (bt_min(btree) != NULL || bt_max(btree) != NULL) {
+            printf("%s: empty tree has a min or max\n", name);
+            return bt_false;
+        }
+    } else if (bt_min(btree) == NULL || bt_min(btree)->id != test_key_id(first) ||
+               bt_max(btree) == NULL || bt_max(btree)->id != test_key_id(last)) {
+        printf("%s: wrong min or max\n", name);
+        return bt_false;
+    }
+
+    return bt_true;
+}
+
+static void
+test_fill(BT_Context *btree, bt_bool with_top)
+{
+    U32 i;
+
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        test_present[i] = (i < TEST_KEY_COUNT || with_top);
+        if (test_present[i]) {
+            bt_insert(btree, test_key_id(i), NULL);
+        }
+    }
+}
+
+static void
+test_forget_range(BT_KeyID id_min, BT_KeyID id_max)
 {
     U32 i;
 
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (test_key_id(i) >= id_min && test_key_id(i) <= id_max) {
+            test_present[i] = 0;
+        }
+    }
+}
+
+static bt_bool
+test_delete_range(void)
+{
     BT_Allocator allocator;
     BT_Context btree;
+    BT_KeyID ranges[][2] = {
+        { 100, 50 },                      /* id_min > id_max */
+        { 3, 3 },                         /* between two keys */
+        { 0, BT_INVALID_ID },             /* whole tree */
+        { 700, BT_INVALID_ID },           /* up to the largest id */
+        { 0, 700 },
+        { 301, 301 },                     /* single key */
+        { 2000, BT_INVALID_ID - 1 },
+        { 0, 0 },                         /* placeholder, crosses the root */
+    };
+    U32 r, step;
 
-    allocator.alloc_memory_context = NULL;
-    allocator.alloc_memory = test_malloc;
+    test_init_allocator(&allocator);
 
-    allocator.free_memory_context = NULL;
-    allocator.free_memory = test_free;
+    for (r = 0; r < x_countof(ranges); ++r) {
+        BT_KeyID id_min = ranges[r][0];
+        BT_KeyID id_max = ranges[r][1];
 
-    allocator.realloc_memory_context = NULL;
-    allocator.realloc_memory = test_realloc;
+        bt_create(&btree, 0, &allocator);
+        test_fill(&btree, bt_true);
+        if (r + 1 == x_countof(ranges)) {
+            id_min = btree.root->keys[0].id - 100;
+            id_max = btree.root->keys[btree.root->key_count - 1].id + 100;
+        }
+        if (bt_delete_range(&btree, id_min, id_max) != BT_ERROR_Ok) {
+            printf("delete_range: failed\n");
+            return bt_false;
+        }
+        test_forget_range(id_min, id_max);
+        if (!test_check_keys(&btree, "delete_range")) {
+            printf("delete_range: range %u\n", r);
+            return bt_false;
+        }
+        bt_destroy(&btree);
+    }
 
-    bt_create(&btree, &allocator);
+    /* NOTE(nick): Random ranges on a tree that keeps getting new keys in between. */
+    bt_create(&btree, 0, &allocator);
+    test_fill(&btree, bt_false);
+    for (step = 0; step < 300; ++step) {
+        BT_KeyID id_min = test_random() % (TEST_KEY_COUNT * 3);
+        BT_KeyID id_max = id_min + test_random() % (step % 10 == 0 ? TEST_KEY_COUNT * 3 : 40);
+        U32 i;
 
-    for (i = 0; i < x_countof(ids); ++i) {
-        U32 k;
+        bt_delete_range(&btree, id_min, id_max);
+        test_forget_range(id_min, id_max);
+        for (i = 0; i < 20; ++i) {
+            U32 k = test_random() % TEST_KEY_COUNT;
+            bt_insert(&btree, test_key_id(k), NULL);
+            test_present[k] = 1;
+        }
+        if (!test_check_keys(&btree, "delete_range")) {
+            printf("delete_range: random step %u\n", step);
+            return bt_false;
+        }
+    }
+    bt_destroy(&btree);
 
-        printf("Inserting %d...", ids[i]);
-        bt_insert(&btree, ids[i], &ids[i]);
+    x_assert(memory_usage == 0);
+    return bt_true;
+}
 
-#if 1
-        for (k = 0; k < i; ++k) {
-            if (bt_search(&btree, ids[k]) != NULL) {
-            } else {
-                printf("error, insert broke node search. Cannot find %d\n", ids[k]);
+/* NOTE(nick): Nodes only get searched by interpolation once they hold
+ * BT_INTERPOLATION_MIN_KEYS keys, half full nodes have to reach that. */
+#if BT_KEY_COUNT >= 2 * BT_INTERPOLATION_MIN_KEYS
+/* NOTE(nick): Ids of the skewed set double within groups of 32, so guesses from the first
+ * and last id of a node land far off. */
+static BT_KeyID
+test_skewed_id(U32 i)
+{
+    return ((BT_KeyID)(i / 32) << 40) + ((BT_KeyID)3 << (i % 32));
+}
+
+static bt_bool
+test_search_skewed(BT_Context *btree, BT_NodeSearch mode, BT_NodeSearchStats *stats_out)
+{
+    U32 i, round;
+
+    /* NOTE(nick): Appended keys of unsorted leaves get sorted first, only sorted keys are guessed. */
+    bt_flush_writes(btree);
+    bt_set_node_search(btree, mode);
+    for (round = 0; round < 4; ++round) {
+        for (i = 0; i < TEST_KEY_COUNT; ++i) {
+            BT_Key *key = bt_search(btree, test_skewed_id(i), bt_false);
+            BT_Key *gap = bt_search(btree, test_skewed_id(i) + 1, bt_false);
+
+            if (key == NULL || key->id != test_skewed_id(i) || gap != NULL) {
+                printf("node_search: skewed search disagrees on key %u\n", i);
                 return bt_false;
             }
         }
+    }
+    bt_node_search_get_stats(btree, stats_out);
+    return bt_true;
+}
 
-        if (k == i) {
-            printf("OK.\n");
+static bt_bool
+test_node_search(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    BT_NodeSearchStats stats;
+    BT_NodeSearchStats interpolation_stats;
+    U32 i;
+
+    test_init_allocator(&allocator);
+
+    /* NOTE(nick): Evenly spaced ids, guesses should mostly land. */
+    bt_create(&btree, 0, &allocator);
+    test_fill(&btree, bt_false);
+    bt_set_node_search(&btree, BT_NODE_SEARCH_Interpolation);
+    if (!test_check_keys(&btree, "node_search")) {
+        return bt_false;
+    }
+    for (i = 0; i < TEST_KEY_COUNT; i += 3) {
+        bt_delete(&btree, test_key_id(i));
+        test_present[i] = 0;
+    }
+    if (!test_check_keys(&btree, "node_search")) {
+        return bt_false;
+    }
+    bt_node_search_get_stats(&btree, &stats);
+    if (stats.guesses == 0 || stats.fallbacks * 4 > stats.guesses) {
+        printf("node_search: interpolation missed on evenly spaced ids\n");
+        return bt_false;
+    }
+    bt_destroy(&btree);
+
+    /* NOTE(nick): Skewed ids make interpolation fall back, Auto has to notice and spend
+     * whole windows on binary search, so it guesses less than plain interpolation. */
+    bt_create(&btree, 0, &allocator);
+    for (i = 0; i < TEST_KEY_COUNT; ++i) {
+        bt_insert(&btree, test_skewed_id(i * 97 % TEST_KEY_COUNT), NULL);
+    }
+    if (!test_search_skewed(&btree, BT_NODE_SEARCH_Interpolation, &interpolation_stats) ||
+        !test_search_skewed(&btree, BT_NODE_SEARCH_Auto, &stats)) {
+        return bt_false;
+    }
+    if (interpolation_stats.fallbacks * 4 <= interpolation_stats.guesses) {
+        printf("node_search: skewed ids didn't make interpolation fall back\n");
+        return bt_false;
+    }
+    if (stats.guesses == 0 || stats.guesses >= interpolation_stats.guesses) {
+        printf("node_search: auto didn't fall back to binary search\n");
+        return bt_false;
+    }
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return bt_true;
+}
+#else
+static bt_bool
+test_node_search(void)
+{
+    return bt_true;
+}
+#endif
+
+#if defined(BT_UNSORTED_LEAVES)
+/* NOTE(nick): Point lookups between the inserts go through the appended keys of leaves,
+ * test_check_keys walks in order and sorts them. */
+static bt_bool
+test_search_unsorted(BT_Context *btree, const char *name)
+{
+    U32 i;
+
+    for (i = 0; i < TEST_KEY_COUNT; ++i) {
+        BT_Key *key = bt_search(btree, test_key_id(i), bt_false);
+
+        if ((key != NULL) != (test_present[i] != 0) || (key != NULL && key->data != (void *)&test_present[i])) {
+            printf("%s: unsorted search disagrees on key %u\n", name, i);
+            return bt_false;
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_unsorted_leaves(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    U32 i, step;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    x_memset(test_present, 0, sizeof(test_present));
+
+    for (i = 0; i < TEST_KEY_COUNT; ++i) {
+        U32 k = i * 97 % TEST_KEY_COUNT;
+        bt_insert(&btree, test_key_id(k), &test_present[k]);
+        test_present[k] = 1;
+        if (i % 64 == 63 && !test_search_unsorted(&btree, "unsorted_leaves")) {
+            return bt_false;
+        }
+    }
+    if (btree.unsorted_leaf_count == 0) {
+        printf("unsorted_leaves: shuffled inserts didn't append to any leaf\n");
+        return bt_false;
+    }
+    if (!test_check_keys(&btree, "unsorted_leaves") || btree.unsorted_leaf_count != 0) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Upserts of appended keys replace them in place, deletes sort first. */
+    for (step = 0; step < 8; ++step) {
+        for (i = 0; i < 64; ++i) {
+            U32 k = test_random() % TEST_KEY_COUNT;
+
+            if (test_random() % 3 == 0) {
+                bt_delete(&btree, test_key_id(k));
+                test_present[k] = 0;
+            } else {
+                bt_upsert(&btree, test_key_id(k), &test_present[k]);
+                test_present[k] = 1;
+            }
+        }
+        if (!test_search_unsorted(&btree, "unsorted_leaves") || !test_check_keys(&btree, "unsorted_leaves")) {
+            printf("unsorted_leaves: step %u\n", step);
+            return bt_false;
         }
+    }
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return bt_true;
+}
+#else
+static bt_bool
+test_unsorted_leaves(void)
+{
+    return bt_true;
+}
 #endif
+
+#if defined(BT_RADIX_ENGINE)
+/* NOTE(nick): Walks both engines in lockstep both ways, then seeks around every key of
+ * the B-tree and takes one cursor step from each seek. */
+static bt_bool
+test_compare_engines(BT_Context *btree, BT_Context *radix, const char *name)
+{
+    BT_Cursor cursor_btree, cursor_radix, probe_btree, probe_radix;
+    BT_Key *key_btree, *key_radix;
+    U32 j;
+
+    key_btree = bt_cursor_first(btree, &cursor_btree);
+    key_radix = bt_cursor_first(radix, &cursor_radix);
+    for (;;) {
+        if (!test_same_key(key_btree, key_radix)) {
+            printf("%s: engines disagree going forward\n", name);
+            return bt_false;
+        }
+        if (key_btree == NULL) {
+            break;
+        }
+        key_btree = bt_cursor_next(&cursor_btree);
+        key_radix = bt_cursor_next(&cursor_radix);
     }
 
-    printf("---------------------------\n");
-    printf("Deleting %d\n", test_id);
+    key_btree = bt_cursor_last(btree, &cursor_btree);
+    key_radix = bt_cursor_last(radix, &cursor_radix);
+    for (;;) {
+        if (!test_same_key(key_btree, key_radix)) {
+            printf("%s: engines disagree going backward\n", name);
+            return bt_false;
+        }
+        if (key_btree == NULL) {
+            break;
+        }
+        key_btree = bt_cursor_prev(&cursor_btree);
+        key_radix = bt_cursor_prev(&cursor_radix);
+    }
 
-    bt_delete(&btree, test_id);
-    for (i = 0; i < x_countof(ids); ++i) {
-        if (bt_search(&btree, ids[i])) {
-            if (ids[i] == test_id) {
-                printf("Error: Deleted from %d, but search still found it.\n", ids[i]);
+    if (!test_same_key(bt_min(btree), bt_min(radix)) || !test_same_key(bt_max(btree), bt_max(radix))) {
+        printf("%s: engines disagree on min or max\n", name);
+        return bt_false;
+    }
+
+    for (key_btree = bt_cursor_first(btree, &cursor_btree); key_btree != NULL; key_btree = bt_cursor_next(&cursor_btree)) {
+        for (j = 0; j < 3; ++j) {
+            BT_KeyID id = key_btree->id + j - 1;
+
+            if (!test_same_key(bt_search(btree, id, bt_false), bt_search(radix, id, bt_false)) ||
+                !test_same_key(bt_floor(btree, id, NULL), bt_floor(radix, id, NULL)) ||
+                !test_same_key(bt_upper_bound(btree, id, NULL), bt_upper_bound(radix, id, NULL))) {
+                printf("%s: engines disagree on seeks around %u\n", name, (U32)key_btree->id);
                 return bt_false;
-            } else {
-                printf("Found %d\n", ids[i]);
             }
-        } else {
-            if (ids[i] != test_id) {
-                printf("Could not find %d, delete has corrupted tree structure.\n", ids[i]);
+            if (!test_same_key(bt_lower_bound(btree, id, &probe_btree), bt_lower_bound(radix, id, &probe_radix)) ||
+                !test_same_key(bt_cursor_next(&probe_btree), bt_cursor_next(&probe_radix)) ||
+                !test_same_key(bt_floor(btree, id, &probe_btree), bt_floor(radix, id, &probe_radix)) ||
+                !test_same_key(bt_cursor_prev(&probe_btree), bt_cursor_prev(&probe_radix))) {
+                printf("%s: engines disagree stepping from seeks around %u\n", name, (U32)key_btree->id);
                 return bt_false;
             }
         }
     }
+    return bt_true;
+}
+
+/* NOTE(nick): Kind the root of count ids that only differ in the last byte has. Nodes
+ * grow when full and shrink at 3/4 of the smaller kind on the way down. */
+static U32
+test_radix_root_kind(U32 count, bt_bool growing)
+{
+    if (count == 0) {
+        return 0;
+    } else if (count == 1) {
+        return BT_RADIX_Leaf;
+    } else if (growing) {
+        return (count <= 4) ? BT_RADIX_Node4 : (count <= 16) ? BT_RADIX_Node16 : (count <= 48) ? BT_RADIX_Node48 : BT_RADIX_Node256;
+    }
+    return (count <= 3) ? BT_RADIX_Node4 : (count <= 12) ? BT_RADIX_Node16 : (count <= 36) ? BT_RADIX_Node48 : BT_RADIX_Node256;
+}
 
-    bt_visit_keys(&btree, BT_VISIT_NODE_TopDown, NULL, test_visit_keys);
+static bt_bool
+test_radix_root(BT_Context *radix, U32 count, bt_bool growing, U32 prefix_length)
+{
+    BT_RadixNode *root = radix->radix_root;
+
+    if (count == 0) {
+        return root == NULL;
+    }
+    if (root == NULL || root->kind != test_radix_root_kind(count, growing)) {
+        return bt_false;
+    }
+    return root->kind == BT_RADIX_Leaf || (root->child_count == count && root->prefix_length == prefix_length);
+}
+
+static bt_bool
+test_radix_engine(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree, radix;
+    BT_KeyID base = BT_U64_CONST(0x01020304, 0x05060700);
+    BT_KeyID split = base + ((BT_KeyID)1 << 32);
+    U32 i, step;
+
+    test_init_allocator(&allocator);
+
+    /* NOTE(nick): Ids below only differ in their last byte, the root keeps the other 7 as
+     * its prefix and goes through every node kind both ways. */
+    bt_create_engine(&btree, 0, &allocator, BT_ENGINE_BTree);
+    bt_create_engine(&radix, 0, &allocator, BT_ENGINE_Radix);
+    for (i = 0; i < 256; ++i) {
+        bt_insert(&btree, base + i, &test_present[i]);
+        bt_insert(&radix, base + i, &test_present[i]);
+        if (!test_radix_root(&radix, i + 1, bt_true, 7)) {
+            printf("radix: wrong root after %u inserts\n", i + 1);
+            return bt_false;
+        }
+    }
+    if (!test_compare_engines(&btree, &radix, "radix grown")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): An id that differs in the 4th byte splits the prefix, deleting it merges
+     * the prefix back into the Node256. */
+    bt_insert(&btree, split, NULL);
+    bt_insert(&radix, split, NULL);
+    if (radix.radix_root->kind != BT_RADIX_Node4 || radix.radix_root->prefix_length != 3 ||
+        !test_compare_engines(&btree, &radix, "radix split prefix")) {
+        printf("radix: prefix didn't split\n");
+        return bt_false;
+    }
+    bt_delete(&btree, split);
+    bt_delete(&radix, split);
+    if (!test_radix_root(&radix, 256, bt_true, 7)) {
+        printf("radix: prefix didn't merge back\n");
+        return bt_false;
+    }
+
+    for (i = 256; i > 0; --i) {
+        bt_delete(&btree, base + i - 1);
+        bt_delete(&radix, base + i - 1);
+        if (!test_radix_root(&radix, i - 1, bt_false, 7)) {
+            printf("radix: wrong root with %u keys left\n", i - 1);
+            return bt_false;
+        }
+        if (i % 16 == 0 && !test_compare_engines(&btree, &radix, "radix shrunk")) {
+            return bt_false;
+        }
+    }
+    bt_destroy(&btree);
+    bt_destroy(&radix);
+
+    /* NOTE(nick): Same inserts and deletes against both engines and the reference set. */
+    bt_create_engine(&btree, 0, &allocator, BT_ENGINE_BTree);
+    bt_create_engine(&radix, 0, &allocator, BT_ENGINE_Radix);
+    test_fill(&btree, bt_true);
+    test_fill(&radix, bt_true);
+    if (!test_check_keys(&btree, "radix btree") || !test_check_keys(&radix, "radix") ||
+        !test_compare_engines(&btree, &radix, "radix filled")) {
+        return bt_false;
+    }
+    for (step = 0; step < 16; ++step) {
+        for (i = 0; i < 64; ++i) {
+            U32 k = test_random() % (TEST_KEY_COUNT + 1);
 
+            if (test_random() % 2 == 0) {
+                bt_delete(&btree, test_key_id(k));
+                bt_delete(&radix, test_key_id(k));
+                test_present[k] = 0;
+            } else {
+                bt_upsert(&btree, test_key_id(k), &test_present[k]);
+                bt_upsert(&radix, test_key_id(k), &test_present[k]);
+                test_present[k] = 1;
+            }
+        }
+        if (!test_check_keys(&btree, "radix btree") || !test_check_keys(&radix, "radix") ||
+            !test_compare_engines(&btree, &radix, "radix random")) {
+            printf("radix: step %u\n", step);
+            return bt_false;
+        }
+    }
     bt_destroy(&btree);
+    bt_destroy(&radix);
+
     x_assert(memory_usage == 0);
+    return bt_true;
+}
+#else
+static bt_bool
+test_radix_engine(void)
+{
+    return bt_true;
+}
+#endif
+
+#if defined(BT_AGGREGATES)
+BT_AGGREGATE_MAP_SIG(test_aggregate_map)
+{
+    BT_AggregateValue result;
+    result.u = id;
+    return result;
+}
+
+BT_AGGREGATE_COMBINE_SIG(test_aggregate_combine)
+{
+    BT_AggregateValue result;
+    result.u = a.u + b.u;
+    return result;
+}
+#endif
+
+/* NOTE(nick): Ranks, selects and range sums of every key against the reference set, they
+ * come from the per sub-node summaries that merges have to keep up. */
+static bt_bool
+test_check_summaries(BT_Context *btree, const char *name)
+{
+#if defined(BT_ORDER_STATISTICS)
+    bt_u64 rank = 0;
+#endif
+#if defined(BT_AGGREGATES)
+    BT_AggregateValue sum;
+    bt_u64 expected = 0;
+#endif
+    U32 i;
 
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (!test_present[i]) {
+            continue;
+        }
+#if defined(BT_ORDER_STATISTICS)
+        if (bt_rank(btree, test_key_id(i)) != rank || bt_select(btree, rank, NULL) == NULL ||
+            bt_select(btree, rank, NULL)->id != test_key_id(i)) {
+            printf("%s: wrong rank or select of key %u\n", name, i);
+            return bt_false;
+        }
+        rank += 1;
+#endif
+#if defined(BT_AGGREGATES)
+        expected += test_key_id(i);
+        if (i % 16 == 0 && (bt_aggregate_range(btree, 0, test_key_id(i), &sum) != BT_ERROR_Ok || sum.u != expected)) {
+            printf("%s: wrong aggregate up to key %u\n", name, i);
+            return bt_false;
+        }
+#endif
+    }
+#if defined(BT_ORDER_STATISTICS)
+    if (bt_count_range(btree, 0, BT_INVALID_ID) != rank) {
+        printf("%s: wrong count\n", name);
+        return bt_false;
+    }
+#endif
     return bt_true;
 }
 
+static U32
+test_count_nodes(BT_Context *btree, BT_Node *node)
+{
+    U32 count = 1;
+    U32 i;
+
+    if (!bt_is_node_leaf(node)) {
+        for (i = 0; i <= node->key_count; ++i) {
+            count += test_count_nodes(btree, bt_node_get_sub(btree, node, i));
+        }
+    }
+    return count;
+}
+
+#if defined(BT_REGION_NODES)
+static bt_bool
+test_check_preorder(BT_Context *btree, BT_Node *node, U32 *slot)
+{
+    U32 i;
+
+    if (node != bt_pool_node(&btree->pool, *slot)) {
+        return bt_false;
+    }
+    *slot += 1;
+    if (!bt_is_node_leaf(node)) {
+        for (i = 0; i <= node->key_count; ++i) {
+            if (!test_check_preorder(btree, bt_node_get_sub(btree, node, i), slot)) {
+                return bt_false;
+            }
+        }
+    }
+    return bt_true;
+}
+#endif
+
+static void
+test_churn(BT_Context *btree, U32 count)
+{
+    U32 i;
+
+    for (i = 0; i < count; ++i) {
+        U32 k = test_random() % (TEST_KEY_COUNT + 1);
+
+        if (test_random() % 2 == 0) {
+            bt_delete(btree, test_key_id(k));
+            test_present[k] = 0;
+        } else {
+            bt_upsert(btree, test_key_id(k), NULL);
+            test_present[k] = 1;
+        }
+    }
+}
+
+/* NOTE(nick): Runs a pass in calls of budget units and checks the tree after every call. */
+static bt_bool
+test_compact_pass(BT_Context *btree, const char *name, bt_u64 budget, U32 *calls_out)
+{
+    bt_bool finished = bt_false;
+    U32 calls = 0;
+
+    while (!finished) {
+        if (bt_compact(btree, budget, &finished) != BT_ERROR_Ok || calls > 32 * TEST_KEY_COUNT) {
+            printf("%s: pass doesn't finish\n", name);
+            return bt_false;
+        }
+        calls += 1;
+        if (!test_check_keys(btree, name) || !test_check_summaries(btree, name)) {
+            printf("%s: call %u\n", name, calls);
+            return bt_false;
+        }
+    }
+    *calls_out = calls;
+    return bt_true;
+}
+
+static U32
+test_tree_height(BT_Context *btree)
+{
+    BT_Node *node = btree->root;
+    U32 height = 0;
+
+    while (node != NULL) {
+        height += 1;
+        node = bt_is_node_leaf(node) ? NULL : bt_node_get_sub(btree, node, 0);
+    }
+    return height;
+}
+
+static bt_bool
+test_compact_run(BT_Context *btree)
+{
+    bt_bool finished;
+    U32 i, nodes, step, calls;
+    bt_bool resumable;
+#if defined(BT_REGION_NODES)
+    U32 slot = 0;
+#endif
+
+    /* NOTE(nick): Ids i * 3 + 2 sit between the keys of the reference set, deleting them
+     * leaves sparse leaves all over the tree and free slots all over the pool. */
+    for (i = 0; i < 8 * TEST_KEY_COUNT; ++i) {
+        bt_insert(btree, (BT_KeyID)i * 3 + 2, NULL);
+    }
+    test_fill(btree, bt_true);
+    for (i = 0; i < 8 * TEST_KEY_COUNT; ++i) {
+        bt_delete(btree, (BT_KeyID)i * 3 + 2);
+    }
+    test_churn(btree, TEST_KEY_COUNT);
+    if (!test_check_keys(btree, "compact") || !test_check_summaries(btree, "compact")) {
+        return bt_false;
+    }
+
+    if (bt_compact(btree, 0, &finished) != BT_ERROR_Ok || finished) {
+        printf("compact: empty budget finished a pass\n");
+        return bt_false;
+    }
+    /* NOTE(nick): A step covers one lowest internal node, a tree of three levels or more has
+     * at least two of them and a budget of one has to resume between them. Wide nodes can
+     * leave only two levels and a pass of a single step. */
+    resumable = (test_tree_height(btree) >= 3);
+    nodes = test_count_nodes(btree, btree->root);
+    if (!test_compact_pass(btree, "compact", 1, &calls)) {
+        return bt_false;
+    }
+    if (resumable && calls < 2) {
+        printf("compact: pass didn't resume\n");
+        return bt_false;
+    }
+    /* NOTE(nick): Two leaves of at least one key plus the key between them never fit into
+     * a single leaf of 3 keys. */
+    if (BT_KEY_COUNT > 3 && test_count_nodes(btree, btree->root) >= nodes) {
+        printf("compact: no leaves merged\n");
+        return bt_false;
+    }
+#if defined(BT_REGION_NODES)
+    /* NOTE(nick): Every node moved to the front in pre-order, free slots after them were
+     * trimmed and the slabs left empty released. */
+    nodes = test_count_nodes(btree, btree->root);
+    if (!test_check_preorder(btree, btree->root, &slot) || btree->pool.used_count != nodes ||
+        btree->pool.chunk_count != (nodes + BT_POOL_CHUNK_NODES - 1) / BT_POOL_CHUNK_NODES) {
+        printf("compact: nodes not relocated or slabs not trimmed\n");
+        return bt_false;
+    }
+#endif
+
+    /* NOTE(nick): Writes between the calls change the tree under a pass in progress. */
+    for (step = 0; step < 64; ++step) {
+        if (bt_compact(btree, 3, &finished) != BT_ERROR_Ok) {
+            return bt_false;
+        }
+        test_churn(btree, 8);
+        if (!test_check_keys(btree, "compact churn") || !test_check_summaries(btree, "compact churn")) {
+            printf("compact churn: step %u\n", step);
+            return bt_false;
+        }
+    }
+    return test_compact_pass(btree, "compact after churn", 4, &calls);
+}
+
+static bt_bool
+test_compact(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+#if defined(BT_AGGREGATES)
+    BT_Aggregate aggregate;
+#endif
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+#if defined(BT_AGGREGATES)
+    x_memset(&aggregate, 0, sizeof(aggregate));
+    aggregate.map = test_aggregate_map;
+    aggregate.combine = test_aggregate_combine;
+    bt_set_aggregate(&btree, &aggregate);
+#endif
+    result = test_compact_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Checks a sharded set against the reference: both cursor directions across
+ * shard boundaries, search, and that every shard only holds ids of its own range. */
+static bt_bool
+test_check_sharded(BT_Sharded *sharded, const char *name)
+{
+    BT_ShardedCursor cursor;
+    BT_Key *key;
+    U32 i = 0;
+    U32 last = TEST_KEY_COUNT + 1;
+
+    for (key = bt_sharded_cursor_seek(sharded, 0, &cursor); key != NULL; key = bt_sharded_cursor_next(&cursor)) {
+        while (i <= TEST_KEY_COUNT && !test_present[i]) {
+            i += 1;
+        }
+        if (i > TEST_KEY_COUNT || key->id != test_key_id(i)) {
+            printf("%s: forward iteration has an unexpected key\n", name);
+            return bt_false;
+        }
+        last = i;
+        i += 1;
+    }
+    bt_sharded_cursor_close(&cursor);
+    while (i <= TEST_KEY_COUNT && !test_present[i]) {
+        i += 1;
+    }
+    if (i <= TEST_KEY_COUNT) {
+        printf("%s: forward iteration misses key %u\n", name, i);
+        return bt_false;
+    }
+
+    if (last <= TEST_KEY_COUNT) {
+        i = last + 1;
+        for (key = bt_sharded_cursor_seek(sharded, test_key_id(last), &cursor); key != NULL;
+             key = bt_sharded_cursor_prev(&cursor)) {
+            do {
+                i -= 1;
+            } while (i > 0 && !test_present[i]);
+            if (!test_present[i] || key->id != test_key_id(i)) {
+                printf("%s: backward iteration has an unexpected key\n", name);
+                return bt_false;
+            }
+        }
+        bt_sharded_cursor_close(&cursor);
+        while (i > 0) {
+            i -= 1;
+            if (test_present[i]) {
+                printf("%s: backward iteration misses key %u\n", name, i);
+                return bt_false;
+            }
+        }
+    }
+
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (bt_sharded_search(sharded, test_key_id(i), NULL) != (test_present[i] != 0)) {
+            printf("%s: search disagrees on key %u\n", name, i);
+            return bt_false;
+        }
+    }
+
+    for (i = 0; i < sharded->shard_count; ++i) {
+        BT_Key *key_min = bt_min(&sharded->shards[i].tree);
+        BT_Key *key_max = bt_max(&sharded->shards[i].tree);
+
+        if ((key_min != NULL && key_min->id < sharded->shards[i].id_min) ||
+            (key_max != NULL && i + 1 < sharded->shard_count && key_max->id >= sharded->shards[i + 1].id_min)) {
+            printf("%s: shard %u holds a key outside of its range\n", name, i);
+            return bt_false;
+        }
+    }
+
+    return bt_true;
+}
+
+static bt_bool
+test_sharded(void)
+{
+    BT_Allocator allocators[4];
+    S32 usage[x_countof(allocators)];
+    BT_Sharded sharded;
+    BT_KeyID boundary;
+    U32 i, step;
+
+    /* NOTE(nick): Every shard gets its own allocator context, so moving keys between shards
+     * can't hand nodes over and has to copy them. */
+    for (i = 0; i < x_countof(allocators); ++i) {
+        test_init_allocator(&allocators[i]);
+        usage[i] = 0;
+        allocators[i].alloc_memory_context = &usage[i];
+        allocators[i].free_memory_context = &usage[i];
+    }
+
+    if (bt_sharded_create(&sharded, x_countof(allocators), 0, allocators, NULL, NULL, NULL) != BT_ERROR_Ok) {
+        printf("sharded: create failed\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Shards start out splitting the whole id space evenly, so the small ids all
+     * land in shard 0 and the top key in the last one, with empty shards in between. */
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        test_present[i] = 1;
+        bt_sharded_insert(&sharded, test_key_id(i), NULL);
+    }
+    if (!test_check_sharded(&sharded, "sharded")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Only shard 0 has seen any load, so rebalancing hands its upper half over. */
+    boundary = sharded.shards[1].id_min;
+    if (bt_sharded_rebalance(&sharded) != BT_ERROR_Ok || sharded.shards[1].id_min >= boundary ||
+        bt_min(&sharded.shards[1].tree) == NULL) {
+        printf("sharded: rebalance did not move the boundary\n");
+        return bt_false;
+    }
+    if (!test_check_sharded(&sharded, "sharded") || usage[1] <= 0) {
+        printf("sharded: after first rebalance\n");
+        return bt_false;
+    }
+
+    for (step = 0; step < 40; ++step) {
+        for (i = 0; i < 30; ++i) {
+            U32 k = test_random() % TEST_KEY_COUNT;
+
+            if (test_present[k]) {
+                bt_sharded_delete(&sharded, test_key_id(k));
+            } else {
+                bt_sharded_insert(&sharded, test_key_id(k), NULL);
+            }
+            test_present[k] = !test_present[k];
+        }
+        /* NOTE(nick): Skew the load towards the low or the high end so boundaries move both ways. */
+        for (i = 0; i < 50; ++i) {
+            U32 k = test_random() % (TEST_KEY_COUNT / 4) + ((step / 5) % 2 ? TEST_KEY_COUNT * 3 / 4 : 0);
+            bt_sharded_search(&sharded, test_key_id(k), NULL);
+        }
+        if (bt_sharded_rebalance(&sharded) != BT_ERROR_Ok) {
+            printf("sharded: rebalance failed\n");
+            return bt_false;
+        }
+        if (!test_check_sharded(&sharded, "sharded")) {
+            printf("sharded: step %u\n", step);
+            return bt_false;
+        }
+    }
+
+    bt_sharded_destroy(&sharded);
+    for (i = 0; i < x_countof(allocators); ++i) {
+        x_assert(usage[i] == 0);
+    }
+    x_assert(memory_usage == 0);
+    return bt_true;
+}
+
+bt_bool
+test_id(U32 test_id)
+{
+    U32 i;
+
+    BT_Allocator allocator;
+    BT_Context btree;
+
+    x_memset(&allocator, 0, sizeof(allocator));
+    allocator.alloc_memory_context = NULL;
+    allocator.alloc_memory = test_malloc;
+
+    allocator.free_memory_context = NULL;
+    allocator.free_memory = test_free;
+
+    allocator.realloc_memory_context = NULL;
+    allocator.realloc_memory = test_realloc;
+
+    bt_create(&btree, sizeof(ids[0]), &allocator);
+
+    for (i = 0; i < x_countof(ids); ++i) {
+        U32 k;
+
+        printf("Inserting %d...", ids[i]);
+        bt_insert(&btree, ids[i], &ids[i]);
+
+#if 1
+        for (k = 0; k < i; ++k) {
+            if (bt_search(&btree, ids[k], bt_false) != NULL) {
+            } else {
+                printf("error, insert broke node search. Cannot find %d\n", ids[k]);
+                return bt_false;
+            }
+        }
+
+        if (k == i) {
+            printf("OK.\n");
+        }
+#endif
+    }
+
+    printf("---------------------------\n");
+    printf("Deleting %d\n", test_id);
+
+    bt_delete(&btree, test_id);
+    for (i = 0; i < x_countof(ids); ++i) {
+        if (bt_search(&btree, ids[i], bt_false)) {
+            if (ids[i] == test_id) {
+                printf("Error: Deleted from %d, but search still found it.\n", ids[i]);
+                return bt_false;
+            } else {
+                printf("Found %d\n", ids[i]);
+            }
+        } else {
+            if (ids[i] != test_id) {
+                printf("Could not find %d, delete has corrupted tree structure.\n", ids[i]);
+                return bt_false;
+            }
+        }
+    }
+
+    bt_visit_keys(&btree, BT_VISIT_NODE_TopDown, NULL, test_visit_keys);
+
+    bt_destroy(&btree);
+    x_assert(memory_usage == 0);
+
+    return bt_true;
+}
+
+typedef struct TestUpdate {
+    U32 calls;
+    bt_bool found;
+    const void *data;
+    const void *result;
+} TestUpdate;
+
+BT_UPDATE_SIG(test_update)
+{
+    TestUpdate *state = (TestUpdate *)user_context;
+    state->calls += 1;
+    state->found = found;
+    state->data = data;
+    return state->result;
+}
+
+/* NOTE(nick): Data of key i is &test_present[i] after an insert and &test_present[i] + 1
+ * after an update, so stale or swapped data shows up. */
+static bt_bool
+test_insert_or_get_run(BT_Context *btree)
+{
+    BT_Key *key;
+    bt_bool inserted;
+    TestUpdate state;
+    U32 i, k;
+
+    x_memset(test_present, 0, sizeof(test_present));
+
+    for (i = 0; i < TEST_KEY_COUNT; ++i) {
+        k = i * 97 % TEST_KEY_COUNT;
+        key = NULL;
+        inserted = bt_false;
+        if (bt_insert_or_get(btree, test_key_id(k), &test_present[k], &key, &inserted) != BT_ERROR_Ok ||
+            !inserted || key == NULL || key->id != test_key_id(k) || key->data != &test_present[k] ||
+            key != bt_search(btree, test_key_id(k), bt_false)) {
+            printf("insert_or_get: wrong insert of key %u\n", k);
+            return bt_false;
+        }
+        test_present[k] = 1;
+
+        /* NOTE(nick): Second call finds the key and leaves its data alone. */
+        if (bt_insert_or_get(btree, test_key_id(k), NULL, &key, &inserted) != BT_ERROR_Ok ||
+            inserted || key == NULL || key->id != test_key_id(k) || key->data != &test_present[k]) {
+            printf("insert_or_get: wrong get of key %u\n", k);
+            return bt_false;
+        }
+    }
+    if (!test_check_keys(btree, "insert_or_get")) {
+        return bt_false;
+    }
+
+    if (bt_update(btree, test_key_id(TEST_KEY_COUNT), NULL, NULL) != BT_ERROR_OpDenied ||
+        bt_search(btree, test_key_id(TEST_KEY_COUNT), bt_false) != NULL) {
+        printf("update: no callback wasn't denied\n");
+        return bt_false;
+    }
+
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        x_memset(&state, 0, sizeof(state));
+        state.result = &test_present[i] + 1;
+        if (bt_update(btree, test_key_id(i), &state, test_update) != BT_ERROR_Ok || state.calls != 1) {
+            printf("update: callback of key %u not called once\n", i);
+            return bt_false;
+        }
+        if (i < TEST_KEY_COUNT ? (!state.found || state.data != &test_present[i]) : (state.found || state.data != NULL)) {
+            printf("update: callback of key %u got wrong found or data\n", i);
+            return bt_false;
+        }
+        key = bt_search(btree, test_key_id(i), bt_false);
+        if (key == NULL || key->data != &test_present[i] + 1) {
+            printf("update: data of key %u not stored\n", i);
+            return bt_false;
+        }
+    }
+    test_present[TEST_KEY_COUNT] = 1;
+    if (!test_check_keys(btree, "update")) {
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_insert_or_get(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    result = test_insert_or_get_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Index of the first present key at or after i, TEST_KEY_COUNT + 1 if none. */
+static U32
+test_next_present(S32 i)
+{
+    if (i < 0) {
+        i = 0;
+    }
+    while (i <= TEST_KEY_COUNT && !test_present[i]) {
+        i += 1;
+    }
+    return (U32)i;
+}
+
+/* NOTE(nick): Index of the last present key at or before i, TEST_KEY_COUNT + 1 if none. */
+static U32
+test_prev_present(S32 i)
+{
+    if (i > TEST_KEY_COUNT) {
+        i = TEST_KEY_COUNT;
+    }
+    while (i >= 0 && !test_present[i]) {
+        i -= 1;
+    }
+    return (i < 0) ? TEST_KEY_COUNT + 1 : (U32)i;
+}
+
+static bt_bool
+test_is_key(BT_Key *key, U32 i)
+{
+    return (i > TEST_KEY_COUNT) ? (key == NULL) : (key != NULL && key->id == test_key_id(i));
+}
+
+/* NOTE(nick): Seeks from the key itself and from the gaps right below and above it, the
+ * gap below key 0 is id 0 and the one above the top key is BT_INVALID_ID. One step each
+ * way from the cursor of every seek. */
+static bt_bool
+test_check_seeks(BT_Context *btree, const char *name)
+{
+    BT_Cursor cursor;
+    BT_Key *key;
+    S32 i, delta;
+
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        for (delta = -1; delta <= 1; ++delta) {
+            BT_KeyID id = test_key_id(i) + delta;
+            U32 ge = test_next_present(delta <= 0 ? i : i + 1);
+            U32 gt = test_next_present(delta < 0 ? i : i + 1);
+            U32 le = test_prev_present(delta >= 0 ? i : i - 1);
+
+            if (!test_is_key(bt_ceiling(btree, id, NULL), ge) || !test_is_key(bt_upper_bound(btree, id, NULL), gt)) {
+                printf("%s: wrong ceiling or upper bound of key %d%+d\n", name, i, delta);
+                return bt_false;
+            }
+            key = bt_lower_bound(btree, id, &cursor);
+            if (!test_is_key(key, ge) || (key != NULL && !test_is_key(bt_cursor_next(&cursor), test_next_present(ge + 1)))) {
+                printf("%s: wrong lower bound of key %d%+d\n", name, i, delta);
+                return bt_false;
+            }
+            key = bt_floor(btree, id, &cursor);
+            if (!test_is_key(key, le) || (key != NULL && !test_is_key(bt_cursor_prev(&cursor), test_prev_present((S32)le - 1)))) {
+                printf("%s: wrong floor of key %d%+d\n", name, i, delta);
+                return bt_false;
+            }
+        }
+    }
+
+    /* NOTE(nick): Whole tree backward. */
+    i = (S32)test_prev_present(TEST_KEY_COUNT);
+    for (key = bt_cursor_last(btree, &cursor); key != NULL; key = bt_cursor_prev(&cursor)) {
+        if (!test_is_key(key, (U32)i)) {
+            printf("%s: backward iteration has an unexpected key\n", name);
+            return bt_false;
+        }
+        i = (S32)test_prev_present(i - 1);
+    }
+    if (i <= TEST_KEY_COUNT) {
+        printf("%s: backward iteration misses key %d\n", name, i);
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_seeks_run(BT_Context *btree)
+{
+    U32 i;
+
+    x_memset(test_present, 0, sizeof(test_present));
+    if (!test_check_seeks(btree, "seeks empty")) {
+        return bt_false;
+    }
+
+    test_fill(btree, bt_true);
+    if (!test_check_seeks(btree, "seeks full")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Holes everywhere, including the first and the top key. */
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (i == 0 || i == TEST_KEY_COUNT || test_random() % 3 == 0) {
+            bt_delete(btree, test_key_id(i));
+            test_present[i] = 0;
+        }
+    }
+    if (!test_check_keys(btree, "seeks sparse") || !test_check_seeks(btree, "seeks sparse")) {
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_seeks(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    result = test_seeks_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Misses are looked up in the gaps between keys of the reference set, each one
+ * is either filtered or counted as a false positive. */
+static bt_bool
+test_check_bloom(BT_Context *btree, const char *name)
+{
+    BT_BloomStats before, after;
+    U32 i;
+
+    bt_bloom_get_stats(btree, &before);
+    for (i = 0; i < TEST_KEY_COUNT; ++i) {
+        if (bt_search(btree, test_key_id(i) + 1, bt_false) != NULL) {
+            printf("%s: found a key that was never inserted\n", name);
+            return bt_false;
+        }
+    }
+    bt_bloom_get_stats(btree, &after);
+    if (after.lookups - before.lookups != TEST_KEY_COUNT ||
+        (after.filtered - before.filtered) + (after.false_positives - before.false_positives) != TEST_KEY_COUNT ||
+        (after.false_positives - before.false_positives) * 4 > TEST_KEY_COUNT) {
+        printf("%s: filter let too many misses through\n", name);
+        return bt_false;
+    }
+    /* NOTE(nick): Catches false negatives. */
+    return test_check_keys(btree, name);
+}
+
+static bt_bool
+test_bloom_run(BT_Context *btree)
+{
+    BT_BloomStats stats;
+    bt_u64 block_count, rebuilds;
+    U32 i, count;
+
+    if (bt_bloom_rebuild(btree) != BT_ERROR_OpDenied) {
+        printf("bloom: rebuild of a disabled filter wasn't denied\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Room for 16 keys, inserting all of them saturates and grows the filter. */
+    bt_bloom_enable(btree, 16);
+    block_count = btree->bloom.block_count;
+    bt_bloom_get_stats(btree, &stats);
+    rebuilds = stats.rebuilds;
+    test_fill(btree, bt_true);
+    bt_bloom_get_stats(btree, &stats);
+    if (btree->bloom.block_count <= block_count || stats.rebuilds <= rebuilds ||
+        btree->bloom.key_count != TEST_KEY_COUNT + 1) {
+        printf("bloom: saturated filter didn't grow\n");
+        return bt_false;
+    }
+    if (!test_check_bloom(btree, "bloom full")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Deletes one by one and by range, the filter gets rebuilt once a quarter
+     * of its keys are gone and only counts the keys left. */
+    rebuilds = stats.rebuilds;
+    for (i = 0; i < TEST_KEY_COUNT; i += 2) {
+        bt_delete(btree, test_key_id(i));
+        test_present[i] = 0;
+    }
+    bt_delete_range(btree, test_key_id(TEST_KEY_COUNT / 2), test_key_id(TEST_KEY_COUNT - 1));
+    test_forget_range(test_key_id(TEST_KEY_COUNT / 2), test_key_id(TEST_KEY_COUNT - 1));
+    bt_bloom_get_stats(btree, &stats);
+    for (i = 0, count = 0; i <= TEST_KEY_COUNT; ++i) {
+        count += test_present[i];
+    }
+    if (stats.rebuilds <= rebuilds || btree->bloom.key_count != count) {
+        printf("bloom: deletes didn't rebuild the filter\n");
+        return bt_false;
+    }
+    if (!test_check_bloom(btree, "bloom deleted")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Deleted keys come back. */
+    for (i = 0; i < TEST_KEY_COUNT; i += 4) {
+        bt_insert(btree, test_key_id(i), NULL);
+        test_present[i] = 1;
+    }
+    if (bt_bloom_rebuild(btree) != BT_ERROR_Ok || !test_check_bloom(btree, "bloom rebuilt")) {
+        return bt_false;
+    }
+
+    bt_bloom_disable(btree);
+    return btree->bloom.blocks == NULL && test_check_keys(btree, "bloom disabled");
+}
+
+static bt_bool
+test_bloom(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    result = test_bloom_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Same writes go to a buffered and to a plain tree. bt_search of the buffered
+ * one reads through pending messages, so both have to agree after every write, and once
+ * more after iteration applied the buffer. */
+static bt_bool
+test_compare_buffered(BT_Context *buffered, BT_Context *direct, const char *name)
+{
+    BT_Cursor cursor_buffered, cursor_direct;
+    BT_Key *key_buffered, *key_direct;
+    U32 i;
+
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (!test_same_key(bt_search(buffered, test_key_id(i), bt_false), bt_search(direct, test_key_id(i), bt_false))) {
+            printf("%s: buffered search disagrees on key %u\n", name, i);
+            return bt_false;
+        }
+    }
+    key_buffered = bt_cursor_first(buffered, &cursor_buffered);
+    key_direct = bt_cursor_first(direct, &cursor_direct);
+    while (key_buffered != NULL || key_direct != NULL) {
+        if (!test_same_key(key_buffered, key_direct)) {
+            printf("%s: flushed tree disagrees\n", name);
+            return bt_false;
+        }
+        key_buffered = bt_cursor_next(&cursor_buffered);
+        key_direct = bt_cursor_next(&cursor_direct);
+    }
+    if (buffered->write_buffer.count != 0) {
+        printf("%s: iteration left messages in the buffer\n", name);
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_write_buffer_run(BT_Context *buffered, BT_Context *direct)
+{
+    static U8 data[4];
+    BT_KeyID id = test_key_id(7);
+    BT_Key *key;
+    U32 i, step;
+
+    if (bt_write_buffer_enable(buffered, 0) != BT_ERROR_OpDenied || bt_write_buffer_enable(buffered, 16) != BT_ERROR_Ok) {
+        printf("write_buffer: wrong enable\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Messages of one key fold into one. Insert after delete turns into an
+     * upsert, insert over a pending upsert keeps its data. */
+    bt_insert(buffered, id, &data[0]);
+    bt_upsert(buffered, id, &data[1]);
+    bt_insert(buffered, id, &data[2]);
+    key = bt_search(buffered, id, bt_false);
+    if (buffered->write_buffer.count != 1 || key == NULL || key->data != &data[1]) {
+        printf("write_buffer: insert over a pending upsert\n");
+        return bt_false;
+    }
+    bt_delete(buffered, id);
+    if (buffered->write_buffer.count != 1 || bt_search(buffered, id, bt_false) != NULL) {
+        printf("write_buffer: pending delete\n");
+        return bt_false;
+    }
+    bt_insert(buffered, id, &data[3]);
+    key = bt_search(buffered, id, bt_false);
+    if (buffered->write_buffer.count != 1 || key == NULL || key->data != &data[3]) {
+        printf("write_buffer: insert over a pending delete\n");
+        return bt_false;
+    }
+    bt_insert(direct, id, &data[3]);
+    if (!test_compare_buffered(buffered, direct, "write_buffer folded")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Pending insert doesn't replace a key that's already in the tree. */
+    bt_insert(buffered, id, &data[0]);
+    key = bt_search(buffered, id, bt_false);
+    if (buffered->write_buffer.count != 1 || key == NULL || key->data != &data[3]) {
+        printf("write_buffer: pending insert replaced a key in the tree\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Few distinct keys, so the same key gets written many times per buffer
+     * and buffers fill up and flush on their own. */
+    for (step = 0; step < 64; ++step) {
+        for (i = 0; i < 48; ++i) {
+            U32 k = test_random() % 64;
+            const void *value = &test_present[k] + test_random() % 2;
+
+            switch (test_random() % 3) {
+            case 0:
+                bt_insert(buffered, test_key_id(k), value);
+                bt_insert(direct, test_key_id(k), value);
+                break;
+            case 1:
+                bt_upsert(buffered, test_key_id(k), value);
+                bt_upsert(direct, test_key_id(k), value);
+                break;
+            default:
+                bt_delete(buffered, test_key_id(k));
+                bt_delete(direct, test_key_id(k));
+                break;
+            }
+            if (!test_same_key(bt_search(buffered, test_key_id(k), bt_false), bt_search(direct, test_key_id(k), bt_false))) {
+                printf("write_buffer: pending write of key %u disagrees\n", k);
+                return bt_false;
+            }
+        }
+        if (step % 8 == 7 && !test_compare_buffered(buffered, direct, "write_buffer")) {
+            printf("write_buffer: step %u\n", step);
+            return bt_false;
+        }
+    }
+
+    /* NOTE(nick): Disable applies what's still pending. */
+    bt_upsert(buffered, id, &data[2]);
+    bt_upsert(direct, id, &data[2]);
+    if (bt_write_buffer_disable(buffered) != BT_ERROR_Ok || buffered->write_buffer.messages != NULL) {
+        printf("write_buffer: wrong disable\n");
+        return bt_false;
+    }
+    return test_compare_buffered(buffered, direct, "write_buffer disabled");
+}
+
+static bt_bool
+test_write_buffer(void)
+{
+    BT_Allocator allocator;
+    BT_Context buffered, direct;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&buffered, 0, &allocator);
+    bt_create(&direct, 0, &allocator);
+    result = test_write_buffer_run(&buffered, &direct);
+    bt_destroy(&buffered);
+    bt_destroy(&direct);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+typedef struct TestFrozenVisit {
+    BT_Cursor cursor;
+    BT_Key *key;
+    U32 count;
+    U32 limit;
+    bt_bool ok;
+} TestFrozenVisit;
+
+/* NOTE(nick): Walks a cursor of the live tree along with the frozen range. */
+BT_VISIT_KEYS_SIG(test_frozen_visit)
+{
+    TestFrozenVisit *visit = (TestFrozenVisit *)user_context;
+
+    if (visit->key == NULL || visit->key->id != id || visit->key->data != data) {
+        visit->ok = bt_false;
+        return bt_false;
+    }
+    visit->key = bt_cursor_next(&visit->cursor);
+    visit->count += 1;
+    return visit->count < visit->limit;
+}
+
+static bt_bool
+test_check_frozen_position(BT_Frozen *frozen, bt_u64 position, BT_Key *key)
+{
+    if (key == NULL) {
+        return position == frozen->key_count;
+    }
+    return position < frozen->key_count && bt_frozen_get_id(frozen, position) == key->id &&
+           bt_frozen_get_data(frozen, position) == key->data;
+}
+
+static bt_bool
+test_check_frozen_probe(BT_Context *btree, BT_Frozen *frozen, BT_KeyID id, const char *name)
+{
+    BT_Cursor cursor;
+    BT_Key *key;
+    TestFrozenVisit visit;
+    BT_KeyID id_max = (id < BT_INVALID_ID - 64) ? id + 64 : BT_INVALID_ID;
+    const void *data = NULL;
+    bt_bool found;
+
+    if (!test_check_frozen_position(frozen, bt_frozen_lower_bound(frozen, id), bt_lower_bound(btree, id, &cursor)) ||
+        !test_check_frozen_position(frozen, bt_frozen_upper_bound(frozen, id), bt_upper_bound(btree, id, &cursor))) {
+        printf("%s: wrong bound of id %u\n", name, (U32)id);
+        return bt_false;
+    }
+    key = bt_search(btree, id, bt_false);
+    found = bt_frozen_search(frozen, id, &data);
+    if (found != (key != NULL) || (key != NULL && data != key->data)) {
+        printf("%s: wrong search of id %u\n", name, (U32)id);
+        return bt_false;
+    }
+
+    /* NOTE(nick): Ranges from id up to a few keys past it, the visitor stops early on
+     * every other one. */
+    x_memset(&visit, 0, sizeof(visit));
+    visit.key = bt_lower_bound(btree, id, &visit.cursor);
+    visit.limit = (id % 2) ? 3 : 0xFFFFFFFF;
+    visit.ok = bt_true;
+    bt_frozen_visit_range(frozen, id, id_max, &visit, test_frozen_visit);
+    if (!visit.ok || (visit.count < visit.limit && visit.key != NULL && visit.key->id <= id_max)) {
+        printf("%s: wrong visit from id %u\n", name, (U32)id);
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_check_frozen(BT_Context *btree, BT_Frozen *frozen, const char *name)
+{
+    BT_Cursor cursor;
+    BT_Key *key;
+    bt_u64 position, stride;
+
+    if (!test_check_frozen_probe(btree, frozen, 0, name) ||
+        !test_check_frozen_probe(btree, frozen, BT_INVALID_ID, name) ||
+        bt_frozen_upper_bound(frozen, BT_INVALID_ID) != frozen->key_count) {
+        return bt_false;
+    }
+    for (key = bt_cursor_first(btree, &cursor), position = 0; key != NULL; key = bt_cursor_next(&cursor), ++position) {
+        if (!test_check_frozen_position(frozen, position, key) ||
+            !test_check_frozen_probe(btree, frozen, key->id - 1, name) ||
+            !test_check_frozen_probe(btree, frozen, key->id, name) ||
+            !test_check_frozen_probe(btree, frozen, key->id + 1, name)) {
+            printf("%s: key %u\n", name, (U32)position);
+            return bt_false;
+        }
+    }
+    if (position != frozen->key_count) {
+        printf("%s: wrong key count\n", name);
+        return bt_false;
+    }
+
+    /* NOTE(nick): Unused slots of the last block. */
+    if (frozen->leaves != NULL) {
+        U8 *offsets = frozen->leaves + (position / BT_FROZEN_BLOCK) * bt_frozen_leaf_stride(frozen) + sizeof(BT_KeyID);
+
+        for (stride = (position % BT_FROZEN_BLOCK) * frozen->delta_size; position % BT_FROZEN_BLOCK != 0 &&
+             stride < BT_FROZEN_BLOCK * frozen->delta_size; ++stride) {
+            if (offsets[stride] != 0xFF) {
+                printf("%s: last block isn't padded\n", name);
+                return bt_false;
+            }
+        }
+    } else {
+        for (; position % BT_FROZEN_BLOCK != 0; ++position) {
+            if (frozen->ids[position] != BT_INVALID_ID) {
+                printf("%s: last block isn't padded\n", name);
+                return bt_false;
+            }
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_freeze_run(BT_Context *btree)
+{
+    /* NOTE(nick): Gaps between ids pick the offset size of packed blocks. A block spans
+     * 7 gaps, so 36 and 37 sit on both sides of the one byte limit. The last one spans
+     * more than 32 bits and isn't packed. */
+    static const BT_KeyID steps[] = { 3, 36, 37, 1000, 100000, (BT_KeyID)1 << 30 };
+    static const U32 delta_sizes[] = { 1, 1, 2, 2, 4, 0 };
+    static const U32 counts[] = { 0, 1, 64, 203 };
+    BT_Frozen frozen;
+    U32 s, c, i;
+
+    for (s = 0; s < x_countof(steps); ++s) {
+        for (c = 0; c < x_countof(counts); ++c) {
+            bt_clear(btree);
+            for (i = 0; i < counts[c]; ++i) {
+                bt_insert(btree, 5 + steps[s] * i, &test_present[i % TEST_KEY_COUNT]);
+            }
+
+            if (bt_freeze(btree, &frozen) != BT_ERROR_Ok || frozen.leaves != NULL || frozen.key_count != counts[c]) {
+                printf("freeze: wrong layout, step %u count %u\n", s, counts[c]);
+                return bt_false;
+            }
+            if (!test_check_frozen(btree, &frozen, "freeze")) {
+                printf("freeze: step %u count %u\n", s, counts[c]);
+                bt_frozen_destroy(&frozen);
+                return bt_false;
+            }
+            bt_frozen_destroy(&frozen);
+
+            if (bt_freeze_packed(btree, &frozen) != BT_ERROR_Ok || frozen.key_count != counts[c] ||
+                (counts[c] > 1 && frozen.delta_size != delta_sizes[s])) {
+                printf("freeze_packed: wrong layout, step %u count %u\n", s, counts[c]);
+                bt_frozen_destroy(&frozen);
+                return bt_false;
+            }
+            if (!test_check_frozen(btree, &frozen, "freeze_packed")) {
+                printf("freeze_packed: step %u count %u\n", s, counts[c]);
+                bt_frozen_destroy(&frozen);
+                return bt_false;
+            }
+            bt_frozen_destroy(&frozen);
+        }
+    }
+
+    /* NOTE(nick): Largest valid id is the last key. */
+    bt_insert(btree, BT_INVALID_ID - 1, NULL);
+    if (bt_freeze(btree, &frozen) != BT_ERROR_Ok) {
+        return bt_false;
+    }
+    if (!test_check_frozen(btree, &frozen, "freeze top") ||
+        bt_frozen_lower_bound(&frozen, BT_INVALID_ID - 1) != frozen.key_count - 1 ||
+        bt_frozen_upper_bound(&frozen, BT_INVALID_ID - 1) != frozen.key_count) {
+        printf("freeze: wrong bounds of the largest id\n");
+        bt_frozen_destroy(&frozen);
+        return bt_false;
+    }
+    bt_frozen_destroy(&frozen);
+    return bt_true;
+}
+
+static bt_bool
+test_freeze(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    result = test_freeze_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Checks left holds the reference keys below id and right the ones from id
+ * on, test_present is left as it was. */
+static bt_bool
+test_check_split(BT_Context *left, BT_Context *right, BT_KeyID id, const char *name)
+{
+    static U8 saved[TEST_KEY_COUNT + 1];
+    bt_bool result;
+
+    x_memcpy(saved, test_present, sizeof(saved));
+    test_forget_range(id, BT_INVALID_ID);
+    result = test_check_keys(left, name);
+    x_memcpy(test_present, saved, sizeof(saved));
+    if (result && id > 0) {
+        test_forget_range(0, id - 1);
+        result = test_check_keys(right, name);
+        x_memcpy(test_present, saved, sizeof(saved));
+    }
+    return result;
+}
+
+static bt_bool
+test_split_join_run(BT_Context *left, BT_Context *right)
+{
+    BT_KeyID split_ids[6];
+    BT_Key *key;
+    U32 i;
+
+    split_ids[0] = 0;
+    split_ids[1] = test_key_id(0);
+    split_ids[2] = test_key_id(100) + 1;
+    split_ids[3] = test_key_id(TEST_KEY_COUNT / 2);
+    split_ids[4] = test_key_id(TEST_KEY_COUNT);
+    split_ids[5] = BT_INVALID_ID;
+
+    bt_set_node_search(left, BT_NODE_SEARCH_Interpolation);
+    bt_bloom_enable(left, TEST_KEY_COUNT);
+    bt_key_cache_enable(left, 64);
+    bt_write_buffer_enable(left, 16);
+    test_fill(left, bt_true);
+
+    for (i = 0; i < x_countof(split_ids); ++i) {
+        bt_destroy(right);
+        /* NOTE(nick): Pending writes of left are applied before the split. */
+        bt_delete(left, test_key_id(1));
+        bt_insert(left, test_key_id(1), NULL);
+        if (bt_split_at(left, split_ids[i], right) != BT_ERROR_Ok) {
+            printf("split_join: split %u failed\n", i);
+            return bt_false;
+        }
+        if (right->node_search.mode != BT_NODE_SEARCH_Interpolation || right->bloom.blocks == NULL ||
+            right->key_cache.entries == NULL || right->write_buffer.messages == NULL) {
+            printf("split_join: right doesn't have the settings of left\n");
+            return bt_false;
+        }
+        if (!test_check_split(left, right, split_ids[i], "split_join split")) {
+            printf("split_join: split %u\n", i);
+            return bt_false;
+        }
+
+        /* NOTE(nick): Joins that would break key order are denied and change nothing. */
+        key = bt_min(right);
+        if (key != NULL && bt_min(left) != NULL && bt_join(right, left) != BT_ERROR_OpDenied) {
+            printf("split_join: join in the wrong order wasn't denied\n");
+            return bt_false;
+        }
+        if (key != NULL) {
+            BT_KeyID id = key->id;
+
+            bt_insert(left, id, NULL);
+            if (bt_join(left, right) != BT_ERROR_OpDenied) {
+                printf("split_join: join of overlapping trees wasn't denied\n");
+                return bt_false;
+            }
+            bt_delete(left, id);
+        }
+        if (!test_check_split(left, right, split_ids[i], "split_join denied")) {
+            return bt_false;
+        }
+
+        if (bt_join(left, right) != BT_ERROR_Ok || bt_min(right) != NULL || !test_check_keys(left, "split_join joined")) {
+            printf("split_join: join %u\n", i);
+            return bt_false;
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_split_join(void)
+{
+    BT_Allocator allocator;
+    BT_Context left, right;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&left, 0, &allocator);
+    bt_create(&right, 0, &allocator);
+    result = test_split_join_run(&left, &right);
+    bt_destroy(&left);
+    bt_destroy(&right);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Key i of the reference set is in tree a when test_set_a[i] is set, its data
+ * is &test_set_a[i]. Same for b. */
+static U8 test_set_a[TEST_KEY_COUNT];
+static U8 test_set_b[TEST_KEY_COUNT];
+
+typedef enum TestSetOp {
+    TEST_SET_Intersect,
+    TEST_SET_Union,
+    TEST_SET_Difference,
+    TEST_SET_Count
+} TestSetOp;
+
+typedef struct TestSetVisit {
+    TestSetOp op;
+    U32 next;
+    U32 count;
+    U32 limit;
+    bt_bool ok;
+} TestSetVisit;
+
+static bt_bool
+test_set_expects(TestSetOp op, U32 i)
+{
+    switch (op) {
+    case TEST_SET_Intersect: return test_set_a[i] && test_set_b[i];
+    case TEST_SET_Union:     return test_set_a[i] || test_set_b[i];
+    default:                 return test_set_a[i] && !test_set_b[i];
+    }
+}
+
+BT_VISIT_KEYS_SIG(test_set_visit)
+{
+    TestSetVisit *visit = (TestSetVisit *)user_context;
+
+    while (visit->next < TEST_KEY_COUNT && !test_set_expects(visit->op, visit->next)) {
+        visit->next += 1;
+    }
+    if (visit->next == TEST_KEY_COUNT || id != test_key_id(visit->next) ||
+        data != (test_set_a[visit->next] ? &test_set_a[visit->next] : &test_set_b[visit->next])) {
+        visit->ok = bt_false;
+        return bt_false;
+    }
+    visit->next += 1;
+    visit->count += 1;
+    return visit->count < visit->limit;
+}
+
+static bt_bool
+test_check_set_ops(BT_Context *a, BT_Context *b, const char *name)
+{
+    static const U32 limits[] = { 0xFFFFFFFF, 1, 5 };
+    TestSetVisit visit;
+    BT_ErrorCode error_code;
+    TestSetOp op;
+    U32 l;
+
+    for (op = TEST_SET_Intersect; op < TEST_SET_Count; ++op) {
+        for (l = 0; l < x_countof(limits); ++l) {
+            x_memset(&visit, 0, sizeof(visit));
+            visit.op = op;
+            visit.limit = limits[l];
+            visit.ok = bt_true;
+            switch (op) {
+            case TEST_SET_Intersect: error_code = bt_intersect(a, b, &visit, test_set_visit); break;
+            case TEST_SET_Union:     error_code = bt_union(a, b, &visit, test_set_visit); break;
+            default:                 error_code = bt_difference(a, b, &visit, test_set_visit); break;
+            }
+            if (error_code != BT_ERROR_Ok || !visit.ok) {
+                printf("%s: operation %u visited a wrong key\n", name, (U32)op);
+                return bt_false;
+            }
+            /* NOTE(nick): Visitor that didn't stop has to see every key of the result. */
+            if (visit.count < visit.limit) {
+                while (visit.next < TEST_KEY_COUNT && !test_set_expects(op, visit.next)) {
+                    visit.next += 1;
+                }
+                if (visit.next != TEST_KEY_COUNT) {
+                    printf("%s: operation %u missed key %u\n", name, (U32)op, visit.next);
+                    return bt_false;
+                }
+            }
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_set_ops_run(BT_Context *a, BT_Context *b)
+{
+    static const char *names[] = {
+        "set_ops overlapping", "set_ops disjoint", "set_ops runs", "set_ops a empty", "set_ops b empty", "set_ops both empty"
+    };
+    U32 pattern, i;
+
+    if (bt_intersect(a, b, NULL, NULL) != BT_ERROR_OpDenied || bt_union(a, b, NULL, NULL) != BT_ERROR_OpDenied ||
+        bt_difference(a, b, NULL, NULL) != BT_ERROR_OpDenied) {
+        printf("set_ops: missing visit wasn't denied\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Long runs that are only in one tree get galloped over. */
+    for (pattern = 0; pattern < x_countof(names); ++pattern) {
+        bt_clear(a);
+        bt_clear(b);
+        for (i = 0; i < TEST_KEY_COUNT; ++i) {
+            switch (pattern) {
+            case 0:
+                test_set_a[i] = (test_random() % 2 == 0);
+                test_set_b[i] = (test_random() % 3 == 0);
+                break;
+            case 1:
+                test_set_a[i] = (i % 2 == 0);
+                test_set_b[i] = (i % 2 == 1);
+                break;
+            case 2:
+                test_set_a[i] = (i < 100 || i > 400 || i % 64 == 0);
+                test_set_b[i] = (i >= 50 && i <= 450);
+                break;
+            case 3:
+                test_set_a[i] = 0;
+                test_set_b[i] = 1;
+                break;
+            case 4:
+                test_set_a[i] = 1;
+                test_set_b[i] = 0;
+                break;
+            default:
+                test_set_a[i] = 0;
+                test_set_b[i] = 0;
+                break;
+            }
+            if (test_set_a[i]) {
+                bt_insert(a, test_key_id(i), &test_set_a[i]);
+            }
+            if (test_set_b[i]) {
+                bt_insert(b, test_key_id(i), &test_set_b[i]);
+            }
+        }
+        if (!test_check_set_ops(a, b, names[pattern])) {
+            return bt_false;
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_set_ops(void)
+{
+    BT_Allocator allocator;
+    BT_Context a, b;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&a, 0, &allocator);
+    bt_create(&b, 0, &allocator);
+    result = test_set_ops_run(&a, &b);
+    bt_destroy(&a);
+    bt_destroy(&b);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+static bt_bool
+test_clear_run(BT_Context *btree)
+{
+    S32 usage_empty;
+    U32 i;
+#if defined(BT_REGION_NODES)
+    BT_NodeRegion region;
+    BT_Key *kept;
+    S32 usage_detached;
+#endif
+
+    /* NOTE(nick): Filter has room for every key, so it never grows. */
+    bt_bloom_enable(btree, TEST_KEY_COUNT * 2);
+    bt_key_cache_enable(btree, 64);
+    bt_write_buffer_enable(btree, 16);
+    /* NOTE(nick): Search stack of the tree only grows, the first fill sets its size. */
+    test_fill(btree, bt_true);
+    bt_clear(btree);
+    usage_empty = memory_usage;
+
+    /* NOTE(nick): Clear frees every node and drops pending writes, settings stay. */
+    for (i = 0; i < 3; ++i) {
+        test_fill(btree, i % 2 == 0);
+        bt_insert(btree, test_key_id(1) + 1, NULL);
+        if (bt_clear(btree) != BT_ERROR_Ok || memory_usage != usage_empty || btree->write_buffer.count != 0) {
+            printf("clear: nodes or pending writes left behind\n");
+            return bt_false;
+        }
+        x_memset(test_present, 0, sizeof(test_present));
+        if (!test_check_keys(btree, "clear") || btree->bloom.blocks == NULL || btree->bloom.key_count != 0 ||
+            btree->key_cache.entries == NULL || btree->write_buffer.messages == NULL) {
+            printf("clear: pass %u\n", i);
+            return bt_false;
+        }
+    }
+    test_fill(btree, bt_true);
+    if (!test_check_keys(btree, "clear reused")) {
+        return bt_false;
+    }
+
+#if defined(BT_REGION_NODES)
+    /* NOTE(nick): Detached slabs stay readable until the region is released, while the
+     * tree goes on with new ones. */
+    kept = bt_search(btree, test_key_id(7), bt_false);
+    usage_detached = memory_usage;
+    if (bt_clear_detached(btree, &region) != BT_ERROR_Ok || memory_usage != usage_detached || region.chunk_count == 0) {
+        printf("clear_detached: slabs didn't go to the region\n");
+        bt_region_release(&region);
+        return bt_false;
+    }
+    x_memset(test_present, 0, sizeof(test_present));
+    if (!test_check_keys(btree, "clear_detached")) {
+        bt_region_release(&region);
+        return bt_false;
+    }
+    test_fill(btree, bt_false);
+    if (!test_check_keys(btree, "clear_detached reused") || kept == NULL || kept->id != test_key_id(7)) {
+        printf("clear_detached: detached key changed\n");
+        bt_region_release(&region);
+        return bt_false;
+    }
+    usage_detached = memory_usage - (S32)(region.chunk_count * BT_POOL_CHUNK_NODES * sizeof(BT_Node) +
+                                          region.chunk_capacity * sizeof(BT_Node *));
+    bt_region_release(&region);
+    if (region.chunks != NULL || region.chunk_count != 0 || memory_usage != usage_detached) {
+        printf("region_release: slabs weren't freed\n");
+        return bt_false;
+    }
+    bt_region_release(&region);
+    if (!test_check_keys(btree, "region_release")) {
+        return bt_false;
+    }
+#endif
+    return bt_true;
+}
+
+static bt_bool
+test_clear(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    result = test_clear_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+static bt_bool
+test_clone_run(BT_Context *src, BT_Context *dst)
+{
+    static U8 present_src[TEST_KEY_COUNT + 1];
+    static U8 present_dst[TEST_KEY_COUNT + 1];
+    static U8 data[2];
+    BT_Key *key;
+    U32 i;
+
+    x_memset(test_present, 0, sizeof(test_present));
+    bt_destroy(dst);
+    if (bt_clone(src, dst) != BT_ERROR_Ok || !test_check_keys(dst, "clone empty")) {
+        return bt_false;
+    }
+
+    bt_set_node_search(src, BT_NODE_SEARCH_Interpolation);
+    bt_bloom_enable(src, TEST_KEY_COUNT * 2);
+    bt_key_cache_enable(src, 64);
+    bt_write_buffer_enable(src, 16);
+    test_fill(src, bt_true);
+    /* NOTE(nick): Pending write of src is applied before it gets copied. */
+    bt_upsert(src, test_key_id(3), &data[0]);
+
+    bt_destroy(dst);
+    if (bt_clone(src, dst) != BT_ERROR_Ok) {
+        printf("clone: failed\n");
+        return bt_false;
+    }
+    key = bt_search(dst, test_key_id(3), bt_false);
+    if (!test_check_keys(dst, "clone") || !test_check_summaries(dst, "clone") || key == NULL || key->data != &data[0]) {
+        return bt_false;
+    }
+    if (dst->node_search.mode != BT_NODE_SEARCH_Interpolation || dst->bloom.blocks == NULL ||
+        dst->bloom.blocks == src->bloom.blocks || dst->key_cache.entries == NULL || dst->write_buffer.messages == NULL) {
+        printf("clone: settings weren't copied\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Writes to the clone don't show up in src. */
+    x_memcpy(present_src, test_present, sizeof(present_src));
+    for (i = 0; i < TEST_KEY_COUNT; i += 3) {
+        bt_delete(dst, test_key_id(i));
+        test_present[i] = 0;
+    }
+    bt_upsert(dst, test_key_id(4), &data[1]);
+    if (!test_check_keys(dst, "clone changed") || !test_check_summaries(dst, "clone changed")) {
+        return bt_false;
+    }
+    x_memcpy(present_dst, test_present, sizeof(present_dst));
+    x_memcpy(test_present, present_src, sizeof(test_present));
+    key = bt_search(src, test_key_id(4), bt_false);
+    if (!test_check_keys(src, "clone source") || !test_check_summaries(src, "clone source") ||
+        key == NULL || key->data != NULL) {
+        printf("clone: writes to the clone changed the source\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): And the other way around. */
+    bt_delete_range(src, test_key_id(100), test_key_id(400));
+    test_forget_range(test_key_id(100), test_key_id(400));
+    for (i = 1; i < TEST_KEY_COUNT; i += 3) {
+        bt_upsert(src, test_key_id(i), &data[1]);
+        test_present[i] = 1;
+    }
+    if (!test_check_keys(src, "clone source changed") || !test_check_summaries(src, "clone source changed")) {
+        return bt_false;
+    }
+    x_memcpy(test_present, present_dst, sizeof(test_present));
+    key = bt_search(dst, test_key_id(7), bt_false);
+    if (!test_check_keys(dst, "clone after source") || !test_check_summaries(dst, "clone after source") ||
+        key == NULL || key->data != NULL) {
+        printf("clone: writes to the source changed the clone\n");
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_clone(void)
+{
+    BT_Allocator allocator;
+    BT_Context src, dst;
+    bt_bool result;
+#if defined(BT_AGGREGATES)
+    BT_Aggregate aggregate;
+#endif
+
+    test_init_allocator(&allocator);
+    bt_create(&src, 0, &allocator);
+    bt_create(&dst, 0, &allocator);
+#if defined(BT_AGGREGATES)
+    x_memset(&aggregate, 0, sizeof(aggregate));
+    aggregate.map = test_aggregate_map;
+    aggregate.combine = test_aggregate_combine;
+    bt_set_aggregate(&src, &aggregate);
+#endif
+    result = test_clone_run(&src, &dst);
+    bt_destroy(&src);
+    bt_destroy(&dst);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+#if defined(BT_HUGEPAGE_NODES)
+static bt_bool
+test_hugepage_run(BT_Context *btree, BT_HugepageHeap *heap)
+{
+    bt_u64 region_count;
+    U32 i;
+
+    test_fill(btree, bt_true);
+    if (heap->region_count == 0 || !test_check_keys(btree, "hugepage")) {
+        printf("hugepage: nodes didn't come from the heap\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Freed nodes are taken again before any new region gets mapped. */
+    region_count = heap->region_count;
+    for (i = 0; i < TEST_KEY_COUNT; i += 2) {
+        bt_delete(btree, test_key_id(i));
+        test_present[i] = 0;
+    }
+    if (!test_check_keys(btree, "hugepage deleted")) {
+        return bt_false;
+    }
+    test_fill(btree, bt_true);
+    if (heap->region_count != region_count || !test_check_keys(btree, "hugepage refilled")) {
+        printf("hugepage: freed nodes weren't reused\n");
+        return bt_false;
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_hugepage(void)
+{
+    /* NOTE(nick): HugeTLB falls back to transparent hugepages when no pages are reserved,
+     * NUMA policies are ignored by kernels without NUMA support. */
+    static const BT_HugepageMode modes[] = { BT_HUGEPAGE_Transparent, BT_HUGEPAGE_HugeTLB, BT_HUGEPAGE_Transparent };
+    static const BT_NumaPolicy policies[] = { BT_NUMA_Local, BT_NUMA_Local, BT_NUMA_Interleave };
+    BT_HugepageHeap heap;
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result = bt_true;
+    U32 i;
+
+    for (i = 0; i < x_countof(modes) && result; ++i) {
+        bt_hugepage_heap_init(&heap, modes[i], policies[i], 1);
+        allocator = bt_hugepage_allocator(&heap);
+        bt_create(&btree, 0, &allocator);
+        result = test_hugepage_run(&btree, &heap);
+        bt_destroy(&btree);
+        bt_hugepage_heap_release(&heap);
+        if (heap.regions != NULL || heap.region_count != 0) {
+            printf("hugepage: regions weren't released\n");
+            result = bt_false;
+        }
+    }
+    return result;
+}
+#else
+static bt_bool
+test_hugepage(void)
+{
+    return bt_true;
+}
+#endif
+
+#if defined(BT_EPOCH_RECLAMATION)
+static U32
+test_epoch_pending(BT_EpochThread *thread)
+{
+    BT_EpochLimbo *limbo;
+    U32 result = thread->retired_count;
+
+    for (limbo = thread->overflow; limbo != NULL; limbo = limbo->next) {
+        result += limbo->retired_count;
+    }
+    return result;
+}
+
+static bt_bool
+test_epoch_run(BT_Context *btree, BT_Epoch *epoch, BT_EpochThread *writer, BT_EpochThread *reader)
+{
+    bt_u64 global_epoch;
+    S32 usage;
+    U32 i, pending;
+
+    bt_epoch_attach(btree, writer);
+
+    /* NOTE(nick): Few enough nodes that retiring doesn't reclaim on its own. Nothing holds
+     * the epoch back, still the nodes wait until it moved on twice. */
+    for (i = 0; i <= BT_KEY_COUNT; ++i) {
+        bt_insert(btree, test_key_id(i), NULL);
+    }
+    usage = memory_usage;
+    global_epoch = epoch->global_epoch;
+    bt_delete_range(btree, 0, BT_INVALID_ID);
+    pending = writer->retired_count;
+    if (pending == 0 || memory_usage != usage || writer->retired[0].epoch != global_epoch) {
+        printf("epoch: deleted nodes weren't retired\n");
+        return bt_false;
+    }
+    if (bt_epoch_reclaim(writer) != pending || epoch->global_epoch != global_epoch + 1 || memory_usage != usage) {
+        printf("epoch: nodes were freed one epoch after they were retired\n");
+        return bt_false;
+    }
+    if (bt_epoch_reclaim(writer) != 0 || memory_usage >= usage) {
+        printf("epoch: nodes weren't freed two epochs after they were retired\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): A reader inside a critical section keeps the epoch from moving on twice,
+     * so nothing retired since it entered is freed. Limbo list runs over into blocks. */
+    for (i = 0; i < 65536; ++i) {
+        bt_insert(btree, (BT_KeyID)i * 7 + 1, NULL);
+    }
+    bt_epoch_enter(reader);
+    usage = memory_usage;
+    for (i = 0; i < 65536; i += 2) {
+        bt_delete(btree, (BT_KeyID)i * 7 + 1);
+    }
+    bt_delete_range(btree, 0, BT_INVALID_ID);
+    for (i = 0; i < 4; ++i) {
+        bt_epoch_reclaim(writer);
+    }
+    pending = test_epoch_pending(writer);
+    if (pending <= BT_EPOCH_LIMBO_COUNT || writer->overflow == NULL || memory_usage < usage) {
+        printf("epoch: nodes were freed while a reader could see them\n");
+        bt_epoch_exit(reader);
+        return bt_false;
+    }
+    bt_epoch_exit(reader);
+
+    /* NOTE(nick): Overflow blocks come back one by one once the reader left. */
+    i = 0;
+    while (i < 64 && bt_epoch_reclaim(writer) != 0) {
+        i += 1;
+    }
+    if (test_epoch_pending(writer) != 0 || writer->overflow != NULL || writer->overflow_last != NULL) {
+        printf("epoch: retired nodes weren't freed after the reader left\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Tree is still usable. bt_destroy retires what's left of it and
+     * bt_epoch_destroy frees that. */
+    test_fill(btree, bt_true);
+    return test_check_keys(btree, "epoch");
+}
+
+static bt_bool
+test_epoch(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    BT_Epoch epoch;
+    BT_EpochThread writer, reader;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    bt_epoch_init(&epoch);
+    bt_epoch_register(&epoch, &writer);
+    bt_epoch_register(&epoch, &reader);
+    result = test_epoch_run(&btree, &epoch, &writer, &reader);
+    bt_destroy(&btree);
+    bt_epoch_destroy(&epoch);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+#else
+static bt_bool
+test_epoch(void)
+{
+    return bt_true;
+}
+#endif
+
+#define TEST_PROBE_COUNT (TEST_KEY_COUNT * 3)
+
+typedef struct TestBatch {
+    BT_Context *btree;
+    const BT_KeyID *ids;
+    U8 seen[TEST_PROBE_COUNT];
+    U32 count;
+    U32 limit;
+    bt_bool ok;
+} TestBatch;
+
+BT_SEARCH_RESULT_SIG(test_batch_result)
+{
+    TestBatch *batch = (TestBatch *)user_context;
+
+    if (probe_index >= TEST_PROBE_COUNT || batch->seen[probe_index] || batch->ids[probe_index] != id ||
+        key != bt_search(batch->btree, id, bt_false)) {
+        batch->ok = bt_false;
+        return bt_false;
+    }
+    batch->seen[probe_index] = 1;
+    batch->count += 1;
+    return batch->count < batch->limit;
+}
+
+/* NOTE(nick): Every probe has to be reported once, with the key bt_search finds for it,
+ * unless the callback stopped the batch. */
+static bt_bool
+test_check_batch(BT_Context *btree, const BT_KeyID *ids, const char *name)
+{
+    static const U32 counts[] = {
+        0, 1, BT_SEARCH_BATCH_WIDTH, BT_SEARCH_BATCH_WIDTH + 1, BT_SEARCH_BATCH_WIDTH * 3 + 5, TEST_PROBE_COUNT
+    };
+    static TestBatch batch;
+    U32 c, l, i;
+
+    for (c = 0; c < x_countof(counts); ++c) {
+        for (l = 0; l < 2; ++l) {
+            x_memset(&batch, 0, sizeof(batch));
+            batch.btree = btree;
+            batch.ids = ids;
+            batch.limit = l ? BT_SEARCH_BATCH_WIDTH + 2 : 0xFFFFFFFF;
+            batch.ok = bt_true;
+            if (bt_search_batch(btree, ids, counts[c], &batch, test_batch_result) != BT_ERROR_Ok || !batch.ok) {
+                printf("%s: wrong result in a batch of %u\n", name, counts[c]);
+                return bt_false;
+            }
+            if (batch.count != ((counts[c] < batch.limit) ? counts[c] : batch.limit)) {
+                printf("%s: batch of %u reported %u probes\n", name, counts[c], batch.count);
+                return bt_false;
+            }
+            for (i = counts[c]; i < TEST_PROBE_COUNT; ++i) {
+                if (batch.seen[i]) {
+                    printf("%s: batch of %u went past its end\n", name, counts[c]);
+                    return bt_false;
+                }
+            }
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_search_batch_run(BT_Context *btree)
+{
+    static BT_KeyID ids[TEST_PROBE_COUNT];
+    U32 i;
+
+    /* NOTE(nick): Keys, misses in the gaps, repeats and both ends of the id range in
+     * random order, so lookups of one batch finish at different depths. */
+    for (i = 0; i < TEST_PROBE_COUNT; ++i) {
+        U32 k = test_random() % (TEST_KEY_COUNT + 1);
+
+        switch (test_random() % 4) {
+        case 0:  ids[i] = test_key_id(k) + 1; break;
+        case 1:  ids[i] = (test_random() % 2) ? 0 : BT_INVALID_ID; break;
+        default: ids[i] = test_key_id(k); break;
+        }
+    }
+
+    if (bt_search_batch(btree, ids, TEST_PROBE_COUNT, NULL, NULL) != BT_ERROR_OpDenied) {
+        printf("search_batch: missing callback wasn't denied\n");
+        return bt_false;
+    }
+    if (!test_check_batch(btree, ids, "search_batch empty")) {
+        return bt_false;
+    }
+    test_fill(btree, bt_true);
+    if (!test_check_batch(btree, ids, "search_batch")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Filtered probes are reported without a descent, pending writes are
+     * applied before the batch. */
+    bt_bloom_enable(btree, TEST_KEY_COUNT * 2);
+    bt_write_buffer_enable(btree, 16);
+    for (i = 0; i < TEST_KEY_COUNT; i += 5) {
+        bt_delete(btree, test_key_id(i));
+    }
+    return test_check_batch(btree, ids, "search_batch filtered");
+}
+
+static bt_bool
+test_search_batch(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    result = test_search_batch_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+static bt_bool
+test_pop_run(BT_Context *btree)
+{
+    BT_Key key;
+    S32 low, high;
+    U32 step, i;
+
+    for (step = 0; step < 2; ++step) {
+        for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+            bt_insert(btree, test_key_id(i), &test_present[i]);
+            test_present[i] = 1;
+        }
+
+        /* NOTE(nick): Pops from both ends until the tree is empty. Popped keys come back
+         * now and then, so the cached edge leaves have to follow merges and new keys. */
+        low = 0;
+        high = TEST_KEY_COUNT;
+        for (i = 0; low <= high; ++i) {
+            bt_bool last = (test_random() % 3 == 0);
+            S32 expected = last ? high : low;
+
+            BT_Key *key_out = step ? NULL : &key;
+
+            x_memset(&key, 0, sizeof(key));
+            if ((last ? bt_pop_max(btree, key_out) : bt_pop_min(btree, key_out)) != BT_ERROR_Ok ||
+                (step == 0 && (key.id != test_key_id(expected) || key.data != &test_present[expected]))) {
+                printf("pop: wrong %s key at pop %u\n", last ? "max" : "min", i);
+                return bt_false;
+            }
+            test_present[expected] = 0;
+            if (last) {
+                high -= 1;
+            } else {
+                low += 1;
+            }
+
+            if (i % 16 == 5 && low > 0) {
+                low -= 1;
+                bt_insert(btree, test_key_id(low), &test_present[low]);
+                test_present[low] = 1;
+            }
+            if (i % 32 == 7 && high < TEST_KEY_COUNT) {
+                high += 1;
+                bt_insert(btree, test_key_id(high), &test_present[high]);
+                test_present[high] = 1;
+            }
+            if (low <= high && (bt_min(btree) == NULL || bt_min(btree)->id != test_key_id(low) ||
+                                bt_max(btree) == NULL || bt_max(btree)->id != test_key_id(high))) {
+                printf("pop: stale min or max after pop %u\n", i);
+                return bt_false;
+            }
+            if (i % 8 == 0 && (!test_check_keys(btree, "pop") || !test_check_summaries(btree, "pop"))) {
+                printf("pop: pop %u\n", i);
+                return bt_false;
+            }
+        }
+
+        if (bt_pop_min(btree, &key) != BT_ERROR_IDNotFound || bt_pop_max(btree, &key) != BT_ERROR_IDNotFound ||
+            !test_check_keys(btree, "pop empty")) {
+            printf("pop: empty tree\n");
+            return bt_false;
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_pop(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree;
+    bt_bool result;
+#if defined(BT_AGGREGATES)
+    BT_Aggregate aggregate;
+#endif
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+#if defined(BT_AGGREGATES)
+    x_memset(&aggregate, 0, sizeof(aggregate));
+    aggregate.map = test_aggregate_map;
+    aggregate.combine = test_aggregate_combine;
+    bt_set_aggregate(&btree, &aggregate);
+#endif
+    result = test_pop_run(&btree);
+    bt_destroy(&btree);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
+/* NOTE(nick): Data of present key i of the reference set. */
+static const void *test_cache_data[TEST_KEY_COUNT + 1];
+
+static bt_bool
+test_check_key_cache(BT_Context *btree, const char *name)
+{
+    BT_Key *key;
+    U32 pass, i;
+
+    /* NOTE(nick): Second pass is served by the cache. */
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+            key = bt_search(btree, test_key_id(i), bt_false);
+            if (test_present[i] ? (key == NULL || key->id != test_key_id(i) || key->data != test_cache_data[i])
+                                : key != NULL) {
+                printf("%s: wrong lookup of key %u\n", name, i);
+                return bt_false;
+            }
+        }
+    }
+    return bt_true;
+}
+
+/* NOTE(nick): Neighbours of key k were in the nodes a merge next to k may have freed. */
+static bt_bool
+test_check_key_cache_near(BT_Context *btree, U32 k, const char *name)
+{
+    BT_Key *key;
+    U32 i;
+
+    for (i = (k < 4) ? 0 : k - 4; i <= k + 4 && i <= TEST_KEY_COUNT; ++i) {
+        key = bt_search(btree, test_key_id(i), bt_false);
+        if (test_present[i] ? (key == NULL || key->data != test_cache_data[i]) : key != NULL) {
+            printf("%s: wrong lookup of key %u after a write to key %u\n", name, i, k);
+            return bt_false;
+        }
+    }
+    return bt_true;
+}
+
+static bt_bool
+test_key_cache_run(BT_Context *btree, BT_Context *right)
+{
+    static U8 values[64];
+    static U8 saved[TEST_KEY_COUNT + 1];
+    BT_KeyCacheStats stats;
+    bt_bool finished = bt_false;
+    U32 step, i;
+
+    /* NOTE(nick): Small cache, so entries get overwritten by other ids all the time. */
+    bt_key_cache_enable(btree, 16);
+    x_memset(test_present, 0, sizeof(test_present));
+
+    /* NOTE(nick): Deletes merge and free nodes that inserts take again, entries that point
+     * into them must not hit. */
+    for (step = 0; step < 4096; ++step) {
+        U32 k = test_random() % (TEST_KEY_COUNT + 1);
+        const void *data = &values[test_random() % x_countof(values)];
+
+        switch (test_random() % 3) {
+        case 0:
+            bt_insert(btree, test_key_id(k), data);
+            if (!test_present[k]) {
+                test_cache_data[k] = data;
+            }
+            test_present[k] = 1;
+            break;
+        case 1:
+            bt_upsert(btree, test_key_id(k), data);
+            test_cache_data[k] = data;
+            test_present[k] = 1;
+            break;
+        default:
+            bt_delete(btree, test_key_id(k));
+            test_present[k] = 0;
+            break;
+        }
+        if (!test_check_key_cache_near(btree, k, "key_cache churn")) {
+            printf("key_cache: step %u\n", step);
+            return bt_false;
+        }
+        if (step % 128 == 0 && !test_check_key_cache(btree, "key_cache churn")) {
+            return bt_false;
+        }
+    }
+    bt_key_cache_get_stats(btree, &stats);
+    if (stats.hits == 0) {
+        printf("key_cache: no lookup hit the cache\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Every key cached, then deletes in scattered order. Freed nodes stay in
+     * the node cache with their old keys, as long as nothing takes them again. */
+    bt_key_cache_enable(btree, 4096);
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (!test_present[i]) {
+            bt_insert(btree, test_key_id(i), &values[i % x_countof(values)]);
+            test_cache_data[i] = &values[i % x_countof(values)];
+            test_present[i] = 1;
+        }
+    }
+    if (!test_check_key_cache(btree, "key_cache filled")) {
+        return bt_false;
+    }
+    /* NOTE(nick): Range deletes free whole nodes that still hold their keys. */
+    for (step = 0; step < 16; ++step) {
+        U32 k = (step * 97) % (TEST_KEY_COUNT - 16);
+
+        bt_delete_range(btree, test_key_id(k), test_key_id(k + 12));
+        test_forget_range(test_key_id(k), test_key_id(k + 12));
+        if (!test_check_key_cache(btree, "key_cache deleted range")) {
+            printf("key_cache: step %u\n", step);
+            return bt_false;
+        }
+    }
+    for (step = 0; step <= TEST_KEY_COUNT; ++step) {
+        U32 k = (step * 211) % (TEST_KEY_COUNT + 1);
+
+        bt_delete(btree, test_key_id(k));
+        test_present[k] = 0;
+        if (!test_check_key_cache_near(btree, k, "key_cache deleted")) {
+            printf("key_cache: step %u\n", step);
+            return bt_false;
+        }
+    }
+
+    /* NOTE(nick): Compaction merges leaves and, with slab nodes, moves them to other
+     * slots. Lookups in between go through the cache. */
+    for (i = 0; i <= TEST_KEY_COUNT; ++i) {
+        if (i % 3 != 0) {
+            bt_delete(btree, test_key_id(i));
+            test_present[i] = 0;
+        } else if (!test_present[i]) {
+            bt_insert(btree, test_key_id(i), &values[i % x_countof(values)]);
+            test_cache_data[i] = &values[i % x_countof(values)];
+            test_present[i] = 1;
+        }
+    }
+    for (step = 0; step < 32 * TEST_KEY_COUNT && !finished; ++step) {
+        if (!test_check_key_cache(btree, "key_cache compact")) {
+            return bt_false;
+        }
+        bt_compact(btree, 4, &finished);
+    }
+    if (!finished || !test_check_key_cache(btree, "key_cache compacted")) {
+        return bt_false;
+    }
+
+    /* NOTE(nick): Nodes that go to right by a split can't be reached through the cache of
+     * btree any more, and the other way around after the join. */
+    bt_destroy(right);
+    if (bt_split_at(btree, test_key_id(TEST_KEY_COUNT / 3), right) != BT_ERROR_Ok || right->key_cache.entries == NULL) {
+        printf("key_cache: split failed\n");
+        return bt_false;
+    }
+    x_memcpy(saved, test_present, sizeof(saved));
+    test_forget_range(test_key_id(TEST_KEY_COUNT / 3), BT_INVALID_ID);
+    if (!test_check_key_cache(btree, "key_cache split left")) {
+        return bt_false;
+    }
+    x_memcpy(test_present, saved, sizeof(saved));
+    test_forget_range(0, test_key_id(TEST_KEY_COUNT / 3) - 1);
+    if (!test_check_key_cache(right, "key_cache split right")) {
+        return bt_false;
+    }
+    x_memcpy(test_present, saved, sizeof(saved));
+    if (bt_join(btree, right) != BT_ERROR_Ok || !test_check_key_cache(btree, "key_cache joined") ||
+        bt_search(right, test_key_id(TEST_KEY_COUNT - 2), bt_false) != NULL) {
+        printf("key_cache: join\n");
+        return bt_false;
+    }
+
+    /* NOTE(nick): Pops, range deletes and clear free nodes in bulk. */
+    for (step = 0; step < 16; ++step) {
+        bt_pop_min(btree, NULL);
+        test_present[test_next_present(0)] = 0;
+        bt_pop_max(btree, NULL);
+        test_present[test_prev_present(TEST_KEY_COUNT)] = 0;
+    }
+    bt_delete_range(btree, test_key_id(100), test_key_id(300));
+    test_forget_range(test_key_id(100), test_key_id(300));
+    if (!test_check_key_cache(btree, "key_cache popped") || !test_check_keys(btree, "key_cache popped")) {
+        return bt_false;
+    }
+    bt_clear(btree);
+    x_memset(test_present, 0, sizeof(test_present));
+    return test_check_key_cache(btree, "key_cache cleared");
+}
+
+static bt_bool
+test_key_cache(void)
+{
+    BT_Allocator allocator;
+    BT_Context btree, right;
+    bt_bool result;
+
+    test_init_allocator(&allocator);
+    bt_create(&btree, 0, &allocator);
+    bt_create(&right, 0, &allocator);
+    result = test_key_cache_run(&btree, &right);
+    bt_destroy(&btree);
+    bt_destroy(&right);
+
+    x_assert(memory_usage == 0);
+    return result;
+}
+
 int 
 main(int argc, char *argv[])
 {
@@ -156,7 +2840,11 @@ main(int argc, char *argv[])
             break;
         }
     }
-    if (i == x_countof(ids)) {
+    if (i == x_countof(ids) && test_delete_range() && test_sharded() && test_node_search() &&
+        test_unsorted_leaves() && test_radix_engine() && test_compact() && test_insert_or_get() &&
+        test_seeks() && test_bloom() && test_write_buffer() && test_freeze() && test_split_join() &&
+        test_set_ops() && test_clear() && test_clone() && test_hugepage() && test_epoch() &&
+        test_search_batch() && test_pop() && test_key_cache()) {
         printf("-------------------------\n");
         printf("All tests passed!\n");
     }